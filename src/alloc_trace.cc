@@ -0,0 +1,314 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Records allocations and deallocations to a file; see
+// google/alloc_trace.h for how to use it and alloc_trace_format.h for
+// what the file looks like.
+//
+// Both hooks encode their event into the buffer of one of kSlots
+// slots, picked by thread, so threads rarely share a slot lock.  Each
+// event takes the next number from last_seq, which puts it in order
+// with the events of every other slot: an allocation's new hook runs
+// before malloc() returns and a deallocation's delete hook runs before
+// the memory is freed, so the trace never shows an address being
+// handed out again before it was freed.
+//
+// A slot has two blocks.  When the one being filled is full, the hook
+// switches the slot to the other one and writes the full block out
+// after dropping the slot lock.  Writes are serialized by write_lock,
+// which the hook takes before it drops the slot lock; so once the hook
+// holds write_lock, the previous write of the slot's other block is
+// over, and once AllocTraceStop() has been through every slot and
+// taken write_lock, every block handed off has been written.
+
+#include "config.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <google/alloc_trace.h>
+#include <google/malloc_hook.h>
+#include "alloc_trace_format.h"
+#include "base/atomicops.h"
+#include "base/basictypes.h"
+#include "base/cycleclock.h"
+#include "base/googleinit.h"
+#include "base/logging.h"
+#include "base/spinlock.h"
+#include "base/sysinfo.h"
+#include "malloc_hook-inl.h"
+#include "maybe_threads.h"
+#include "tcmalloc_guard.h"
+#include "thread_cache.h"
+
+#ifndef PATH_MAX
+#ifdef MAXPATHLEN
+#define PATH_MAX        MAXPATHLEN
+#else
+#define PATH_MAX        4096         // seems conservative for max filename len!
+#endif
+#endif
+
+using tcmalloc::alloc_trace::BlockHeader;
+using tcmalloc::alloc_trace::Encoder;
+using tcmalloc::alloc_trace::Event;
+using tcmalloc::alloc_trace::FileHeader;
+using tcmalloc::alloc_trace::kMaxEventBytes;
+
+static const int kSlotBits = 5;
+static const int kSlots = 1 << kSlotBits;
+static const size_t kBlockBytes = 16 << 10;
+
+struct TraceSlot {
+  // Does nothing, so that it does not matter when it runs
+  TraceSlot() : lock(base::LINKER_INITIALIZED) { }
+
+  SpinLock lock;
+  // All protected by lock.  "used" counts the BlockHeader at the front
+  // of the block being filled.
+  int current;
+  size_t used;
+  Encoder encoder;
+  char blocks[2][kBlockBytes];
+};
+
+static TraceSlot slots[kSlots];
+
+// Taken by AllocTraceStart() and AllocTraceStop()
+static SpinLock trace_lock(SpinLock::LINKER_INITIALIZED);
+
+// Serializes writes to trace_fd.  trace_fd is valid while recording,
+// and changed with both trace_lock and write_lock held.
+static SpinLock write_lock(SpinLock::LINKER_INITIALIZED);
+static RawFD trace_fd = kIllegalRawFD;
+
+// Non-zero while the hooks should record.  Read under the slot locks.
+static volatile Atomic32 recording = 0;
+
+// The number of the last event.  Pointer-sized, so in a 32-bit program
+// a trace of more than 2^32 events cannot be put back in order.
+static volatile AtomicWord last_seq = 0;
+
+// The hooks we replaced, which ours call in turn
+static MallocHook::NewHook old_new_hook = NULL;
+static MallocHook::DeleteHook old_delete_hook = NULL;
+
+// Threads are numbered from 1 in the order they first show up
+static Atomic32 next_thread_id = 0;
+#ifdef HAVE_TLS
+static __thread uint32 thread_id
+# ifdef HAVE___ATTRIBUTE__
+   __attribute__ ((tls_model ("initial-exec")))
+# endif
+   ;
+#endif
+
+static uint32 CurrentThreadId() {
+#ifdef HAVE_TLS
+  if (tcmalloc::KernelSupportsTLS()) {
+    if (thread_id == 0) {
+      thread_id = base::subtle::NoBarrier_AtomicIncrement(&next_thread_id, 1);
+    }
+    return thread_id;
+  }
+#endif
+#ifdef HAVE_PTHREAD
+  // Without TLS fall back to the (larger, but still distinct) thread handle
+  return static_cast<uint32>((uintptr_t)pthread_self());
+#else
+  return 0;
+#endif
+}
+
+static TraceSlot* SlotForThread(uint32 thread) {
+  // Thread numbers may be small and dense, or aligned pointers
+  return &slots[(thread * 0x9E3779B1u) >> (32 - kSlotBits)];
+}
+
+// REQUIRES: slot->lock held
+static void ResetSlot(TraceSlot* slot) {
+  slot->used = sizeof(BlockHeader);
+  slot->encoder.Reset();
+}
+
+// Fills in the BlockHeader of the block being filled, and returns the
+// bytes to write.
+// REQUIRES: slot->lock held
+static size_t FinishBlock(TraceSlot* slot) {
+  BlockHeader header;
+  header.bytes = static_cast<uint32>(slot->used - sizeof(header));
+  memcpy(slot->blocks[slot->current], &header, sizeof(header));
+  return slot->used;
+}
+
+// Switches "slot" to its other block, and writes out the full one
+// after unlocking the slot.
+// REQUIRES: slot->lock held, recording
+static void FlushSlotAndUnlock(TraceSlot* slot) {
+  const char* full = slot->blocks[slot->current];
+  const size_t bytes = FinishBlock(slot);
+  write_lock.Lock();
+  slot->current ^= 1;
+  ResetSlot(slot);
+  slot->lock.Unlock();
+  RawWrite(trace_fd, full, bytes);
+  write_lock.Unlock();
+}
+
+static void RecordEvent(tcmalloc::alloc_trace::Op op,
+                        const void* ptr, size_t size) {
+  if (ptr == NULL) return;
+  Event e;
+  e.op = op;
+  e.thread = CurrentThreadId();
+  e.address = reinterpret_cast<uintptr_t>(ptr);
+  e.size = size;
+  TraceSlot* slot = SlotForThread(e.thread);
+  slot->lock.Lock();
+  if (!base::subtle::Acquire_Load(&recording)) {
+    slot->lock.Unlock();              // stopped since the hook ran
+    return;
+  }
+  // Taken under the slot lock, so the numbers rise within each block
+  e.seq = static_cast<uintptr_t>(
+      base::subtle::Barrier_AtomicIncrement(&last_seq, 1));
+  e.cycles = CycleClock::Now();
+  slot->used += slot->encoder.Encode(
+      e, slot->blocks[slot->current] + slot->used);
+  if (slot->used + kMaxEventBytes > kBlockBytes) {
+    FlushSlotAndUnlock(slot);
+  } else {
+    slot->lock.Unlock();
+  }
+}
+
+static void TraceNewHook(const void* ptr, size_t size) {
+  RecordEvent(tcmalloc::alloc_trace::kMalloc, ptr, size);
+  if (old_new_hook != NULL) (*old_new_hook)(ptr, size);
+}
+
+static void TraceDeleteHook(const void* ptr) {
+  RecordEvent(tcmalloc::alloc_trace::kFree, ptr, 0);
+  if (old_delete_hook != NULL) (*old_delete_hook)(ptr);
+}
+
+extern "C" int AllocTraceStart(const char* filename) {
+  // This may read /proc, so do it before our hooks are installed
+  const double cycles_per_second = CyclesPerSecond();
+
+  SpinLockHolder h(&trace_lock);
+  if (trace_fd != kIllegalRawFD) return 0;
+  const RawFD fd = RawOpenForWriting(filename);
+  if (fd == kIllegalRawFD) {
+    RAW_LOG(WARNING, "AllocTrace: cannot open %s", filename);
+    return 0;
+  }
+  FileHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, tcmalloc::alloc_trace::kMagic, sizeof(header.magic));
+  header.version = tcmalloc::alloc_trace::kVersion;
+  header.cycles_per_second = cycles_per_second;
+  RawWrite(fd, reinterpret_cast<const char*>(&header), sizeof(header));
+
+  for (int i = 0; i < kSlots; i++) {
+    SpinLockHolder l(&slots[i].lock);
+    slots[i].current = 0;
+    ResetSlot(&slots[i]);
+  }
+  {
+    SpinLockHolder l(&write_lock);
+    trace_fd = fd;
+  }
+  base::subtle::Release_Store(&recording, 1);
+  // A previous AllocTraceStop() leaves our hooks in place if someone
+  // chained onto them, and then they are already running.
+  if (MallocHook::GetNewHook() != &TraceNewHook) {
+    old_new_hook = MallocHook::SetNewHook(&TraceNewHook);
+  }
+  if (MallocHook::GetDeleteHook() != &TraceDeleteHook) {
+    old_delete_hook = MallocHook::SetDeleteHook(&TraceDeleteHook);
+  }
+  return 1;
+}
+
+extern "C" void AllocTraceStop() {
+  SpinLockHolder h(&trace_lock);
+  if (trace_fd == kIllegalRawFD) return;
+  // Only take our hooks out if nobody has installed theirs on top.
+  // Hooks still running see trace_fd closed and record nothing.
+  if (MallocHook::GetNewHook() == &TraceNewHook) {
+    MallocHook::SetNewHook(old_new_hook);
+  }
+  if (MallocHook::GetDeleteHook() == &TraceDeleteHook) {
+    MallocHook::SetDeleteHook(old_delete_hook);
+  }
+  base::subtle::Release_Store(&recording, 0);
+  for (int i = 0; i < kSlots; i++) {
+    TraceSlot* slot = &slots[i];
+    SpinLockHolder l(&slot->lock);
+    if (slot->used > sizeof(BlockHeader)) {
+      const size_t bytes = FinishBlock(slot);
+      SpinLockHolder w(&write_lock);
+      RawWrite(trace_fd, slot->blocks[slot->current], bytes);
+    }
+    ResetSlot(slot);
+  }
+  // Waits for the blocks that hooks handed off to be written
+  SpinLockHolder w(&write_lock);
+  RawClose(trace_fd);
+  trace_fd = kIllegalRawFD;
+}
+
+static void AllocTraceInit() {
+  char fname[PATH_MAX];
+  if (!GetUniquePathFromEnv("TCMALLOC_TRACE_FILE", fname)) {
+    return;
+  }
+  // We do a uid check so we don't write out files in a setuid executable.
+#ifdef HAVE_GETEUID
+  if (getuid() != geteuid()) {
+    RAW_LOG(WARNING, ("AllocTrace: ignoring TCMALLOC_TRACE_FILE because "
+                      "program seems to be setuid\n"));
+    return;
+  }
+#endif
+  AllocTraceStart(fname);
+}
+
+// Writes out the rest of the trace at program exit
+struct AllocTraceEndWriter {
+  ~AllocTraceEndWriter() { AllocTraceStop(); }
+};
+
+// We want to make sure tcmalloc is up and running before we start
+static const TCMallocGuard tcmalloc_initializer;
+REGISTER_MODULE_INITIALIZER(alloc_trace, AllocTraceInit());
+static AllocTraceEndWriter alloc_trace_end_writer;
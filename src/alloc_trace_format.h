@@ -0,0 +1,243 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// The file format written by the allocation trace recorder
+// (alloc_trace.cc) and read by alloc_trace_replay.
+//
+// A trace is a FileHeader followed by blocks.  Each block is a
+// BlockHeader giving its length, followed by a stream of events.  Each
+// event is an op byte followed by varints:
+//
+//    op  thread  seq  cycles  address  [size]
+//
+// "thread" is a small number naming the recording thread, and "seq"
+// numbers the events of the whole trace in the order they happened.
+// The recorder fills a block per group of threads, so blocks interleave
+// in the file; sort the events by "seq" (DecodeTrace() does) to get
+// them in order, in which an address is never freed before the event
+// that allocated it.  Within a block, "seq" and "cycles" (the CycleClock
+// time) are the differences from the previous event, and "address" is
+// the zigzag-encoded difference from the previous event's address.
+// Only kMalloc events carry a size.  Most events take 7-12 bytes.
+// Integers in the headers are in the byte order of the recording
+// machine.
+
+#ifndef TCMALLOC_ALLOC_TRACE_FORMAT_H_
+#define TCMALLOC_ALLOC_TRACE_FORMAT_H_
+
+#include "config.h"
+#include <stddef.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+#include "base/basictypes.h"
+
+namespace tcmalloc {
+namespace alloc_trace {
+
+static const char kMagic[8] = { 't', 'c', 'm', 't', 'r', 'a', 'c', 'e' };
+static const uint32 kVersion = 2;
+
+struct FileHeader {
+  char   magic[8];
+  uint32 version;
+  uint32 reserved;
+  double cycles_per_second;
+};
+
+struct BlockHeader {
+  uint32 bytes;         // of the events that follow
+};
+
+enum Op {
+  kMalloc = 0,
+  kFree   = 1
+};
+
+struct Event {
+  Op     op;
+  uint32 thread;
+  uint64 seq;           // position in the whole trace
+  uint64 cycles;        // absolute CycleClock time
+  uint64 address;
+  uint64 size;          // kMalloc only
+};
+
+// Six varints of at most 10 bytes each, plus the op byte
+static const int kMaxEventBytes = 1 + 6 * 10;
+
+inline char* PutVarint(char* p, uint64 v) {
+  while (v >= 0x80) {
+    *p++ = static_cast<char>(v | 0x80);
+    v >>= 7;
+  }
+  *p++ = static_cast<char>(v);
+  return p;
+}
+
+// Returns NULL if the varint runs past "limit"
+inline const char* GetVarint(const char* p, const char* limit, uint64* v) {
+  uint64 result = 0;
+  for (int shift = 0; p < limit && shift < 64; shift += 7) {
+    const uint64 byte = static_cast<unsigned char>(*p++);
+    result |= (byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      *v = result;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+// Turns each event of a block into bytes.  Remembers the previous
+// event's sequence number, time and address, so the events must be
+// encoded in order, and Reset() at the start of each block.
+class Encoder {
+ public:
+  void Reset() {
+    last_seq_ = 0;
+    last_cycles_ = 0;
+    last_address_ = 0;
+  }
+
+  // Writes at most kMaxEventBytes to "buf", and returns the count
+  int Encode(const Event& e, char* buf) {
+    char* p = buf;
+    *p++ = static_cast<char>(e.op);
+    p = PutVarint(p, e.thread);
+    p = PutVarint(p, e.seq - last_seq_);
+    last_seq_ = e.seq;
+    // CycleClock may step backwards when we move between CPUs
+    p = PutVarint(p, e.cycles > last_cycles_ ? e.cycles - last_cycles_ : 0);
+    if (e.cycles > last_cycles_) last_cycles_ = e.cycles;
+    const int64 delta = static_cast<int64>(e.address - last_address_);
+    p = PutVarint(p, (static_cast<uint64>(delta) << 1) ^
+                     static_cast<uint64>(delta >> 63));
+    last_address_ = e.address;
+    if (e.op == kMalloc) {
+      p = PutVarint(p, e.size);
+    }
+    return static_cast<int>(p - buf);
+  }
+
+ private:
+  uint64 last_seq_;
+  uint64 last_cycles_;
+  uint64 last_address_;
+};
+
+// The inverse of Encoder, for the events of one block
+class Decoder {
+ public:
+  Decoder() : last_seq_(0), last_cycles_(0), last_address_(0) { }
+
+  // Reads one event starting at "p".  Returns the start of the next
+  // event, or NULL if the bytes before "limit" do not hold a whole
+  // valid event.
+  const char* Decode(const char* p, const char* limit, Event* e) {
+    if (p >= limit) return NULL;
+    const int op = static_cast<unsigned char>(*p++);
+    if (op != kMalloc && op != kFree) return NULL;
+    e->op = static_cast<Op>(op);
+    uint64 thread, seq, cycles, zigzag;
+    if ((p = GetVarint(p, limit, &thread)) == NULL) return NULL;
+    if ((p = GetVarint(p, limit, &seq)) == NULL) return NULL;
+    if ((p = GetVarint(p, limit, &cycles)) == NULL) return NULL;
+    if ((p = GetVarint(p, limit, &zigzag)) == NULL) return NULL;
+    e->size = 0;
+    if (e->op == kMalloc) {
+      if ((p = GetVarint(p, limit, &e->size)) == NULL) return NULL;
+    }
+    e->thread = static_cast<uint32>(thread);
+    last_seq_ += seq;
+    e->seq = last_seq_;
+    last_cycles_ += cycles;
+    e->cycles = last_cycles_;
+    last_address_ += (zigzag >> 1) ^ (~(zigzag & 1) + 1);
+    e->address = last_address_;
+    return p;
+  }
+
+ private:
+  uint64 last_seq_;
+  uint64 last_cycles_;
+  uint64 last_address_;
+};
+
+// Returns true if "header" starts a trace this code can read
+inline bool ValidHeader(const FileHeader& header) {
+  return (memcmp(header.magic, kMagic, sizeof(kMagic)) == 0 &&
+          header.version == kVersion);
+}
+
+inline bool EventBefore(const Event& a, const Event& b) {
+  return a.seq < b.seq;
+}
+
+// Decodes the blocks from "p" up to "limit" (everything after the
+// FileHeader) and appends their events to "events", in the order they
+// happened.  Returns false if the trace ends part-way through a block
+// or holds a malformed event, after appending the events before that.
+inline bool DecodeTrace(const char* p, const char* limit,
+                        std::vector<Event>* events) {
+  const size_t first = events->size();
+  bool whole = true;
+  while (p < limit) {
+    BlockHeader block;
+    if (limit - p < static_cast<ptrdiff_t>(sizeof(block))) {
+      whole = false;
+      break;
+    }
+    memcpy(&block, p, sizeof(block));
+    p += sizeof(block);
+    if (static_cast<size_t>(limit - p) < block.bytes) {
+      whole = false;
+      break;
+    }
+    const char* block_limit = p + block.bytes;
+    Decoder decoder;
+    Event e;
+    while (p < block_limit) {
+      if ((p = decoder.Decode(p, block_limit, &e)) == NULL) {
+        whole = false;
+        break;
+      }
+      events->push_back(e);
+    }
+    if (p == NULL) break;
+  }
+  std::sort(events->begin() + first, events->end(), EventBefore);
+  return whole;
+}
+
+}  // namespace alloc_trace
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_ALLOC_TRACE_FORMAT_H_
@@ -184,9 +184,11 @@ struct CompileAssert {
 #ifdef HAVE___ATTRIBUTE__
 # define ATTRIBUTE_WEAK      __attribute__((weak))
 # define ATTRIBUTE_NOINLINE  __attribute__((noinline))
+# define ATTRIBUTE_ALWAYS_INLINE  __attribute__((always_inline))
 #else
 # define ATTRIBUTE_WEAK
 # define ATTRIBUTE_NOINLINE
+# define ATTRIBUTE_ALWAYS_INLINE
 #endif
 
 // Section attributes are supported for both ELF and Mach-O, but in
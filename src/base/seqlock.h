@@ -0,0 +1,96 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// A sequence lock lets readers take a consistent copy of some data
+// without ever making its writers wait.  Writers must already be
+// serialized among themselves by some other means, typically by always
+// holding the same SpinLock.  A writer brackets each update:
+//
+//    seq.BeginWrite();
+//    counter_a += n;
+//    counter_b -= n;
+//    seq.EndWrite();
+//
+// and a reader copies the data until it gets a copy that no writer
+// touched in the meantime:
+//
+//    Atomic32 s;
+//    do {
+//      s = seq.BeginRead();
+//      a = counter_a;
+//      b = counter_b;
+//    } while (seq.RetryRead(s));
+//
+// Readers may see torn values inside the loop, so they must only copy
+// plain data there, and never follow pointers.
+
+#ifndef BASE_SEQLOCK_H_
+#define BASE_SEQLOCK_H_
+
+#include "config.h"
+#include "base/basictypes.h"
+#include "base/atomicops.h"
+
+class SeqLock {
+ public:
+  SeqLock() : seq_(0) { }
+
+  // For static SeqLock objects; see SpinLock(base::LinkerInitialized).
+  explicit SeqLock(base::LinkerInitialized /*x*/) {
+    // Does nothing; seq_ is already initialized
+  }
+
+  // The sequence number is odd while a write is in progress.  The
+  // store of the odd value must be visible before any of the data
+  // stores, hence the full barrier in Acquire_Store().
+  void BeginWrite() {
+    base::subtle::Acquire_Store(&seq_, seq_ + 1);
+  }
+  void EndWrite() {
+    base::subtle::Release_Store(&seq_, seq_ + 1);
+  }
+
+  Atomic32 BeginRead() const {
+    return base::subtle::Acquire_Load(&seq_);
+  }
+
+  // Returns true if the data copied since BeginRead() returned "seq"
+  // may be inconsistent, and should be copied again.
+  bool RetryRead(Atomic32 seq) const {
+    return (seq & 1) != 0 || base::subtle::Release_Load(&seq_) != seq;
+  }
+
+ private:
+  volatile Atomic32 seq_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(SeqLock);
+};
+
+#endif  // BASE_SEQLOCK_H_
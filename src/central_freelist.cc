@@ -31,18 +31,89 @@
 // Author: Sanjay Ghemawat <opensource@google.com>
 
 #include "config.h"
+#include <errno.h>
 #include "central_freelist.h"
 
+#include "base/commandlineflags.h"
 #include "linked_list.h"
 #include "static_vars.h"
 
+DEFINE_bool(tcmalloc_color_objects,
+            EnvToBool("TCMALLOC_COLOR_OBJECTS", false),
+            "Stagger the first object of successive spans of the same size"
+            " class by a cache line, for classes whose objects would"
+            " otherwise map to the same cache sets.  May cost one object"
+            " per span for some classes; see SizeMap::class_to_colors().");
+DEFINE_bool(tcmalloc_bitmap_spans,
+            EnvToBool("TCMALLOC_BITMAP_SPANS", false),
+            "Keep track of the free objects of newly populated central"
+            " free-list spans with a bitmap in the span metadata, instead"
+            " of a linked list threaded through the free objects.  Then"
+            " neither populating a span nor returning objects to it"
+            " touches the object memory.");
+DEFINE_int32(tcmalloc_empty_span_reserve,
+             EnvToInt("TCMALLOC_EMPTY_SPAN_RESERVE", 2),
+             "Number of completely free spans each size class keeps,"
+             " already carved into objects, before it returns them to"
+             " the page heap.  Saves carving and coalescing spans over"
+             " and over when a class's usage oscillates.");
+
 namespace tcmalloc {
 
-void CentralFreeList::Init(size_t cl) {
+// Number of objects carved out of "span" by Populate()
+static size_t ObjectsInSpan(const Span* span) {
+  const size_t bytes = (span->length << kPageShift) -
+                       span->color * kCacheLineSize;
+  return bytes / Static::sizemap()->ByteSizeForClass(span->sizeclass);
+}
+
+// Index of the lowest set bit of "word", which must not be zero
+static inline int FindFirstSet(uint64_t word) {
+#if defined(__GNUC__)
+  return __builtin_ctzll(word);
+#else
+  int n = 0;
+  while ((word & 1) == 0) {
+    word >>= 1;
+    n++;
+  }
+  return n;
+#endif
+}
+
+// Address of the first object of "span"
+static inline char* SpanObjectBase(const Span* span) {
+  return reinterpret_cast<char*>(span->start << kPageShift) +
+         span->color * kCacheLineSize;
+}
+
+void CentralFreeList::Init(size_t cl, bool long_lived) {
   size_class_ = cl;
+  long_lived_ = long_lived;
+  size_reciprocal_ = 0;
+  if (cl > 0) {
+    // Objects of a class spanning several pages are larger than a page
+    // divided by the number of pages, so no span has more objects than
+    // a single page of kAlignment-sized ones, which SpanBitmap covers.
+    const size_t size = Static::sizemap()->ByteSizeForClass(cl);
+    const size_t span_bytes =
+        Static::sizemap()->class_to_pages(cl) << kPageShift;
+    CHECK_CONDITION(span_bytes / size <= SpanBitmap::kWords * 64);
+    size_reciprocal_ = static_cast<uint32_t>(
+        ((static_cast<uint64_t>(1) << 32) + size - 1) / size);
+  }
   tcmalloc::DLL_Init(&empty_);
   tcmalloc::DLL_Init(&nonempty_);
+  tcmalloc::DLL_Init(&reserve_);
   counter_ = 0;
+  span_objects_ = 0;
+  next_color_ = 0;
+  reserve_count_ = 0;
+  populated_spans_ = 0;
+  reused_spans_ = 0;
+  returned_spans_ = 0;
+  thrashed_spans_ = 0;
+  unrepaid_returns_ = 0;
 
   cache_size_ = 1;
   used_slots_ = 0;
@@ -57,6 +128,15 @@ void CentralFreeList::ReleaseListToSpans(void* start) {
   }
 }
 
+size_t CentralFreeList::ObjectIndex(const Span* span,
+                                    const void* object) const {
+  // The offset is a multiple of the object size and far below 2^32, so
+  // multiplying by the rounded-up reciprocal of the size is exact.
+  const uint64_t offset = static_cast<const char*>(object) -
+                          SpanObjectBase(span);
+  return static_cast<size_t>((offset * size_reciprocal_) >> 32);
+}
+
 void CentralFreeList::ReleaseToSpans(void* object) {
   const PageID p = reinterpret_cast<uintptr_t>(object) >> kPageShift;
   Span* span = Static::pageheap()->GetDescriptor(p);
@@ -64,46 +144,96 @@ void CentralFreeList::ReleaseToSpans(void* object) {
   ASSERT(span->refcount > 0);
 
   // If span is empty, move it to non-empty list
-  if (span->objects == NULL) {
+  const bool span_empty = (span->has_bitmap
+                           ? span->refcount == span->bitmap_objects
+                           : span->objects == NULL);
+  if (span_empty) {
     tcmalloc::DLL_Remove(span);
     tcmalloc::DLL_Prepend(&nonempty_, span);
     Event(span, 'N', 0);
   }
 
   // The following check is expensive, so it is disabled by default
-  if (false) {
+  if (false && !span->has_bitmap) {
     // Check that object does not occur in list
     int got = 0;
     for (void* p = span->objects; p != NULL; p = *((void**) p)) {
       ASSERT(p != object);
       got++;
     }
-    ASSERT(got + span->refcount ==
-           (span->length<<kPageShift) /
-           Static::sizemap()->ByteSizeForClass(span->sizeclass));
+    ASSERT(got + span->refcount == ObjectsInSpan(span));
   }
 
   counter_++;
   span->refcount--;
+  if (span->has_bitmap) {
+    SpanBitmap* bitmap = span->bitmap;
+    const size_t index = ObjectIndex(span, object);
+    const size_t w = index / 64;
+    const uint64_t bit = static_cast<uint64_t>(1) << (index % 64);
+    ASSERT(index < span->bitmap_objects);
+    ASSERT((bitmap->words[w] & bit) == 0);
+    bitmap->words[w] |= bit;
+    if (w < span->bitmap_hint) span->bitmap_hint = w;
+  } else {
+    *(reinterpret_cast<void**>(object)) = span->objects;
+    span->objects = object;
+  }
+
   if (span->refcount == 0) {
+    // Keep the span, still carved up, in case we need it again soon.
+    // If that makes the reserve too big, the span that has been there
+    // longest goes back to the page heap.
     Event(span, '#', 0);
-    counter_ -= ((span->length<<kPageShift) /
-                 Static::sizemap()->ByteSizeForClass(span->sizeclass));
     tcmalloc::DLL_Remove(span);
+    tcmalloc::DLL_Prepend(&reserve_, span);
+    reserve_count_++;
+    if (reserve_count_ > FLAGS_tcmalloc_empty_span_reserve) {
+      ReturnSpan(reserve_.prev);
+    }
+  }
+}
 
-    // Release central list lock while operating on pageheap
-    lock_.Unlock();
-    {
-      SpinLockHolder h(Static::pageheap_lock());
-      Static::pageheap()->Delete(span);
+void CentralFreeList::ReturnSpan(Span* span) {
+  ASSERT(span->refcount == 0);
+  counter_ -= ObjectsInSpan(span);
+  span_objects_ -= ObjectsInSpan(span);
+  tcmalloc::DLL_Remove(span);
+  reserve_count_--;
+  returned_spans_++;
+  unrepaid_returns_++;
+
+  // Release central list lock while operating on pageheap
+  lock_.Unlock();
+  {
+    TimedSpinLockHolder h(Static::pageheap_lock());
+    if (span->has_bitmap) {
+      Static::span_bitmap_allocator()->Delete(span->bitmap);
+      span->has_bitmap = 0;
+      span->objects = NULL;
     }
-    lock_.Lock();
-  } else {
-    *(reinterpret_cast<void**>(object)) = span->objects;
-    span->objects = object;
+    Static::pageheap()->Delete(span);
+  }
+  lock_.Lock();
+}
+
+void CentralFreeList::ReleaseReserve() {
+  SpinLockHolder h(&lock_);
+  // ReturnSpan() drops lock_, so look at the list afresh every time
+  while (!tcmalloc::DLL_IsEmpty(&reserve_)) {
+    ReturnSpan(reserve_.prev);
   }
 }
 
+void CentralFreeList::GetSpanStats(SpanStats* stats) {
+  SpinLockHolder h(&lock_);
+  stats->reserved = reserve_count_;
+  stats->populated = populated_spans_;
+  stats->reused = reused_spans_;
+  stats->returned = returned_spans_;
+  stats->thrashed = thrashed_spans_;
+}
+
 bool CentralFreeList::EvictRandomSizeClass(
     int locked_size_class, bool force) {
   static int race_counter = 0;
@@ -233,7 +363,16 @@ int CentralFreeList::RemoveRange(void **start, void **end, int N) {
 void* CentralFreeList::FetchFromSpansSafe() {
   void *t = FetchFromSpans();
   if (!t) {
-    Populate();
+    if (!tcmalloc::DLL_IsEmpty(&reserve_)) {
+      // Our most recently emptied span is the likeliest to be cached
+      Span* span = reserve_.next;
+      tcmalloc::DLL_Remove(span);
+      tcmalloc::DLL_Prepend(&nonempty_, span);
+      reserve_count_--;
+      reused_spans_++;
+    } else {
+      Populate();
+    }
     t = FetchFromSpans();
   }
   return t;
@@ -243,11 +382,31 @@ void* CentralFreeList::FetchFromSpans() {
   if (tcmalloc::DLL_IsEmpty(&nonempty_)) return NULL;
   Span* span = nonempty_.next;
 
-  ASSERT(span->objects != NULL);
+  void* result;
+  bool span_empty;
   span->refcount++;
-  void* result = span->objects;
-  span->objects = *(reinterpret_cast<void**>(result));
-  if (span->objects == NULL) {
+  if (span->has_bitmap) {
+    // Take the lowest free object, so that objects are handed out in
+    // address order and a partly used span fills from the front.
+    SpanBitmap* bitmap = span->bitmap;
+    int w = span->bitmap_hint;
+    while (bitmap->words[w] == 0) {
+      w++;
+      ASSERT(w < SpanBitmap::kWords);
+    }
+    const int bit = FindFirstSet(bitmap->words[w]);
+    bitmap->words[w] &= bitmap->words[w] - 1;   // Clear the lowest set bit
+    span->bitmap_hint = w;
+    result = SpanObjectBase(span) +
+             (w * 64 + bit) * Static::sizemap()->ByteSizeForClass(size_class_);
+    span_empty = (span->refcount == span->bitmap_objects);
+  } else {
+    ASSERT(span->objects != NULL);
+    result = span->objects;
+    span->objects = *(reinterpret_cast<void**>(result));
+    span_empty = (span->objects == NULL);
+  }
+  if (span_empty) {
     // Move to empty list
     tcmalloc::DLL_Remove(span);
     tcmalloc::DLL_Prepend(&empty_, span);
@@ -259,34 +418,84 @@ void* CentralFreeList::FetchFromSpans() {
 
 // Fetch memory from the system and add to the central cache freelist.
 void CentralFreeList::Populate() {
+  // Pick this span's color while we still hold the lock
+  size_t color = 0;
+  if (FLAGS_tcmalloc_color_objects) {
+    color = next_color_;
+    next_color_ = (color + 1) % Static::sizemap()->class_to_colors(size_class_);
+  }
+  populated_spans_++;
+  if (unrepaid_returns_ > 0) {
+    // We gave a span back to the page heap and now need a new one
+    thrashed_spans_++;
+    unrepaid_returns_--;
+  }
+
   // Release central list lock while operating on pageheap
   lock_.Unlock();
   const size_t npages = Static::sizemap()->class_to_pages(size_class_);
 
+  const bool use_bitmap = FLAGS_tcmalloc_bitmap_spans;
   Span* span;
+  SpanBitmap* bitmap = NULL;
+  size_t growth;
   {
-    SpinLockHolder h(Static::pageheap_lock());
-    span = Static::pageheap()->New(npages);
-    if (span) Static::pageheap()->RegisterSizeClass(span, size_class_);
+    TimedSpinLockHolder h(Static::pageheap_lock());
+    span = Static::pageheap()->New(npages, &growth);
+    if (span) {
+      Static::pageheap()->RegisterSizeClass(span, size_class_);
+      if (long_lived_) {
+        for (Length i = 0; i < span->length; i++) {
+          Static::pageheap()->SetSizeClass(span->start + i, 0);
+        }
+      }
+      if (use_bitmap) bitmap = Static::span_bitmap_allocator()->New();
+    }
   }
+  RecordHeapGrowth(growth);
   if (span == NULL) {
     MESSAGE("allocation failed: %d\n", errno);
     lock_.Lock();
     return;
   }
   ASSERT(span->length == npages);
-  // Cache sizeclass info eagerly.  Locking is not necessary.
-  // (Instead of being eager, we could just replace any stale info
-  // about this span, but that seems to be no better in practice.)
-  for (int i = 0; i < npages; i++) {
-    Static::pageheap()->CacheSizeClass(span->start + i, size_class_);
+  span->color = color;
+  span->long_lived = long_lived_;
+  span->refcount = 0; // No sub-object in use yet
+
+  if (bitmap != NULL) {
+    // Mark every object free without touching the span's memory
+    const size_t num = ObjectsInSpan(span);
+    const size_t full_words = num / 64;
+    for (size_t w = 0; w < SpanBitmap::kWords; w++) {
+      if (w < full_words) {
+        bitmap->words[w] = ~static_cast<uint64_t>(0);
+      } else if (w == full_words && num % 64 != 0) {
+        bitmap->words[w] = (static_cast<uint64_t>(1) << (num % 64)) - 1;
+      } else {
+        bitmap->words[w] = 0;
+      }
+    }
+    span->bitmap_objects = num;
+    span->bitmap_hint = 0;
+    span->bitmap = bitmap;
+    span->has_bitmap = 1;
+
+    lock_.Lock();
+    tcmalloc::DLL_Prepend(&nonempty_, span);
+    counter_ += num;
+    span_objects_ += num;
+    return;
   }
+  span->has_bitmap = 0;
 
-  // Split the block into pieces and add to the free-list
-  // TODO: coloring of objects to avoid cache conflicts?
+  // Split the block into pieces and add to the free-list.  Skip the
+  // first "color" cache lines so that the objects of this span do not
+  // map to the same cache sets as those of the previous span.
   void** tail = &span->objects;
   char* ptr = reinterpret_cast<char*>(span->start << kPageShift);
   char* limit = ptr + (npages << kPageShift);
+  ptr += color * kCacheLineSize;
   const size_t size = Static::sizemap()->ByteSizeForClass(size_class_);
   int num = 0;
   while (ptr + size <= limit) {
@@ -296,13 +505,14 @@ void CentralFreeList::Populate() {
     num++;
   }
   ASSERT(ptr <= limit);
+  ASSERT(num == ObjectsInSpan(span));
   *tail = NULL;
-  span->refcount = 0; // No sub-object in use yet
 
   // Add span to list of non-empty spans
   lock_.Lock();
   tcmalloc::DLL_Prepend(&nonempty_, span);
   counter_ += num;
+  span_objects_ += num;
 }
 
 int CentralFreeList::tc_length() {
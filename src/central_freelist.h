@@ -44,7 +44,11 @@ namespace tcmalloc {
 // Data kept per size-class in central cache.
 class CentralFreeList {
  public:
-  void Init(size_t cl);
+  // If "long_lived" is true, this list's spans are marked as such and
+  // their pages get sizeclass 0 in the pagemap, so that every free of
+  // one of their objects takes the slow path and finds its way back
+  // here rather than into a thread cache.
+  void Init(size_t cl, bool long_lived);
 
   // These methods all do internal locking.
 
@@ -64,6 +68,27 @@ class CentralFreeList {
   // Returns the number of free objects in the transfer cache.
   int tc_length();
 
+  // Returns the number of objects in this class's spans, free or not.
+  size_t span_objects() {
+    SpinLockHolder h(&lock_);
+    return span_objects_;
+  }
+
+  // Returns the completely free spans kept in reserve to the page heap.
+  void ReleaseReserve() LOCKS_EXCLUDED(lock_);
+
+  // Counts of spans going through this list since startup.  A span is
+  // "thrashed" if we carved it after giving a span back to the page
+  // heap, i.e. the reserve was too small to absorb the oscillation.
+  struct SpanStats {
+    size_t   reserved;      // Completely free spans in reserve now
+    uint64_t populated;     // Spans carved into objects
+    uint64_t reused;        // Spans taken back out of the reserve
+    uint64_t returned;      // Spans given back to the page heap
+    uint64_t thrashed;      // Spans carved to replace a returned one
+  };
+  void GetSpanStats(SpanStats* stats) LOCKS_EXCLUDED(lock_);
+
  private:
   // TransferCache is used to cache transfers of
   // sizemap.num_objects_to_move(size_class) back and forth between
@@ -101,6 +126,15 @@ class CentralFreeList {
   // May temporarily release lock_.
   void ReleaseToSpans(void* object) EXCLUSIVE_LOCKS_REQUIRED(lock_);
 
+  // Index of "object" among the objects of "span", which must be one
+  // of our spans.
+  size_t ObjectIndex(const Span* span, const void* object) const;
+
+  // REQUIRES: lock_ is held
+  // Give "span", which must be in the reserve, back to the page heap.
+  // Releases lock_ temporarily.
+  void ReturnSpan(Span* span) EXCLUSIVE_LOCKS_REQUIRED(lock_);
+
   // REQUIRES: lock_ is held
   // Populate cache by fetching from the page heap.
   // May temporarily release lock_.
@@ -134,9 +168,20 @@ class CentralFreeList {
 
   // We keep linked lists of empty and non-empty spans.
   size_t   size_class_;     // My size class
+  bool     long_lived_;     // Serves long-lived allocation sites only
   Span     empty_;          // Dummy header for list of empty spans
   Span     nonempty_;       // Dummy header for list of non-empty spans
+  Span     reserve_;        // Dummy header for list of completely free spans
   size_t   counter_;        // Number of free objects in cache entry
+  size_t   span_objects_;   // Number of objects in all our spans
+  size_t   next_color_;     // Cache color for the next span we populate
+  uint32_t size_reciprocal_;  // 2^32 / object size, rounded up
+  int32_t  reserve_count_;  // Length of reserve_
+  uint64_t populated_spans_;
+  uint64_t reused_spans_;
+  uint64_t returned_spans_;
+  uint64_t thrashed_spans_;
+  uint64_t unrepaid_returns_;  // Returned spans not yet made up for
 
   // Here we reserve space for TCEntry cache slots.  Since one size class can
   // end up getting all the TCEntries quota in the system we just preallocate
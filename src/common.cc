@@ -33,150 +33,46 @@
 #include "system-alloc.h"
 #include "config.h"
 #include "common.h"
+#include "base/basictypes.h"
+#include "base/seqlock.h"
+#include "base/spinlock.h"
+#include "size_map_tables.h"            // the SizeMap tables
 
 namespace tcmalloc {
 
-// Note: the following only works for "n"s that fit in 32-bits, but
-// that is fine since we only use it for small sizes.
-static inline int LgFloor(size_t n) {
+int FineHistogramBucket(uint64_t n) {
+  ASSERT(n > 0);
   int log = 0;
-  for (int i = 4; i >= 0; --i) {
-    int shift = (1 << i);
-    size_t x = n >> shift;
-    if (x != 0) {
-      n = x;
+  uint64_t x = n;
+  for (int i = 5; i >= 0; --i) {
+    const int shift = (1 << i);
+    if ((x >> shift) != 0) {
+      x >>= shift;
       log += shift;
     }
   }
-  ASSERT(n == 1);
-  return log;
+  // The bits just below the leading one pick the sub-bucket
+  const uint64_t sub = (log >= kHistogramSubBits
+                        ? n >> (log - kHistogramSubBits)
+                        : n << (kHistogramSubBits - log));
+  return (log << kHistogramSubBits) +
+         static_cast<int>(sub & ((1 << kHistogramSubBits) - 1));
 }
 
-int SizeMap::NumMoveSize(size_t size) {
-  if (size == 0) return 0;
-  // Use approx 64k transfers between thread and central caches.
-  int num = static_cast<int>(64.0 * 1024.0 / size);
-  if (num < 2) num = 2;
-  // Clamp well below kMaxFreeListLength to avoid ping pong between central
-  // and thread caches.
-  if (num > static_cast<int>(0.8 * kMaxFreeListLength))
-    num = static_cast<int>(0.8 * kMaxFreeListLength);
-
-  // Also, avoid bringing in too many objects into small object free
-  // lists.  There are lots of such lists, and if we allow each one to
-  // fetch too many at a time, we end up having to scavenge too often
-  // (especially when there are lots of threads and each thread gets a
-  // small allowance for its thread cache).  This fixes a problem seen
-  // in the 20060502 bigtable release by both Andrew Fikes and Ben
-  // Darnell.
-  //
-  // TODO: Make thread cache free list sizes dynamic so that we do not
-  // have to equally divide a fixed resource amongst lots of threads.
-  if (num > 32) num = 32;
-
-  return num;
-}
-
-// Initialize the mapping arrays
-void SizeMap::Init() {
-  // Do some sanity checking on add_amount[]/shift_amount[]/class_array[]
-  if (ClassIndex(0) < 0) {
-    CRASH("Invalid class index %d for size 0\n", ClassIndex(0));
-  }
-  if (ClassIndex(kMaxSize) >= sizeof(class_array_)) {
-    CRASH("Invalid class index %d for kMaxSize\n", ClassIndex(kMaxSize));
-  }
-
-  // Compute the size classes we want to use
-  int sc = 1;   // Next size class to assign
-  int alignment = kAlignment;
-  CHECK_CONDITION(kAlignment <= 16);
-  int last_lg = -1;
-  for (size_t size = kAlignment; size <= kMaxSize; size += alignment) {
-    int lg = LgFloor(size);
-    if (lg > last_lg) {
-      // Increase alignment every so often to reduce number of size classes.
-      if (size >= 2048) {
-        // Cap alignment at 256 for large sizes
-        alignment = 256;
-      } else if (size >= 128) {
-        // Space wasted due to alignment is at most 1/8, i.e., 12.5%.
-        alignment = size / 8;
-      } else if (size >= 16) {
-        // We need an alignment of at least 16 bytes to satisfy
-        // requirements for some SSE types.
-        alignment = 16;
-      }
-      CHECK_CONDITION(size < 16 || alignment >= 16);
-      CHECK_CONDITION((alignment & (alignment - 1)) == 0);
-      last_lg = lg;
-    }
-    CHECK_CONDITION((size % alignment) == 0);
-
-    // Allocate enough pages so leftover is less than 1/8 of total.
-    // This bounds wasted space to at most 12.5%.
-    size_t psize = kPageSize;
-    while ((psize % size) > (psize >> 3)) {
-      psize += kPageSize;
-    }
-    const size_t my_pages = psize >> kPageShift;
-
-    if (sc > 1 && my_pages == class_to_pages_[sc-1]) {
-      // See if we can merge this into the previous class without
-      // increasing the fragmentation of the previous class.
-      const size_t my_objects = (my_pages << kPageShift) / size;
-      const size_t prev_objects = (class_to_pages_[sc-1] << kPageShift)
-                                  / class_to_size_[sc-1];
-      if (my_objects == prev_objects) {
-        // Adjust last class to include this size
-        class_to_size_[sc-1] = size;
-        continue;
-      }
-    }
-
-    // Add new class
-    class_to_pages_[sc] = my_pages;
-    class_to_size_[sc] = size;
-    sc++;
-  }
-  if (sc != kNumClasses) {
-    CRASH("wrong number of size classes: found %d instead of %d\n",
-          sc, int(kNumClasses));
-  }
-
-  // Initialize the mapping arrays
-  int next_size = 0;
-  for (int c = 1; c < kNumClasses; c++) {
-    const int max_size_in_class = class_to_size_[c];
-    for (int s = next_size; s <= max_size_in_class; s += kAlignment) {
-      class_array_[ClassIndex(s)] = c;
-    }
-    next_size = max_size_in_class + kAlignment;
-  }
-
-  // Double-check sizes just to be safe
-  for (size_t size = 0; size <= kMaxSize; size++) {
-    const int sc = SizeClass(size);
-    if (sc <= 0 || sc >= kNumClasses) {
-      CRASH("Bad size class %d for %" PRIuS "\n", sc, size);
-    }
-    if (sc > 1 && size <= class_to_size_[sc-1]) {
-      CRASH("Allocating unnecessarily large class %d for %" PRIuS
-            "\n", sc, size);
-    }
-    const size_t s = class_to_size_[sc];
-    if (size > s) {
-      CRASH("Bad size %" PRIuS " for %" PRIuS " (sc = %d)\n", s, size, sc);
-    }
-    if (s == 0) {
-      CRASH("Bad size %" PRIuS " for %" PRIuS " (sc = %d)\n", s, size, sc);
-    }
-  }
-
-  // Initialize the num_objects_to_move array.
-  for (size_t cl = 1; cl  < kNumClasses; ++cl) {
-    num_objects_to_move_[cl] = NumMoveSize(ByteSizeForClass(cl));
-  }
+// The tables must cover every size class and every class_array_ index,
+// so changing the size-class parameters in common.h without
+// regenerating size_map_tables.h fails to compile here.
+void SizeMap::CheckTableSizes() {
+  COMPILE_ASSERT(arraysize(class_to_size_) == kNumClasses,
+                 class_to_size_matches_kNumClasses);
+  COMPILE_ASSERT(arraysize(class_to_pages_) == kNumClasses,
+                 class_to_pages_matches_kNumClasses);
+  COMPILE_ASSERT(arraysize(class_to_colors_) == kNumClasses,
+                 class_to_colors_matches_kNumClasses);
+  COMPILE_ASSERT(arraysize(num_objects_to_move_) == kNumClasses,
+                 num_objects_to_move_matches_kNumClasses);
+  COMPILE_ASSERT(arraysize(class_array_) == kClassArraySize,
+                 class_array_matches_kMaxSize);
 }
 
 void SizeMap::Dump() {
@@ -186,26 +82,91 @@ void SizeMap::Dump() {
     const int alloc_objs = alloc_size / class_to_size_[cl];
     const int min_used = (class_to_size_[cl-1] + 1) * alloc_objs;
     const int max_waste = alloc_size - min_used;
-    MESSAGE("SC %3d [ %8d .. %8d ] from %8d ; %2.0f%% maxwaste\n",
+    MESSAGE("SC %3d [ %8d .. %8d ] from %8d ; %2.0f%% maxwaste"
+            " ; %2d colors\n",
             int(cl),
             int(class_to_size_[cl-1] + 1),
             int(class_to_size_[cl]),
             int(class_to_pages_[cl] << kPageShift),
-            max_waste * 100.0 / alloc_size
+            max_waste * 100.0 / alloc_size,
+            int(class_to_colors_[cl])
             );
   }
 }
 
 // Metadata allocator -- keeps stats about how many bytes allocated.
+// Metadata is allocated under several different locks (e.g. the
+// pageheap lock and the sample lock), so the counter has its own.
+// Readers go through metadata_seq instead of taking the lock.
+static SpinLock metadata_lock(SpinLock::LINKER_INITIALIZED);
+static SeqLock metadata_seq(base::LINKER_INITIALIZED);
 static uint64_t metadata_system_bytes_ = 0;
-void* MetaDataAlloc(size_t bytes) {
-  void* result = TCMalloc_SystemAlloc(bytes, NULL);
+
+static void* AllocateMetaData(size_t bytes, size_t alignment) {
+  void* result = TCMalloc_SystemAlloc(bytes, NULL, alignment);
   if (result != NULL) {
+    SpinLockHolder h(&metadata_lock);
+    metadata_seq.BeginWrite();
     metadata_system_bytes_ += bytes;
+    metadata_seq.EndWrite();
   }
   return result;
 }
 
-uint64_t metadata_system_bytes() { return metadata_system_bytes_; }
+void* MetaDataAlloc(size_t bytes) {
+  return AllocateMetaData(bytes, 0);
+}
+
+// Chunks given back by MetaDataChunkFree(), linked through their first
+// word.  TCMalloc_SystemRelease() leaves alone the system page holding
+// the link.  Protected by metadata_lock; metadata_seq covers the count.
+static void* free_chunks_ = NULL;
+static uint64_t free_chunk_count_ = 0;
+
+void* MetaDataChunkAlloc() {
+  {
+    SpinLockHolder h(&metadata_lock);
+    void* chunk = free_chunks_;
+    if (chunk != NULL) {
+      free_chunks_ = *reinterpret_cast<void**>(chunk);
+      metadata_seq.BeginWrite();
+      free_chunk_count_--;
+      metadata_seq.EndWrite();
+      return chunk;
+    }
+  }
+  return AllocateMetaData(kMetaDataChunkSize, kMetaDataChunkSize);
+}
+
+void MetaDataChunkFree(void* chunk) {
+  TCMalloc_SystemRelease(reinterpret_cast<char*>(chunk) + sizeof(void*),
+                         kMetaDataChunkSize - sizeof(void*));
+  SpinLockHolder h(&metadata_lock);
+  *reinterpret_cast<void**>(chunk) = free_chunks_;
+  free_chunks_ = chunk;
+  metadata_seq.BeginWrite();
+  free_chunk_count_++;
+  metadata_seq.EndWrite();
+}
+
+uint64_t metadata_free_chunk_bytes() {
+  uint64_t result;
+  Atomic32 seq;
+  do {
+    seq = metadata_seq.BeginRead();
+    result = free_chunk_count_ * kMetaDataChunkSize;
+  } while (metadata_seq.RetryRead(seq));
+  return result;
+}
+
+uint64_t metadata_system_bytes() {
+  uint64_t result;
+  Atomic32 seq;
+  do {
+    seq = metadata_seq.BeginRead();
+    result = metadata_system_bytes_;
+  } while (metadata_seq.RetryRead(seq));
+  return result;
+}
 
 }  // namespace tcmalloc
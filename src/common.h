@@ -56,12 +56,25 @@ typedef uintptr_t Length;
 
 // Not all possible combinations of the following parameters make
 // sense.  In particular, if kMaxSize increases, you may have to
-// increase kNumClasses as well.
+// increase kNumClasses as well.  The size-class tables are generated
+// from these by size_map_gen; run "make size_map_tables" after
+// changing any of them.
 static const size_t kPageShift  = 12;
 static const size_t kPageSize   = 1 << kPageShift;
 static const size_t kMaxSize    = 8u * kPageSize;
-static const size_t kAlignment  = 8;
+static const size_t kCacheLineSize = 64;
+
+// Objects of 16 bytes or more are always 16-byte aligned, for SSE.
+// Building with --enable-16byte-alignment extends that to the smallest
+// objects, which drops the 8-byte size class.
+#ifdef TCMALLOC_16BYTE_ALIGNMENT
+static const size_t kAlignShift = 4;
+static const size_t kNumClasses = 60;
+#else
+static const size_t kAlignShift = 3;
 static const size_t kNumClasses = 61;
+#endif
+static const size_t kAlignment  = 1 << kAlignShift;
 
 // Maximum length we allow a per-thread free-list to have before we
 // move objects from it into the corresponding central free-list.  We
@@ -81,7 +94,10 @@ inline Length pages(size_t bytes) {
       ((bytes & (kPageSize - 1)) > 0 ? 1 : 0);
 }
 
-// Size-class information + mapping
+// Size-class information + mapping.  The tables are constant, and
+// generated ahead of time into size_map_tables.h by size_map_gen (see
+// size_map_gen.cc), so they live in read-only memory and need no
+// initialization.
 class SizeMap {
  private:
   // Number of objects to move between a per-thread list and a central
@@ -89,21 +105,22 @@ class SizeMap {
   // amortize the lock overhead for accessing the central list.  Making
   // it too big may temporarily cause unnecessary memory wastage in the
   // per-thread free list until the scavenger cleans up the list.
-  int num_objects_to_move_[kNumClasses];
-  
+  static const int num_objects_to_move_[];
+
   //-------------------------------------------------------------------
   // Mapping from size to size_class and vice versa
   //-------------------------------------------------------------------
 
-  // Sizes <= 1024 have an alignment >= 8.  So for such sizes we have an
-  // array indexed by ceil(size/8).  Sizes > 1024 have an alignment >= 128.
-  // So for these larger sizes we have an array indexed by ceil(size/128).
+  // Sizes <= 1024 have an alignment >= kAlignment.  So for such sizes we
+  // have an array indexed by ceil(size/kAlignment).  Sizes > 1024 have an
+  // alignment >= 128.  So for these larger sizes we have an array indexed
+  // by ceil(size/128).
   //
   // We flatten both logical arrays into one physical array and use
   // arithmetic to compute an appropriate index.  The constants used by
   // ClassIndex() were selected to make the flattening work.
   //
-  // Examples:
+  // Examples, with the default kAlignment of 8:
   //   Size       Expression                      Index
   //   -------------------------------------------------------
   //   0          (0 + 7) / 8                     0
@@ -113,35 +130,38 @@ class SizeMap {
   //   1025       (1025 + 127 + (120<<7)) / 128   129
   //   ...
   //   32768      (32768 + 127 + (120<<7)) / 128  376
+  //
+  // With a kAlignment of 16 the small sizes take up 64 entries, and
+  // kBigOffset is 56 instead of 120.
   static const int kMaxSmallSize = 1024;
-  unsigned char class_array_[377];
-  
+  static const int kBigOffset = (kMaxSmallSize >> kAlignShift) - (1024 >> 7);
+  static const int kClassArraySize =
+      ((kMaxSize + 127 + (kBigOffset << 7)) >> 7) + 1;
+  static const unsigned char class_array_[];
+
   // Compute index of the class_array[] entry for a given size
   static inline int ClassIndex(int s) {
     ASSERT(0 <= s);
     ASSERT(s <= kMaxSize);
     const bool big = (s > kMaxSmallSize);
-    const int add_amount = big ? (127 + (120<<7)) : 7;
-    const int shift_amount = big ? 7 : 3;
+    const int add_amount = big ? (127 + (kBigOffset<<7)) : kAlignment - 1;
+    const int shift_amount = big ? 7 : kAlignShift;
     return (s + add_amount) >> shift_amount;
   }
 
-  int NumMoveSize(size_t size);
-
   // Mapping from size class to max size storable in that class
-  size_t class_to_size_[kNumClasses];
+  static const size_t class_to_size_[];
 
   // Mapping from size class to number of pages to allocate at a time
-  size_t class_to_pages_[kNumClasses];
+  static const size_t class_to_pages_[];
 
- public:
-  // Constructor should do nothing since we rely on explicit Init()
-  // call, which may or may not be called before the constructor runs.
-  SizeMap() { }
+  // Mapping from size class to number of cache colors (see below)
+  static const size_t class_to_colors_[];
 
-  // Initialize the mapping arrays
-  void Init();
+  // Never called; holds compile-time checks of the tables' sizes.
+  static void CheckTableSizes();
 
+ public:
   inline int SizeClass(int size) {
     return class_array_[ClassIndex(size)];
   }
@@ -161,6 +181,16 @@ class SizeMap {
     return class_to_pages_[cl];
   }
 
+  // Number of different offsets, in units of kCacheLineSize, at which
+  // the first object of a span of this class may be placed.  1 means
+  // objects always start at the beginning of the span.  Staggering the
+  // start of successive spans keeps same-indexed objects of classes
+  // whose size is a multiple of a large power of two from all landing
+  // in the same cache sets.
+  inline size_t class_to_colors(size_t cl) {
+    return class_to_colors_[cl];
+  }
+
   // Number of objects to move between a per-thread list and a central
   // list in one shot.  We want this to be not too small so we can
   // amortize the lock overhead for accessing the central list.  Making
@@ -170,19 +200,48 @@ class SizeMap {
     return num_objects_to_move_[cl];
   }
 
-  // Dump contents of the computed size map
+  // Dump contents of the size map
   void Dump();
 };
 
 // Allocates "bytes" worth of memory and returns it.  Increments
 // metadata_system_bytes appropriately.  May return NULL if allocation
-// fails.  Requires pageheap_lock is held.
+// fails.  Thread-safe; callers serialize use of the returned memory.
 void* MetaDataAlloc(size_t bytes);
 
 // Returns the total number of bytes allocated from the system.
-// Requires pageheap_lock is held.
+// Does not need any lock.
 uint64_t metadata_system_bytes();
 
+// Metadata that comes and goes (spans, thread caches and so on) is
+// carved out of chunks of this many bytes, aligned to their size.
+// See PageHeapAllocator.
+static const size_t kMetaDataChunkSize = 128 << 10;
+
+// Returns a metadata chunk: one given back with MetaDataChunkFree() if
+// there is any, else a new one from MetaDataAlloc().  Its contents are
+// unspecified.  May return NULL if allocation fails.  Thread-safe.
+void* MetaDataChunkAlloc();
+
+// Gives back a chunk from MetaDataChunkAlloc() that holds no live
+// objects.  Its pages are released to the system until it is reused.
+// Thread-safe.
+void MetaDataChunkFree(void* chunk);
+
+// Returns the number of bytes in chunks given back by
+// MetaDataChunkFree() and not reused yet.  Does not need any lock.
+uint64_t metadata_free_chunk_bytes();
+
+// Log-scaled size histograms have a bucket per power of two: "n"
+// goes in bucket floor(log2(n)).  The fine-grained ones split each of
+// those in 2^kHistogramSubBits, by the bits of "n" just below its
+// leading one.
+static const int kHistogramSubBits = 2;
+
+// Returns the bucket of "n" in a fine-grained histogram.
+// REQUIRES: n > 0
+int FineHistogramBucket(uint64_t n);
+
 // size/depth are made the same size as a pointer so that some generic
 // code below can conveniently cast them back and forth to void*.
 static const int kMaxStackDepth = 31;
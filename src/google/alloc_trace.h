@@ -0,0 +1,84 @@
+/* Copyright (c) 2008, Google Inc.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *     * Redistributions of source code must retain the above copyright
+ * notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above
+ * copyright notice, this list of conditions and the following disclaimer
+ * in the documentation and/or other materials provided with the
+ * distribution.
+ *     * Neither the name of Google Inc. nor the names of its
+ * contributors may be used to endorse or promote products derived from
+ * this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ * ---
+ * Records every allocation and deallocation made through tcmalloc to a
+ * compact binary file, for replaying later with alloc_trace_replay.
+ *
+ * The recorder is built on the MallocHook new and delete hooks, and
+ * chains to whatever hooks were installed before it.  Realloc() reports
+ * itself to those hooks as a new and a delete, so it appears in the
+ * trace that way.  Start the recorder in one of two ways:
+ *
+ *    1. Before starting the program, set the environment variable
+ *       "TCMALLOC_TRACE_FILE" to the name of the file to write.
+ *
+ *    2. Programmatically, with "AllocTraceStart(filename)" and
+ *       "AllocTraceStop()".
+ *
+ * Threads record into separate buffers, which are written out as they
+ * fill up, so recording threads mostly do not wait for one another;
+ * they do all bump one shared event counter.  The heap profiler and
+ * heap checker cannot share the hooks, so do not record while either of
+ * them is running.
+ */
+
+#ifndef BASE_ALLOC_TRACE_H_
+#define BASE_ALLOC_TRACE_H_
+
+/* Annoying stuff for windows; makes sure clients can import these functions */
+#ifndef PERFTOOLS_DLL_DECL
+# ifdef _WIN32
+#   define PERFTOOLS_DLL_DECL  __declspec(dllimport)
+# else
+#   define PERFTOOLS_DLL_DECL
+# endif
+#endif
+
+/* All this code should be usable from within C apps. */
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Start recording to "filename", replacing anything already there.
+ * Returns 0 if the file cannot be opened or a trace is already being
+ * recorded, and non-zero otherwise.
+ */
+PERFTOOLS_DLL_DECL int AllocTraceStart(const char* filename);
+
+/* Stop recording and write out the remaining events.  A no-op if no
+ * trace is being recorded.
+ */
+PERFTOOLS_DLL_DECL void AllocTraceStop();
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
+
+#endif  /* BASE_ALLOC_TRACE_H_ */
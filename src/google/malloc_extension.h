@@ -55,6 +55,12 @@
 
 static const int kMallocHistogramSize = 64;
 
+// MallocMemoryStatsFine() splits each bucket of the histogram above
+// into this many.
+static const int kMallocFineHistogramSubBuckets = 4;
+static const int kMallocFineHistogramSize =
+    kMallocHistogramSize * kMallocFineHistogramSubBuckets;
+
 // The default implementations of the following routines do nothing.
 // All implementations should be thread-safe; the current one
 // (TCMallocImplementation) is.
@@ -75,6 +81,12 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   virtual bool VerifyNewMemory(void* p);
   virtual bool VerifyArrayNewMemory(void* p);
   virtual bool VerifyMallocMemory(void* p);
+
+  // Get the number and total size of the blocks currently allocated,
+  // and a histogram of their sizes: histogram[i] is the number of
+  // blocks of at least 2^i and less than 2^(i+1) bytes.  Sizes are
+  // as allocated, i.e. after rounding up the requested size.  The
+  // numbers are approximate while other threads allocate.
   virtual bool MallocMemoryStats(int* blocks, size_t* total,
                                  int histogram[kMallocHistogramSize]);
 
@@ -129,12 +141,32 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   //      Number of bytes used across all thread caches.
   //      This property is not writable.
   //
+  // "tcmalloc.idle_thread_cache_reclaimed_bytes"
+  //      Total number of bytes drained so far from the caches of
+  //      threads that had stopped allocating (see
+  //      $TCMALLOC_IDLE_THREAD_CACHE_MS).  This property is not writable.
+  //
   // "tcmalloc.slack_bytes"
   //      Number of bytes allocated from system, but not currently
   //      in use by malloced objects.  I.e., bytes available for
   //      allocation without needing more bytes from system.
   //      This property is not writable.
   //
+  // "tcmalloc.sampling_period_bytes"
+  //      Mean number of bytes allocated between samples taken for
+  //      GetHeapSample().  Zero disables sampling.  Default: 128KB
+  //      (or $TCMALLOC_SAMPLE_PARAMETER).
+  //
+  // "tcmalloc.metadata_bytes"
+  //      Number of bytes allocated from system for tcmalloc's own
+  //      bookkeeping (spans, thread caches, the page map, ...).
+  //      This property is not writable.
+  //
+  // "tcmalloc.free_metadata_bytes"
+  //      Part of tcmalloc.metadata_bytes that held bookkeeping no longer
+  //      needed.  It is waiting to be reused, and meanwhile released
+  //      to the system.  This property is not writable.
+  //
   // TODO: Add more properties as necessary
   // -------------------------------------------------------------------
 
@@ -212,6 +244,76 @@ class PERFTOOLS_DLL_DECL MallocExtension {
   // Like ReadStackTraces(), but returns stack traces that caused growth
   // in the address space size.
   virtual void** ReadHeapGrowthStackTraces();
+
+  // Virtual methods added after the ones above go at the end of the
+  // class, so that code built against an older version of this header
+  // still finds every method it knows about in the same vtable slot.
+ public:
+  // Like MallocMemoryStats(), with kMallocFineHistogramSubBuckets
+  // buckets per power of two.  The range [2^i, 2^(i+1)) is split
+  // evenly, so a block of "size" bytes, with 2^i <= size < 2^(i+1),
+  // is counted in histogram[i * kMallocFineHistogramSubBuckets +
+  // (size - 2^i) * kMallocFineHistogramSubBuckets / 2^i].
+  virtual bool MallocMemoryStatsFine(int* blocks, size_t* total,
+                                     int histogram[kMallocFineHistogramSize]);
+
+  // Returns the number of bytes actually reserved for the object at
+  // "p", which is at least as many as were requested and may be more.
+  // The caller may use all of them, e.g. to let a buffer grow into
+  // the slack without calling realloc().  "p" must have been returned
+  // by malloc() (or one of its relatives) and not yet freed.  Returns
+  // 0 if unknown.  (Currently only implemented in tcmalloc.)
+  virtual size_t GetAllocatedSize(void* p);
+
+  // Stores in *allocated_bytes and *freed_bytes how many bytes the
+  // calling thread has allocated and freed since it started, counting
+  // what GetAllocatedSize() would report for each object.  The counts
+  // are cheap to keep, so this is a lightweight way to attribute
+  // allocation churn to whatever a thread is doing: read them before
+  // and after, and subtract.  They wrap around rather than saturate,
+  // so such differences stay right.  Returns false if unsupported.
+  // (Currently only implemented in tcmalloc.)
+  virtual bool GetThreadAllocationCounters(size_t* allocated_bytes,
+                                           size_t* freed_bytes);
+
+  // What a memory pressure callback is told about the process
+  struct MemoryPressureInfo {
+    size_t heap_bytes;    // Bytes obtained from the system
+    size_t free_bytes;    // Bytes free in the page heap, mapped or not
+    size_t rss_bytes;     // Resident set size; 0 if unknown or unwatched
+  };
+  typedef void (*MemoryPressureCallback)(const MemoryPressureInfo* info,
+                                         void* arg);
+
+  // Asks for "callback" to be called with "arg" while the heap is
+  // bigger than "heap_limit" bytes, the process's resident set is
+  // bigger than "rss_limit" bytes, or fewer than "free_floor" bytes are
+  // free in the page heap; a zero leaves that test out.  This lets a
+  // cache shrink itself before the heap has to grow.  The tests are
+  // made whenever the heap grows or returns memory to the system, and
+  // each callback is called at most once every
+  // TCMALLOC_MEMORY_PRESSURE_INTERVAL_MS milliseconds (1000 by
+  // default).  Callbacks run on whichever thread allocated or freed
+  // memory at the time, with no allocator locks held, so they may
+  // allocate and free memory themselves; allocation by a callback does
+  // not set off further callbacks.  Returns false if too many
+  // callbacks are registered already, or if unsupported.  (Currently
+  // only implemented in tcmalloc.)
+  virtual bool AddMemoryPressureCallback(MemoryPressureCallback callback,
+                                         void* arg, size_t heap_limit,
+                                         size_t rss_limit, size_t free_floor);
+
+  // Undoes AddMemoryPressureCallback() for "callback" and "arg".  A
+  // test already under way on another thread may still call it once.
+  // Returns false if it was not registered.
+  virtual bool RemoveMemoryPressureCallback(MemoryPressureCallback callback,
+                                            void* arg);
+
+ protected:
+  // Like ReadStackTraces(), and also stores in *sample_period the mean
+  // number of bytes between samples, or 0 if unknown.  The default
+  // calls ReadStackTraces() and reports 0.
+  virtual void** ReadStackTracesWithPeriod(int* sample_period);
 };
 
 #endif  // BASE_MALLOC_EXTENSION_H_
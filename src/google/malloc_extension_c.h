@@ -53,6 +53,8 @@ bool MallocExtension_VerifyArrayNewMemory(void* p);
 bool MallocExtension_VerifyMallocMemory(void* p);
 bool MallocExtension_MallocMemoryStats(int* blocks, size_t* total,
                                        int histogram[kMallocHistogramSize]);
+bool MallocExtension_MallocMemoryStatsFine(
+    int* blocks, size_t* total, int histogram[kMallocFineHistogramSize]);
 
 void MallocExtension_GetStats(char* buffer, int buffer_length);
 
@@ -67,6 +69,21 @@ bool MallocExtension_GetNumericProperty(const char* property, size_t* value);
 bool MallocExtension_SetNumericProperty(const char* property, size_t value);
 void MallocExtension_MarkThreadIdle();
 void MallocExtension_ReleaseFreeMemory();
+size_t MallocExtension_GetAllocatedSize(void* p);
+bool MallocExtension_GetThreadAllocationCounters(size_t* allocated_bytes,
+                                                 size_t* freed_bytes);
+
+/* Returns the number of bytes malloc(size) would actually reserve,
+ * without allocating anything; this is what malloc_usable_size() and
+ * MallocExtension_GetAllocatedSize() would report for the result.
+ * "flags" is 0 or MALLOCX_LG_ALIGN(lg), which asks instead about
+ * memalign(1 << lg, size).  Returns 0 if no such allocation is
+ * possible.  Not a MallocExtension shim; tcmalloc exports it directly.
+ */
+#ifndef MALLOCX_LG_ALIGN
+#define MALLOCX_LG_ALIGN(lg) ((int)(lg))
+#endif
+size_t nallocx(size_t size, int flags);
 
 #ifdef __cplusplus
 }   // extern "C"
@@ -0,0 +1,125 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Lifetime profile of allocation sites; see lifetime_profile.h.
+
+#include "config.h"
+#include "lifetime_profile.h"
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include "base/cycleclock.h"
+#include "base/sysinfo.h"
+
+DEFINE_bool(tcmalloc_lifetime_segregation,
+            EnvToBool("TCMALLOC_LIFETIME_SEGREGATION", false),
+            "Keep small objects from allocation sites whose sampled"
+            " objects tend to be long-lived on spans of their own.");
+DEFINE_int64(tcmalloc_long_lived_ms,
+             EnvToInt64("TCMALLOC_LONG_LIVED_MS", 1000),
+             "With tcmalloc_lifetime_segregation, sampled objects that"
+             " live at least this many milliseconds count as long-lived.");
+
+namespace tcmalloc {
+
+// The profile is an open-addressed hash table of sites.  Entries are
+// never removed, so a reader can probe it without a lock: at worst it
+// misses a site that is being added, or sees a stale verdict.
+static const int kSiteTableBits = 10;
+static const int kSiteTableSize = 1 << kSiteTableBits;
+static const int kMaxProbes = 8;
+
+// Counts are halved once their sum reaches this, so that the verdict
+// follows a site whose behaviour changes.
+static const uint32_t kMaxSiteSamples = 64;
+
+// A site needs at least this many long-lived samples to be long-lived
+static const uint32_t kMinLongLivedSamples = 2;
+
+struct SiteRecord {
+  const void* volatile site;
+  uint32_t short_lived;
+  uint32_t long_lived;
+  volatile bool is_long_lived;
+};
+
+static SiteRecord site_table[kSiteTableSize];
+
+static inline int SiteHash(const void* site) {
+  const uint32_t x =
+      static_cast<uint32_t>(reinterpret_cast<uintptr_t>(site) >> 2);
+  return static_cast<int>((x * 2654435761u) >> (32 - kSiteTableBits));
+}
+
+bool IsLongLivedSite(const void* site) {
+  if (site == NULL) return false;
+  const int h = SiteHash(site);
+  for (int i = 0; i < kMaxProbes; i++) {
+    const SiteRecord& r = site_table[(h + i) & (kSiteTableSize - 1)];
+    if (r.site == site) return r.is_long_lived;
+    if (r.site == NULL) return false;
+  }
+  return false;
+}
+
+void RecordSiteLifetime(const void* site, bool long_lived) {
+  if (site == NULL) return;
+  const int h = SiteHash(site);
+  SiteRecord* r = NULL;
+  for (int i = 0; i < kMaxProbes; i++) {
+    SiteRecord* candidate = &site_table[(h + i) & (kSiteTableSize - 1)];
+    if (candidate->site == site || candidate->site == NULL) {
+      r = candidate;
+      break;
+    }
+  }
+  if (r == NULL) return;        // Too many sites hash here
+  r->site = site;
+
+  if (long_lived) {
+    r->long_lived++;
+  } else {
+    r->short_lived++;
+  }
+  if (r->long_lived + r->short_lived >= kMaxSiteSamples) {
+    r->long_lived /= 2;
+    r->short_lived /= 2;
+  }
+  r->is_long_lived = (r->long_lived >= kMinLongLivedSamples &&
+                      r->long_lived > r->short_lived);
+}
+
+int64 LongLivedCycles() {
+  return static_cast<int64>(
+      CyclesPerSecond() * FLAGS_tcmalloc_long_lived_ms / 1000);
+}
+
+}  // namespace tcmalloc
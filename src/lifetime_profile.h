@@ -0,0 +1,75 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Lifetime profile of allocation sites.
+//
+// With TCMALLOC_LIFETIME_SEGREGATION set, small objects from allocation
+// sites that tend to hand out long-lived objects are carved from spans
+// of their own (Static::long_lived_cache()) instead of sharing spans
+// with short-lived objects.  A long-lived object left behind on a span
+// otherwise keeps the whole span from going back to the page heap once
+// its short-lived neighbours have been freed.
+//
+// Which sites are long-lived is learned from sampled objects (see
+// sampler.h).  A site is the return address of the allocation routine
+// the application called, e.g. malloc() or operator new.  A sampled
+// object that is freed within TCMALLOC_LONG_LIVED_MS counts as
+// short-lived for its site; one still live after that long counts as
+// long-lived.  A site is long-lived once most of its recent samples
+// are.  Nothing is learned without sampling, so in libtcmalloc_minimal
+// the option has no effect.
+
+#ifndef TCMALLOC_LIFETIME_PROFILE_H_
+#define TCMALLOC_LIFETIME_PROFILE_H_
+
+#include "config.h"
+#include "base/basictypes.h"
+#include "base/commandlineflags.h"
+
+DECLARE_bool(tcmalloc_lifetime_segregation);
+
+namespace tcmalloc {
+
+// Returns true if small objects allocated from "site" should come from
+// the long-lived central lists.  Does not take any lock.
+bool IsLongLivedSite(const void* site);
+
+// Counts a sampled object from "site" as long- or short-lived.  Sites
+// that do not fit in the (fixed-size) profile are ignored.
+// REQUIRES: Static::sample_lock() is held.
+void RecordSiteLifetime(const void* site, bool long_lived);
+
+// Returns TCMALLOC_LONG_LIVED_MS in CycleClock ticks.
+int64 LongLivedCycles();
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_LIFETIME_PROFILE_H_
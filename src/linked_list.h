@@ -46,6 +46,14 @@ inline void SLL_SetNext(void *t, void *n) {
   *(reinterpret_cast<void**>(t)) = n;
 }
 
+// Hint to the processor that "p" will be read soon.  "p" may be NULL
+// (prefetches never fault).  A no-op on compilers we don't know about.
+inline void SLL_Prefetch(const void *p) {
+#if defined(__GNUC__)
+  __builtin_prefetch(p, 0, 3);  // for read, keep in all cache levels
+#endif
+}
+
 inline void SLL_Push(void **list, void *element) {
   SLL_SetNext(element, *list);
   *list = element;
@@ -121,7 +121,15 @@ bool MallocExtension::MallocMemoryStats(int* blocks, size_t* total,
                                        int histogram[kMallocHistogramSize]) {
   *blocks = 0;
   *total = 0;
-  memset(histogram, 0, sizeof(histogram));
+  memset(histogram, 0, kMallocHistogramSize * sizeof(*histogram));
+  return true;
+}
+
+bool MallocExtension::MallocMemoryStatsFine(
+    int* blocks, size_t* total, int histogram[kMallocFineHistogramSize]) {
+  *blocks = 0;
+  *total = 0;
+  memset(histogram, 0, kMallocFineHistogramSize * sizeof(*histogram));
   return true;
 }
 
@@ -129,6 +137,11 @@ void** MallocExtension::ReadStackTraces() {
   return NULL;
 }
 
+void** MallocExtension::ReadStackTracesWithPeriod(int* sample_period) {
+  *sample_period = 0;
+  return ReadStackTraces();
+}
+
 void** MallocExtension::ReadHeapGrowthStackTraces() {
   return NULL;
 }
@@ -149,6 +162,26 @@ double MallocExtension::GetMemoryReleaseRate() {
   return -1.0;
 }
 
+size_t MallocExtension::GetAllocatedSize(void* p) {
+  return 0;
+}
+
+bool MallocExtension::GetThreadAllocationCounters(size_t* allocated_bytes,
+                                                  size_t* freed_bytes) {
+  return false;
+}
+
+bool MallocExtension::AddMemoryPressureCallback(
+    MemoryPressureCallback callback, void* arg, size_t heap_limit,
+    size_t rss_limit, size_t free_floor) {
+  return false;
+}
+
+bool MallocExtension::RemoveMemoryPressureCallback(
+    MemoryPressureCallback callback, void* arg) {
+  return false;
+}
+
 // The current malloc extension object.  We also keep a pointer to
 // the default implementation so that the heap-leak checker does not
 // complain about a memory leak.
@@ -283,7 +316,8 @@ void PrintStackEntry(string* result, void** entry) {
 }
 
 void MallocExtension::GetHeapSample(string* result) {
-  void** entries = ReadStackTraces();
+  int sample_period = 0;
+  void** entries = ReadStackTracesWithPeriod(&sample_period);
   if (entries == NULL) {
     *result += "This malloc implementation does not support sampling.\n"
                "As of 2005/01/26, only tcmalloc supports sampling, and you\n"
@@ -305,7 +339,17 @@ void MallocExtension::GetHeapSample(string* result) {
     }
   }
 
-  PrintHeader(result, "heap", entries);
+  // Objects were sampled with probability 1-exp(-size/sample_period);
+  // "heap_v2" tells pprof to scale the counts back up accordingly.  An
+  // implementation that does not report its period gets the old
+  // unscaled "heap" header.
+  char label[32];
+  if (sample_period > 0) {
+    snprintf(label, sizeof(label), "heap_v2/%d", sample_period);
+  } else {
+    snprintf(label, sizeof(label), "heap");
+  }
+  PrintHeader(result, label, entries);
   for (StackTraceTable::iterator iter = table.begin();
        iter != table.end();
        ++iter) {
@@ -353,6 +397,9 @@ C_SHIM(VerifyMallocMemory, bool, (void* p), (p));
 C_SHIM(MallocMemoryStats, bool,
        (int* blocks, size_t* total, int histogram[kMallocHistogramSize]),
        (blocks, total, histogram));
+C_SHIM(MallocMemoryStatsFine, bool,
+       (int* blocks, size_t* total, int histogram[kMallocFineHistogramSize]),
+       (blocks, total, histogram));
 
 C_SHIM(GetStats, void,
        (char* buffer, int buffer_length), (buffer, buffer_length));
@@ -363,3 +410,7 @@ C_SHIM(SetNumericProperty, bool,
 
 C_SHIM(MarkThreadIdle, void, (), ());
 C_SHIM(ReleaseFreeMemory, void, (), ());
+C_SHIM(GetAllocatedSize, size_t, (void* p), (p));
+C_SHIM(GetThreadAllocationCounters, bool,
+       (size_t* allocated_bytes, size_t* freed_bytes),
+       (allocated_bytes, freed_bytes));
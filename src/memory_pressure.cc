@@ -0,0 +1,188 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Memory pressure callbacks; see memory_pressure.h.
+
+#include "config.h"
+#include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#include "memory_pressure.h"
+#include "base/basictypes.h"
+#include "base/commandlineflags.h"
+#include "base/cycleclock.h"
+#include "base/spinlock.h"
+#include "base/sysinfo.h"
+#include "page_heap.h"
+#include "static_vars.h"
+
+DEFINE_int64(tcmalloc_memory_pressure_interval_ms,
+             EnvToInt64("TCMALLOC_MEMORY_PRESSURE_INTERVAL_MS", 1000),
+             "Call each memory pressure callback at most once every this"
+             " many milliseconds, however often its threshold is found"
+             " to be crossed.");
+
+namespace tcmalloc {
+
+Atomic32 memory_pressure_callback_count = 0;
+Atomic32 memory_pressure_pending = 0;
+
+namespace {
+
+struct Registration {
+  MallocExtension::MemoryPressureCallback fn;   // NULL if the slot is free
+  void* arg;
+  size_t heap_limit;
+  size_t rss_limit;
+  size_t free_floor;
+  int64 last_call;                              // CycleClock time
+};
+
+// Protects registrations.  Never held while a callback runs.
+SpinLock registration_lock(SpinLock::LINKER_INITIALIZED);
+Registration registrations[kMaxMemoryPressureCallbacks];
+
+// Registrations with a nonzero rss_limit; reading the RSS is a
+// system call, so we skip it when nobody asks
+int rss_watchers = 0;
+
+// Set while a thread runs callbacks.  Other threads, and allocation
+// by the callbacks themselves, do not wait for it.
+Atomic32 running = 0;
+
+// Returns the resident set size of the process, or 0 if unknown
+size_t ResidentBytes() {
+#if defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H)
+  // The second field of /proc/self/statm is the RSS in pages
+  const int fd = open("/proc/self/statm", O_RDONLY);
+  if (fd < 0) return 0;
+  char buf[128];
+  const ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) return 0;
+  buf[len] = '\0';
+  const char* p = strchr(buf, ' ');
+  if (p == NULL) return 0;
+  size_t pages = 0;
+  for (p++; *p >= '0' && *p <= '9'; p++) pages = pages * 10 + (*p - '0');
+  return pages * getpagesize();
+#else
+  return 0;
+#endif
+}
+
+bool Crossed(const Registration& r,
+             const MallocExtension::MemoryPressureInfo& info) {
+  return ((r.heap_limit != 0 && info.heap_bytes > r.heap_limit) ||
+          (r.rss_limit != 0 && info.rss_bytes > r.rss_limit) ||
+          (r.free_floor != 0 && info.free_bytes < r.free_floor));
+}
+
+}  // namespace
+
+void RunMemoryPressureCallbacks() {
+  if (base::subtle::Acquire_CompareAndSwap(&running, 0, 1) != 0) return;
+  base::subtle::NoBarrier_Store(&memory_pressure_pending, 0);
+
+  PageHeap::Stats stats;
+  Static::pageheap()->GetStats(&stats);
+  MallocExtension::MemoryPressureInfo info;
+  info.heap_bytes = stats.system_bytes;
+  info.free_bytes = stats.free_bytes + stats.unmapped_bytes;
+  info.rss_bytes = (rss_watchers > 0 ? ResidentBytes() : 0);
+
+  const int64 now = CycleClock::Now();
+  const int64 interval = static_cast<int64>(
+      CyclesPerSecond() * FLAGS_tcmalloc_memory_pressure_interval_ms / 1000);
+  Registration due[kMaxMemoryPressureCallbacks];
+  int num_due = 0;
+  {
+    SpinLockHolder h(&registration_lock);
+    for (int i = 0; i < kMaxMemoryPressureCallbacks; i++) {
+      Registration* r = &registrations[i];
+      if (r->fn == NULL || !Crossed(*r, info)) continue;
+      if (r->last_call != 0 && now - r->last_call < interval) continue;
+      r->last_call = now;
+      due[num_due++] = *r;
+    }
+  }
+
+  for (int i = 0; i < num_due; i++) {
+    (*due[i].fn)(&info, due[i].arg);
+  }
+  base::subtle::Release_Store(&running, 0);
+}
+
+bool AddMemoryPressureCallback(MallocExtension::MemoryPressureCallback fn,
+                               void* arg, size_t heap_limit,
+                               size_t rss_limit, size_t free_floor) {
+  if (fn == NULL) return false;
+  SpinLockHolder h(&registration_lock);
+  for (int i = 0; i < kMaxMemoryPressureCallbacks; i++) {
+    Registration* r = &registrations[i];
+    if (r->fn != NULL) continue;
+    r->fn = fn;
+    r->arg = arg;
+    r->heap_limit = heap_limit;
+    r->rss_limit = rss_limit;
+    r->free_floor = free_floor;
+    r->last_call = 0;
+    if (rss_limit != 0) rss_watchers++;
+    base::subtle::NoBarrier_Store(
+        &memory_pressure_callback_count,
+        base::subtle::NoBarrier_Load(&memory_pressure_callback_count) + 1);
+    return true;
+  }
+  return false;
+}
+
+bool RemoveMemoryPressureCallback(MallocExtension::MemoryPressureCallback fn,
+                                  void* arg) {
+  if (fn == NULL) return false;
+  SpinLockHolder h(&registration_lock);
+  for (int i = 0; i < kMaxMemoryPressureCallbacks; i++) {
+    Registration* r = &registrations[i];
+    if (r->fn != fn || r->arg != arg) continue;
+    r->fn = NULL;
+    if (r->rss_limit != 0) rss_watchers--;
+    base::subtle::NoBarrier_Store(
+        &memory_pressure_callback_count,
+        base::subtle::NoBarrier_Load(&memory_pressure_callback_count) - 1);
+    return true;
+  }
+  return false;
+}
+
+}  // namespace tcmalloc
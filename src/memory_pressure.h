@@ -0,0 +1,88 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Memory pressure callbacks; see
+// MallocExtension::AddMemoryPressureCallback() for what they promise.
+//
+// The page heap calls NoteMemoryPressureEvent() when it grows, when it
+// takes on or gives up a huge object mapped straight from the system,
+// and when its scavenger runs.  That happens under pageheap_lock, so it only
+// raises a flag.  The allocator calls PollMemoryPressure() at points
+// where it holds no lock and is not inside a thread cache (after the
+// slow paths of ThreadCache::Allocate() and Deallocate(), and after
+// page-level allocations and frees), and that checks the thresholds
+// and runs the callbacks that are due.
+
+#ifndef TCMALLOC_MEMORY_PRESSURE_H_
+#define TCMALLOC_MEMORY_PRESSURE_H_
+
+#include "config.h"
+#include <stddef.h>
+#include <google/malloc_extension.h>
+#include "base/atomicops.h"
+
+namespace tcmalloc {
+
+// Most callbacks that can be registered at once
+static const int kMaxMemoryPressureCallbacks = 16;
+
+// Nonzero while callbacks are registered
+extern Atomic32 memory_pressure_callback_count;
+// Nonzero when a check is owed
+extern Atomic32 memory_pressure_pending;
+
+inline void NoteMemoryPressureEvent() {
+  if (base::subtle::NoBarrier_Load(&memory_pressure_callback_count) != 0) {
+    base::subtle::NoBarrier_Store(&memory_pressure_pending, 1);
+  }
+}
+
+// Checks the thresholds and runs the callbacks that are due.  Returns
+// at once if another thread is at it, or if a callback on this thread
+// is allocating.
+void RunMemoryPressureCallbacks();
+
+inline void PollMemoryPressure() {
+  if (base::subtle::NoBarrier_Load(&memory_pressure_pending) != 0) {
+    RunMemoryPressureCallbacks();
+  }
+}
+
+// Implement the MallocExtension methods of the same names
+bool AddMemoryPressureCallback(MallocExtension::MemoryPressureCallback fn,
+                               void* arg, size_t heap_limit,
+                               size_t rss_limit, size_t free_floor);
+bool RemoveMemoryPressureCallback(MallocExtension::MemoryPressureCallback fn,
+                                  void* arg);
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_MEMORY_PRESSURE_H_
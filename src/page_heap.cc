@@ -31,8 +31,10 @@
 // Author: Sanjay Ghemawat <opensource@google.com>
 
 #include "config.h"
+#include <string.h>                    // for memcpy, memset
 #include "page_heap.h"
 
+#include "memory_pressure.h"
 #include "static_vars.h"
 #include "system-alloc.h"
 
@@ -43,18 +45,35 @@ DEFINE_double(tcmalloc_release_rate,
               "Increase this flag to return memory faster; decrease it "
               "to return memory slower.  Reasonable rates are in the "
               "range [0,10]");
+DEFINE_bool(tcmalloc_address_ordered_spans,
+            EnvToBool("TCMALLOC_ADDRESS_ORDERED_SPANS", false),
+            "If true, carve each span out of the lowest-addressed free"
+            " span that is big enough, instead of the smallest one that"
+            " was freed most recently.  This packs live data toward the"
+            " bottom of the heap, so that the top of the heap coalesces"
+            " and can be returned to the system, at the cost of keeping"
+            " the free lists sorted and searching all of them.");
 
 namespace tcmalloc {
 
+// Insert "span" into the address-ordered "list".  Freed spans tend to
+// be near the top of the heap, so search from the back.
+static void InsertByAddress(Span* list, Span* span) {
+  Span* prev = list->prev;
+  while (prev != list && prev->start > span->start) {
+    prev = prev->prev;
+  }
+  DLL_Prepend(prev, span);
+}
+
 PageHeap::PageHeap()
     : pagemap_(MetaDataAlloc),
-      pagemap_cache_(0),
-      free_pages_(0),
-      system_bytes_(0),
       scavenge_counter_(0),
       // Start scavenging at kMaxPages list
       scavenge_index_(kMaxPages-1) {
-  COMPILE_ASSERT(kNumClasses <= (1 << PageMapCache::kValuebits), valuebits);
+  // The pagemap keeps sizeclasses in a byte per page
+  COMPILE_ASSERT(kNumClasses <= 256, sizeclass_fits_in_a_byte);
+  memset(&stats_, 0, sizeof(stats_));
   DLL_Init(&large_.normal);
   DLL_Init(&large_.returned);
   for (int i = 0; i < kMaxPages; i++) {
@@ -63,9 +82,20 @@ PageHeap::PageHeap()
   }
 }
 
-Span* PageHeap::New(Length n) {
+Span* PageHeap::New(Length n, size_t* growth) {
   ASSERT(Check());
   ASSERT(n > 0);
+  *growth = 0;
+
+  if (FLAGS_tcmalloc_address_ordered_spans) {
+    Span* result = AllocLowest(n);
+    if (result != NULL) return result;
+    if (!GrowHeap(n, growth)) {
+      ASSERT(Check());
+      return NULL;
+    }
+    return AllocLowest(n);
+  }
 
   // Find first size >= n that has a non-empty list
   for (Length s = n; s < kMaxPages; s++) {
@@ -88,7 +118,7 @@ Span* PageHeap::New(Length n) {
   if (result != NULL) return result;
 
   // Grow the heap and try again
-  if (!GrowHeap(n)) {
+  if (!GrowHeap(n, growth)) {
     ASSERT(Check());
     return NULL;
   }
@@ -132,12 +162,46 @@ Span* PageHeap::AllocLarge(Length n) {
   return best == NULL ? NULL : Carve(best, n);
 }
 
+Span* PageHeap::AllocLowest(Length n) {
+  // The small-span lists are sorted, so we only need to look at the
+  // head of each one.  Large spans are few; search them all.
+  Span* best = NULL;
+  for (Length s = n; s < kMaxPages; s++) {
+    Span* normal = free_[s].normal.next;
+    if (normal != &free_[s].normal &&
+        (best == NULL || normal->start < best->start)) {
+      best = normal;
+    }
+    Span* returned = free_[s].returned.next;
+    if (returned != &free_[s].returned &&
+        (best == NULL || returned->start < best->start)) {
+      best = returned;
+    }
+  }
+  for (Span* span = large_.normal.next;
+       span != &large_.normal;
+       span = span->next) {
+    if (span->length >= n && (best == NULL || span->start < best->start)) {
+      best = span;
+    }
+  }
+  for (Span* span = large_.returned.next;
+       span != &large_.returned;
+       span = span->next) {
+    if (span->length >= n && (best == NULL || span->start < best->start)) {
+      best = span;
+    }
+  }
+  return best == NULL ? NULL : Carve(best, n);
+}
+
 Span* PageHeap::Split(Span* span, Length n) {
   ASSERT(0 < n);
   ASSERT(n < span->length);
   ASSERT(span->location == Span::IN_USE);
   ASSERT(span->sizeclass == 0);
   Event(span, 'T', n);
+  RecordInUseSpan(span, -1);
 
   const int extra = span->length - n;
   Span* leftover = NewSpan(span->start + n, extra);
@@ -146,6 +210,8 @@ Span* PageHeap::Split(Span* span, Length n) {
   RecordSpan(leftover);
   pagemap_.set(span->start + n - 1, span); // Update map from pageid to span
   span->length = n;
+  RecordInUseSpan(span, 1);
+  RecordInUseSpan(leftover, 1);
 
   return leftover;
 }
@@ -154,7 +220,7 @@ Span* PageHeap::Carve(Span* span, Length n) {
   ASSERT(n > 0);
   ASSERT(span->location != Span::IN_USE);
   const int old_location = span->location;
-  DLL_Remove(span);
+  RemoveFromFreeList(span);
   span->location = Span::IN_USE;
   Event(span, 'A', n);
 
@@ -166,17 +232,13 @@ Span* PageHeap::Carve(Span* span, Length n) {
     Event(leftover, 'S', extra);
     RecordSpan(leftover);
 
-    // Place leftover span on appropriate free list
-    SpanList* listpair = (extra < kMaxPages) ? &free_[extra] : &large_;
-    Span* dst = (leftover->location == Span::ON_RETURNED_FREELIST
-                 ? &listpair->returned : &listpair->normal);
-    DLL_Prepend(dst, leftover);
+    AddToFreeList(leftover);
 
     span->length = n;
     pagemap_.set(span->start + n - 1, span);
   }
+  RecordInUseSpan(span, 1);
   ASSERT(Check());
-  free_pages_ -= n;
   return span;
 }
 
@@ -186,8 +248,15 @@ void PageHeap::Delete(Span* span) {
   ASSERT(span->length > 0);
   ASSERT(GetDescriptor(span->start) == span);
   ASSERT(GetDescriptor(span->start + span->length - 1) == span);
+  if (span->sizeclass != 0) {
+    for (Length i = 0; i < span->length; i++) {
+      pagemap_.set_sizeclass(span->start + i, 0);
+    }
+  } else {
+    RecordInUseSpan(span, -1);
+  }
   span->sizeclass = 0;
-  span->sample = 0;
+  ASSERT(!span->sampled);
 
   // Coalesce -- we guarantee that "p" != 0, so no bounds checking
   // necessary.  We do not bother resetting the stale pagemap
@@ -204,7 +273,7 @@ void PageHeap::Delete(Span* span) {
     // Merge preceding span into this span
     ASSERT(prev->start + prev->length == p);
     const Length len = prev->length;
-    DLL_Remove(prev);
+    RemoveFromFreeList(prev);
     DeleteSpan(prev);
     span->start -= len;
     span->length += len;
@@ -216,7 +285,7 @@ void PageHeap::Delete(Span* span) {
     // Merge next span into this span
     ASSERT(next->start == p+n);
     const Length len = next->length;
-    DLL_Remove(next);
+    RemoveFromFreeList(next);
     DeleteSpan(next);
     span->length += len;
     pagemap_.set(span->start + span->length - 1, span);
@@ -225,12 +294,7 @@ void PageHeap::Delete(Span* span) {
 
   Event(span, 'D', span->length);
   span->location = Span::ON_NORMAL_FREELIST;
-  if (span->length < kMaxPages) {
-    DLL_Prepend(&free_[span->length].normal, span);
-  } else {
-    DLL_Prepend(&large_.normal, span);
-  }
-  free_pages_ += n;
+  AddToFreeList(span);
 
   IncrementalScavenge(n);
   ASSERT(Check());
@@ -240,6 +304,7 @@ void PageHeap::IncrementalScavenge(Length n) {
   // Fast path; not yet time to release memory
   scavenge_counter_ -= n;
   if (scavenge_counter_ >= 0) return;  // Not yet time to scavenge
+  NoteMemoryPressureEvent();
 
   // Never delay scavenging for more than the following number of
   // deallocated pages.  With 4K pages, this comes to 4GB of
@@ -263,14 +328,15 @@ void PageHeap::IncrementalScavenge(Length n) {
     if (index > kMaxPages) index = 0;
     SpanList* slist = (index == kMaxPages) ? &large_ : &free_[index];
     if (!DLL_IsEmpty(&slist->normal)) {
-      // Release the last span on the normal portion of this list
+      // Release the last span on the normal portion of this list.
+      // With address-ordered lists, that is the highest one.
       Span* s = slist->normal.prev;
       ASSERT(s->location == Span::ON_NORMAL_FREELIST);
-      DLL_Remove(s);
+      RemoveFromFreeList(s);
       TCMalloc_SystemRelease(reinterpret_cast<void*>(s->start << kPageShift),
                              static_cast<size_t>(s->length << kPageShift));
       s->location = Span::ON_RETURNED_FREELIST;
-      DLL_Prepend(&slist->returned, s);
+      AddToFreeList(s);
 
       // Compute how long to wait until we return memory.
       // FLAGS_tcmalloc_release_rate==1 means wait for 1000 pages
@@ -293,38 +359,147 @@ void PageHeap::IncrementalScavenge(Length n) {
   scavenge_counter_ = kDefaultReleaseDelay;
 }
 
+void PageHeap::AddToFreeList(Span* span) {
+  ASSERT(span->location != Span::IN_USE);
+  SpanList* listpair = (span->length < kMaxPages) ? &free_[span->length]
+                                                  : &large_;
+  Span* list = (span->location == Span::ON_RETURNED_FREELIST
+                ? &listpair->returned : &listpair->normal);
+  // AllocLarge() does its own address-ordered search of large_
+  if (FLAGS_tcmalloc_address_ordered_spans && span->length < kMaxPages) {
+    InsertByAddress(list, span);
+  } else {
+    DLL_Prepend(list, span);
+  }
+  RecordFreeSpan(span, 1);
+}
+
+void PageHeap::RemoveFromFreeList(Span* span) {
+  ASSERT(span->location != Span::IN_USE);
+  RecordFreeSpan(span, -1);
+  DLL_Remove(span);
+}
+
+void PageHeap::RecordFreeSpan(const Span* span, int delta) {
+  const bool returned = (span->location == Span::ON_RETURNED_FREELIST);
+  const int64_t bytes = delta * static_cast<int64_t>(span->length << kPageShift);
+  stats_seq_.BeginWrite();
+  if (returned) {
+    stats_.unmapped_bytes += bytes;
+  } else {
+    stats_.free_bytes += bytes;
+  }
+  if (span->length < kMaxPages) {
+    (returned ? stats_.returned_spans : stats_.normal_spans)[span->length] +=
+        delta;
+  } else if (returned) {
+    stats_.large_returned_spans += delta;
+    stats_.large_returned_pages += delta * static_cast<int64_t>(span->length);
+  } else {
+    stats_.large_normal_spans += delta;
+    stats_.large_normal_pages += delta * static_cast<int64_t>(span->length);
+  }
+  stats_seq_.EndWrite();
+}
+
+void PageHeap::RecordInUseSpan(const Span* span, int delta) {
+  const int bucket = FineHistogramBucket(span->length);
+  ASSERT(bucket < kSpanHistogramSize);
+  stats_seq_.BeginWrite();
+  stats_.inuse_spans[bucket] += delta;
+  stats_.inuse_pages += delta * static_cast<int64_t>(span->length);
+  stats_seq_.EndWrite();
+}
+
+void PageHeap::GetStats(Stats* stats) const {
+  Atomic32 seq;
+  do {
+    seq = stats_seq_.BeginRead();
+    memcpy(stats, &stats_, sizeof(*stats));
+  } while (stats_seq_.RetryRead(seq));
+}
+
+Span* PageHeap::RegisterDirect(void* start, Length n) {
+  const PageID p = reinterpret_cast<uintptr_t>(start) >> kPageShift;
+  ASSERT(n > 0);
+  // Nothing ever looks up the interior pages of a huge object, so we
+  // do not make the pagemap allocate nodes for them
+  if (!pagemap_.Ensure(p, 1) || !pagemap_.Ensure(p + n - 1, 1)) {
+    return NULL;
+  }
+  Span* span = NewSpan(p, n);
+  span->direct = 1;
+  Event(span, 'M', n);
+  RecordSpan(span);
+  RecordInUseSpan(span, 1);
+  stats_seq_.BeginWrite();
+  stats_.system_bytes += n << kPageShift;
+  stats_.direct_spans++;
+  stats_.direct_bytes += n << kPageShift;
+  stats_seq_.EndWrite();
+  NoteMemoryPressureEvent();
+  return span;
+}
+
+void PageHeap::UnregisterDirect(Span* span) {
+  ASSERT(span->direct);
+  ASSERT(span->location == Span::IN_USE);
+  ASSERT(span->sizeclass == 0);
+  ASSERT(!span->sampled);
+  // Clear the map so that coalescing in Delete() cannot find this span
+  // next to a page heap span, and free() cannot find it any more
+  pagemap_.set(span->start, NULL);
+  pagemap_.set(span->start + span->length - 1, NULL);
+  RecordInUseSpan(span, -1);
+  stats_seq_.BeginWrite();
+  stats_.system_bytes -= span->length << kPageShift;
+  stats_.direct_spans--;
+  stats_.direct_bytes -= span->length << kPageShift;
+  stats_seq_.EndWrite();
+  NoteMemoryPressureEvent();
+  DeleteSpan(span);
+}
+
 void PageHeap::RegisterSizeClass(Span* span, size_t sc) {
   // Associate span object with all interior pages as well
   ASSERT(span->location == Span::IN_USE);
   ASSERT(GetDescriptor(span->start) == span);
   ASSERT(GetDescriptor(span->start+span->length-1) == span);
   Event(span, 'C', sc);
+  RecordInUseSpan(span, -1);    // No longer a large object
   span->sizeclass = sc;
   for (Length i = 1; i < span->length-1; i++) {
     pagemap_.set(span->start+i, span);
   }
+  for (Length i = 0; i < span->length; i++) {
+    pagemap_.set_sizeclass(span->start+i, sc);
+  }
 }
 
 static double PagesToMB(uint64_t pages) {
   return (pages << kPageShift) / 1048576.0;
 }
 
-void PageHeap::Dump(TCMalloc_Printer* out) {
+void PageHeap::Dump(TCMalloc_Printer* out) const {
+  Stats stats;
+  GetStats(&stats);
+
   int nonempty_sizes = 0;
   for (int s = 0; s < kMaxPages; s++) {
-    if (!DLL_IsEmpty(&free_[s].normal) || !DLL_IsEmpty(&free_[s].returned)) {
+    if (stats.normal_spans[s] + stats.returned_spans[s] > 0) {
       nonempty_sizes++;
     }
   }
   out->printf("------------------------------------------------\n");
-  out->printf("PageHeap: %d sizes; %6.1f MB free\n",
-              nonempty_sizes, PagesToMB(free_pages_));
+  out->printf("PageHeap: %d sizes; %6.1f MB free; %6.1f MB unmapped\n",
+              nonempty_sizes, stats.free_bytes / 1048576.0,
+              stats.unmapped_bytes / 1048576.0);
   out->printf("------------------------------------------------\n");
   uint64_t total_normal = 0;
   uint64_t total_returned = 0;
   for (int s = 0; s < kMaxPages; s++) {
-    const int n_length = DLL_Length(&free_[s].normal);
-    const int r_length = DLL_Length(&free_[s].returned);
+    const int n_length = stats.normal_spans[s];
+    const int r_length = stats.returned_spans[s];
     if (n_length + r_length > 0) {
       uint64_t n_pages = s * n_length;
       uint64_t r_pages = s * r_length;
@@ -341,44 +516,37 @@ void PageHeap::Dump(TCMalloc_Printer* out) {
     }
   }
 
-  uint64_t n_pages = 0;
-  uint64_t r_pages = 0;
-  int n_spans = 0;
-  int r_spans = 0;
-  out->printf("Normal large spans:\n");
-  for (Span* s = large_.normal.next; s != &large_.normal; s = s->next) {
-    out->printf("   [ %6" PRIuS " pages ] %6.1f MB\n",
-                s->length, PagesToMB(s->length));
-    n_pages += s->length;
-    n_spans++;
-  }
-  out->printf("Unmapped large spans:\n");
-  for (Span* s = large_.returned.next; s != &large_.returned; s = s->next) {
-    out->printf("   [ %6" PRIuS " pages ] %6.1f MB\n",
-                s->length, PagesToMB(s->length));
-    r_pages += s->length;
-    r_spans++;
-  }
+  const uint64_t n_pages = stats.large_normal_pages;
+  const uint64_t r_pages = stats.large_returned_pages;
   total_normal += n_pages;
   total_returned += r_pages;
   out->printf(">255   large * %6u spans ~ %6.1f MB; %6.1f MB cum"
               "; unmapped: %6.1f MB; %6.1f MB cum\n",
-              (n_spans + r_spans),
+              (stats.large_normal_spans + stats.large_returned_spans),
               PagesToMB(n_pages + r_pages),
               PagesToMB(total_normal + total_returned),
               PagesToMB(r_pages),
               PagesToMB(total_returned));
+  out->printf("Direct-mapped objects: %6d spans ~ %6.1f MB\n",
+              stats.direct_spans, stats.direct_bytes / 1048576.0);
 }
 
-static void RecordGrowth(size_t growth) {
+void RecordHeapGrowth(size_t growth) {
+  if (growth == 0) return;
+  StackTrace stack;
+  stack.depth = GetStackTrace(stack.stack, kMaxStackDepth-1, 1);
+  stack.size = growth;
+
+  // The growth stacks live with the other stack traces, under the
+  // sample lock, so reading them does not hold up the page heap.
+  TimedSpinLockHolder h(Static::sample_lock());
   StackTrace* t = Static::stacktrace_allocator()->New();
-  t->depth = GetStackTrace(t->stack, kMaxStackDepth-1, 3);
-  t->size = growth;
+  *t = stack;
   t->stack[kMaxStackDepth-1] = reinterpret_cast<void*>(Static::growth_stacks());
   Static::set_growth_stacks(t);
 }
 
-bool PageHeap::GrowHeap(Length n) {
+bool PageHeap::GrowHeap(Length n, size_t* growth) {
   ASSERT(kMaxPages >= kMinSystemAlloc);
   if (n > kMaxValidPages) return false;
   Length ask = (n>kMinSystemAlloc) ? n : static_cast<Length>(kMinSystemAlloc);
@@ -393,10 +561,13 @@ bool PageHeap::GrowHeap(Length n) {
     if (ptr == NULL) return false;
   }
   ask = actual_size >> kPageShift;
-  RecordGrowth(ask << kPageShift);
+  *growth = ask << kPageShift;
 
-  uint64_t old_system_bytes = system_bytes_;
-  system_bytes_ += (ask << kPageShift);
+  const uint64_t old_system_bytes = stats_.system_bytes;
+  stats_seq_.BeginWrite();
+  stats_.system_bytes += (ask << kPageShift);
+  stats_seq_.EndWrite();
+  NoteMemoryPressureEvent();
   const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
   ASSERT(p > 0);
 
@@ -405,7 +576,7 @@ bool PageHeap::GrowHeap(Length n) {
   // when a program keeps allocating and freeing large blocks.
 
   if (old_system_bytes < kPageMapBigAllocationThreshold
-      && system_bytes_ >= kPageMapBigAllocationThreshold) {
+      && stats_.system_bytes >= kPageMapBigAllocationThreshold) {
     pagemap_.PreallocateMoreMemory();
   }
 
@@ -416,9 +587,11 @@ bool PageHeap::GrowHeap(Length n) {
     // Pretend the new area is allocated and then Delete() it to
     // cause any necessary coalescing to occur.
     //
-    // We do not adjust free_pages_ here since Delete() will do it for us.
+    // We do not adjust stats_.free_bytes here since Delete() will do
+    // it for us.
     Span* span = NewSpan(p, ask);
     RecordSpan(span);
+    RecordInUseSpan(span, 1);   // Delete() will take it out again
     Delete(span);
     ASSERT(Check());
     return true;
@@ -458,15 +631,28 @@ bool PageHeap::CheckList(Span* list, Length min_pages, Length max_pages,
   return true;
 }
 
-static void ReleaseFreeList(Span* list, Span* returned) {
+void PageHeap::ReleaseFreeList(Span* list, Span* returned) {
   // Walk backwards through list so that when we push these
   // spans on the "returned" list, we preserve the order.
+  // If both lists are kept in address order, the spans come off "list"
+  // highest first, so one backward pass over "returned" finds where
+  // each of them goes; AddToFreeList() would search it from the back
+  // for every span.
+  Span* prev = returned->prev;
   while (!DLL_IsEmpty(list)) {
     Span* s = list->prev;
-    DLL_Remove(s);
-    DLL_Prepend(returned, s);
     ASSERT(s->location == Span::ON_NORMAL_FREELIST);
+    RemoveFromFreeList(s);
     s->location = Span::ON_RETURNED_FREELIST;
+    if (FLAGS_tcmalloc_address_ordered_spans && s->length < kMaxPages) {
+      while (prev != returned && prev->start > s->start) {
+        prev = prev->prev;
+      }
+      DLL_Prepend(prev, s);
+      RecordFreeSpan(s, 1);
+    } else {
+      AddToFreeList(s);
+    }
     TCMalloc_SystemRelease(reinterpret_cast<void*>(s->start << kPageShift),
                            static_cast<size_t>(s->length << kPageShift));
   }
@@ -477,6 +663,7 @@ void PageHeap::ReleaseFreePages() {
     ReleaseFreeList(&free_[s].normal, &free_[s].returned);
   }
   ReleaseFreeList(&large_.normal, &large_.returned);
+  NoteMemoryPressureEvent();
   ASSERT(Check());
 }
 
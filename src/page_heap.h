@@ -34,8 +34,8 @@
 #define TCMALLOC_PAGE_HEAP_H_
 
 #include "config.h"
+#include "base/seqlock.h"
 #include "common.h"
-#include "packed-cache-inl.h"
 #include "pagemap.h"
 #include "span.h"
 
@@ -55,21 +55,19 @@ namespace tcmalloc {
 // -------------------------------------------------------------------------
 
 // We use PageMap2<> for 32-bit and PageMap3<> for 64-bit machines.
-// We also use a simple one-level cache for hot PageID-to-sizeclass mappings,
+// The leaves of the map also hold the sizeclass of every page,
 // because sometimes the sizeclass is all the information we need.
 
 // Selector class -- general selector uses 3-level map
 template <int BITS> class MapSelector {
  public:
   typedef TCMalloc_PageMap3<BITS-kPageShift> Type;
-  typedef PackedCache<BITS-kPageShift, uint64_t> CacheType;
 };
 
 // A two-level map for 32-bit machines
 template <> class MapSelector<32> {
  public:
   typedef TCMalloc_PageMap2<32-kPageShift> Type;
-  typedef PackedCache<32-kPageShift, uint16_t> CacheType;
 };
 
 // -------------------------------------------------------------------------
@@ -82,18 +80,74 @@ template <> class MapSelector<32> {
 
 class PageHeap {
  public:
+  // Minimum number of pages to fetch from system at a time.  Must be
+  // significantly bigger than kBlockSize to amortize system-call
+  // overhead, and also to reduce external fragementation.  Also, we
+  // should keep this value big because various incarnations of Linux
+  // have small limits on the number of mmap() regions per
+  // address-space.
+  static const int kMinSystemAlloc = 1 << (20 - kPageShift);
+
+  // For all span-lengths < kMaxPages we keep an exact-size list.
+  // REQUIRED: kMaxPages >= kMinSystemAlloc;
+  static const size_t kMaxPages = kMinSystemAlloc;
+
+  // Size of the in-use span histogram in Stats, indexed by
+  // FineHistogramBucket(span length)
+  static const int kSpanHistogramSize =
+      (8 * sizeof(Length)) << kHistogramSubBits;
+
+  // Counters describing the state of the heap.  They are updated
+  // under Static::pageheap_lock like everything else, and can be read
+  // without it through GetStats().
+  struct Stats {
+    uint64_t system_bytes;          // Bytes allocated from system
+    uint64_t free_bytes;            // Bytes in free, mapped spans
+    uint64_t unmapped_bytes;        // Bytes in free, unmapped spans
+    int normal_spans[kMaxPages];    // Free, mapped spans of each length
+    int returned_spans[kMaxPages];  // Free, unmapped spans of each length
+    int large_normal_spans;         // Same, for spans >= kMaxPages ...
+    int large_returned_spans;
+    uint64_t large_normal_pages;    // ... and their total lengths
+    uint64_t large_returned_pages;
+
+    // Spans handed out by New() that were not carved into small
+    // objects (see RegisterSizeClass()), that is, large objects
+    int inuse_spans[kSpanHistogramSize];
+    uint64_t inuse_pages;           // Total length of those spans
+
+    // Spans mapped directly from the system (see RegisterDirect()).
+    // These are also counted in system_bytes and the in-use histogram.
+    int direct_spans;
+    uint64_t direct_bytes;
+  };
+
   PageHeap();
 
   // Allocate a run of "n" pages.  Returns zero if out of memory.
   // Caller should not pass "n == 0" -- instead, n should have
-  // been rounded up already.
-  Span* New(Length n);
+  // been rounded up already.  Sets "*growth" to the number of bytes
+  // the heap grew by to satisfy the request, usually 0; the caller
+  // passes it to RecordHeapGrowth() once it has released
+  // pageheap_lock.
+  Span* New(Length n, size_t* growth);
 
   // Delete the span "[p, p+n-1]".
   // REQUIRES: span was returned by earlier call to New() and
   //           has not yet been deleted.
   void Delete(Span* span);
 
+  // Make a span for the "n" pages at "start", which the caller mapped
+  // straight from the system for a single huge object.  The span is
+  // in use, never sits on a free list, and never coalesces with its
+  // neighbours; only its first and last pages are entered in the
+  // pagemap.  Returns NULL if the pagemap cannot cover the pages.
+  Span* RegisterDirect(void* start, Length n);
+
+  // Forget "span", which came from RegisterDirect(), and delete it.
+  // The caller then unmaps its pages.
+  void UnregisterDirect(Span* span);
+
   // Mark an allocated span as being used for small objects of the
   // specified size-class.
   // REQUIRES: span was returned by an earlier call to New()
@@ -115,15 +169,21 @@ class PageHeap {
     return reinterpret_cast<Span*>(pagemap_.get(p));
   }
 
-  // Dump state to stderr
-  void Dump(TCMalloc_Printer* out);
+  // Dump state to "out".  Does not need Static::pageheap_lock.
+  void Dump(TCMalloc_Printer* out) const;
+
+  // Copy a consistent snapshot of the counters into "*stats".  Does
+  // not need Static::pageheap_lock, and never makes allocation wait.
+  void GetStats(Stats* stats) const;
 
-  // Return number of bytes allocated from system
-  inline uint64_t SystemBytes() const { return system_bytes_; }
+  // Return number of bytes allocated from system.
+  // REQUIRES: Static::pageheap_lock is held, or use GetStats().
+  inline uint64_t SystemBytes() const { return stats_.system_bytes; }
 
-  // Return number of free bytes in heap
+  // Return number of free bytes in heap, mapped or not.
+  // REQUIRES: Static::pageheap_lock is held, or use GetStats().
   uint64_t FreeBytes() const {
-    return (static_cast<uint64_t>(free_pages_) << kPageShift);
+    return stats_.free_bytes + stats_.unmapped_bytes;
   }
 
   bool Check();
@@ -135,38 +195,26 @@ class PageHeap {
   // Release all pages on the free list for reuse by the OS:
   void ReleaseFreePages();
 
-  // Return 0 if we have no information, or else the correct sizeclass for p.
-  // Reads and writes to pagemap_cache_ do not require locking.
-  // The entries are 64 bits on 64-bit hardware and 16 bits on
-  // 32-bit hardware, and we don't mind raciness as long as each read of
-  // an entry yields a valid entry, not a partially updated entry.
-  size_t GetSizeClassIfCached(PageID p) const {
-    return pagemap_cache_.GetOrDefault(p, 0);
+  // Return the sizeclass of the objects on page p, or 0 if p is not part
+  // of a span of small objects.  Also returns 0 for pages holding the
+  // start of a sampled object (see sampler.h), so that freeing one
+  // takes the slow path.  Reads do not require locking: the entries
+  // are single bytes, and they only change while no object starting
+  // on the page is live, or under Static::sample_lock().
+  size_t GetSizeClass(PageID p) const {
+    return pagemap_.sizeclass(p);
   }
-  void CacheSizeClass(PageID p, size_t cl) const { pagemap_cache_.Put(p, cl); }
+  // REQUIRES: p belongs to a span that is in use.
+  void SetSizeClass(PageID p, size_t cl) { pagemap_.set_sizeclass(p, cl); }
 
  private:
   // Allocates a big block of memory for the pagemap once we reach more than
   // 128MB
   static const size_t kPageMapBigAllocationThreshold = 128 << 20;
 
-  // Minimum number of pages to fetch from system at a time.  Must be
-  // significantly bigger than kBlockSize to amortize system-call
-  // overhead, and also to reduce external fragementation.  Also, we
-  // should keep this value big because various incarnations of Linux
-  // have small limits on the number of mmap() regions per
-  // address-space.
-  static const int kMinSystemAlloc = 1 << (20 - kPageShift);
-
-  // For all span-lengths < kMaxPages we keep an exact-size list.
-  // REQUIRED: kMaxPages >= kMinSystemAlloc;
-  static const size_t kMaxPages = kMinSystemAlloc;
-
-  // Pick the appropriate map and cache types based on pointer size
+  // Pick the appropriate map type based on pointer size
   typedef MapSelector<8*sizeof(uintptr_t)>::Type PageMap;
-  typedef MapSelector<8*sizeof(uintptr_t)>::CacheType PageMapCache;
   PageMap pagemap_;
-  mutable PageMapCache pagemap_cache_;
 
   // We segregate spans of a given size into two circular linked
   // lists: one for normal spans, and one for spans whose memory
@@ -182,23 +230,45 @@ class PageHeap {
   // Array mapping from span length to a doubly linked list of free spans
   SpanList free_[kMaxPages];
 
-  // Number of pages kept in free lists
-  uintptr_t free_pages_;
-
-  // Bytes allocated from system
-  uint64_t system_bytes_;
+  // Counters for GetStats().  Every change to stats_ is bracketed by
+  // stats_seq_.BeginWrite() and EndWrite(); the writers are already
+  // serialized by Static::pageheap_lock.
+  Stats stats_;
+  SeqLock stats_seq_;
 
-  bool GrowHeap(Length n);
+  // Adds at least "n" pages from the system, and sets "*growth" to
+  // the number of bytes added.
+  bool GrowHeap(Length n, size_t* growth);
 
   // REQUIRES: span->length >= n
   // REQUIRES: span->location != IN_USE
   // Remove span from its free list, and move any leftover part of
   // span into appropriate free lists.  Also update "span" to have
   // length exactly "n" and mark it as non-free so it can be returned
-  // to the client.  After all that, decrease free_pages_ by n and
-  // return span.
+  // to the client.  After all that, return span.
   Span* Carve(Span* span, Length n);
 
+  // Put "span" on the free list matching its length and location.
+  // When FLAGS_tcmalloc_address_ordered_spans is set, the lists for
+  // small spans are kept sorted by address (lowest first) so that
+  // New() hands out the lowest suitable span.
+  // REQUIRES: span->location != IN_USE
+  void AddToFreeList(Span* span);
+
+  // Take "span" off its free list.
+  // REQUIRES: span->location != IN_USE
+  void RemoveFromFreeList(Span* span);
+
+  // Add or remove "span" to or from stats_, as a free span.
+  void RecordFreeSpan(const Span* span, int delta);
+
+  // Add or remove "span" to or from stats_, as a large object.
+  void RecordInUseSpan(const Span* span, int delta);
+
+  // Move every span on "list" to "returned", the matching returned
+  // list, and return its memory to the system.
+  void ReleaseFreeList(Span* list, Span* returned);
+
   void RecordSpan(Span* span) {
     pagemap_.set(span->start, span);
     if (span->length > 1) {
@@ -210,6 +280,12 @@ class PageHeap {
   // span of exactly the specified length.  Else, returns NULL.
   Span* AllocLarge(Length n);
 
+  // Allocate a span of length == n from the lowest-addressed free
+  // span that is big enough (address-ordered first fit).  Used instead
+  // of the searches above when FLAGS_tcmalloc_address_ordered_spans
+  // is set.  Returns NULL if no free span is big enough.
+  Span* AllocLowest(Length n);
+
   // Incrementally release some memory to the system.
   // IncrementalScavenge(n) is called whenever n pages are freed.
   void IncrementalScavenge(Length n);
@@ -221,6 +297,12 @@ class PageHeap {
   int scavenge_index_;
 };
 
+// Remembers the current stack as one that grew the heap by "growth"
+// bytes, for MallocExtension::GetHeapGrowthStacks().  Does nothing if
+// "growth" is 0.  Unwinding the stack is slow, so call this with no
+// allocator lock held; it takes sample_lock itself.
+void RecordHeapGrowth(size_t growth);
+
 }  // namespace tcmalloc
 
 #endif  // TCMALLOC_PAGE_HEAP_H_
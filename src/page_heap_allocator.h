@@ -37,6 +37,14 @@ namespace tcmalloc {
 
 // Simple allocator for objects of a specified type.  External locking
 // is required before accessing one of these objects.
+//
+// Objects are carved out of metadata chunks (see MetaDataChunkAlloc()),
+// each of which keeps its own free list and count of live objects.
+// Once every object in a chunk is freed, the chunk goes back to a pool
+// shared by all allocators, so memory that held, say, spans can later
+// hold thread caches.  We hang on to one chunk with room in it, so an
+// allocator hovering around a chunk boundary doesn't keep trading
+// chunks with the pool.
 template <class T>
 class PageHeapAllocator {
  public:
@@ -44,58 +52,117 @@ class PageHeapAllocator {
   // allocated and their constructors might not have run by the time some
   // other static variable tries to allocate memory.
   void Init() {
-    ASSERT(kAlignedSize <= kAllocIncrement);
+    CHECK_CONDITION(kObjectOffset + kAlignedSize <= kMetaDataChunkSize);
     inuse_ = 0;
-    free_area_ = NULL;
-    free_avail_ = 0;
-    free_list_ = NULL;
+    chunks_ = 0;
+    partial_ = NULL;
     // Reserve some space at the beginning to avoid fragmentation.
     Delete(New());
   }
 
   T* New() {
-    // Consult free list
+    Chunk* chunk = partial_;
+    if (chunk == NULL) {
+      // Every chunk we have is full
+      chunk = reinterpret_cast<Chunk*>(MetaDataChunkAlloc());
+      CHECK_CONDITION(chunk != NULL);
+      chunk->free_list = NULL;
+      chunk->carved = kObjectOffset;
+      chunk->inuse = 0;
+      Push(chunk);
+      chunks_++;
+    }
+
+    // Consult the chunk's free list before carving a new object
     void* result;
-    if (free_list_ != NULL) {
-      result = free_list_;
-      free_list_ = *(reinterpret_cast<void**>(result));
+    if (chunk->free_list != NULL) {
+      result = chunk->free_list;
+      chunk->free_list = *(reinterpret_cast<void**>(result));
     } else {
-      if (free_avail_ < kAlignedSize) {
-        // Need more room
-        free_area_ = reinterpret_cast<char*>(MetaDataAlloc(kAllocIncrement));
-        CHECK_CONDITION(free_area_ != NULL);
-        free_avail_ = kAllocIncrement;
-      }
-      result = free_area_;
-      free_area_ += kAlignedSize;
-      free_avail_ -= kAlignedSize;
+      result = reinterpret_cast<char*>(chunk) + chunk->carved;
+      chunk->carved += kAlignedSize;
     }
+    chunk->inuse++;
     inuse_++;
+    if (IsFull(chunk)) Unlink(chunk);
     return reinterpret_cast<T*>(result);
   }
 
   void Delete(T* p) {
-    *(reinterpret_cast<void**>(p)) = free_list_;
-    free_list_ = p;
+    Chunk* chunk = ChunkOf(p);
+    if (IsFull(chunk)) Push(chunk);
+    *(reinterpret_cast<void**>(p)) = chunk->free_list;
+    chunk->free_list = p;
+    chunk->inuse--;
     inuse_--;
+    if (chunk->inuse == 0 && (chunk != partial_ || chunk->next != NULL)) {
+      // Some other chunk has room, so this one can go
+      Unlink(chunk);
+      chunks_--;
+      MetaDataChunkFree(chunk);
+    }
   }
 
   int inuse() const { return inuse_; }
 
+  // Bytes of chunks this allocator holds, including free space in them
+  size_t held_bytes() const { return chunks_ * kMetaDataChunkSize; }
+
+  // Bytes each object takes up in a chunk
+  size_t object_size() const { return kAlignedSize; }
+
  private:
-  // How much to allocate from system at a time
-  static const int kAllocIncrement = 128 << 10;
+  // Sits at the start of each chunk.  The chunks with room for another
+  // object are on a doubly linked list headed by partial_.
+  struct Chunk {
+    Chunk* next;
+    Chunk* prev;
+    void* free_list;            // Objects freed since they were carved
+    size_t carved;              // Offset of the first never-used byte
+    int inuse;                  // Number of allocated but unfreed objects
+  };
+
+  // Objects start on the first cache line after the chunk header
+  static const size_t kObjectOffset =
+      ((sizeof(Chunk) + kCacheLineSize - 1) / kCacheLineSize) * kCacheLineSize;
 
   // Aligned size of T
   static const size_t kAlignedSize
   = (((sizeof(T) + kAlignment - 1) / kAlignment) * kAlignment);
 
-  // Free area from which to carve new objects
-  char* free_area_;
-  size_t free_avail_;
+  // Chunks are aligned to their size, so we find an object's chunk by
+  // masking its address.
+  static Chunk* ChunkOf(void* p) {
+    return reinterpret_cast<Chunk*>(reinterpret_cast<uintptr_t>(p) &
+                                    ~(kMetaDataChunkSize - 1));
+  }
+
+  static bool IsFull(const Chunk* chunk) {
+    return (chunk->free_list == NULL &&
+            chunk->carved + kAlignedSize > kMetaDataChunkSize);
+  }
+
+  void Push(Chunk* chunk) {
+    chunk->prev = NULL;
+    chunk->next = partial_;
+    if (partial_ != NULL) partial_->prev = chunk;
+    partial_ = chunk;
+  }
+
+  void Unlink(Chunk* chunk) {
+    if (chunk->prev != NULL) {
+      chunk->prev->next = chunk->next;
+    } else {
+      partial_ = chunk->next;
+    }
+    if (chunk->next != NULL) chunk->next->prev = chunk->prev;
+  }
+
+  // Chunks with room for another object
+  Chunk* partial_;
 
-  // Free list of already carved objects
-  void* free_list_;
+  // Number of chunks we hold, full or not
+  size_t chunks_;
 
   // Number of allocated but unfreed objects
   int inuse_;
@@ -38,6 +38,10 @@
 // a three-level radix tree that strips away approximately 1/3rd of
 // the bits every time.
 //
+// Alongside each pointer the map keeps one byte holding the size-class
+// of the page, so callers that only need the size-class never have to
+// dereference the pointer.
+//
 // The BITS parameter should be the number of bits required to hold
 // a page number.  E.g., with 32 bit pointers and 4K pages (i.e.,
 // page offset fits in lower 12 bits), BITS == 20.
@@ -62,6 +66,7 @@ class TCMalloc_PageMap1 {
   static const int LENGTH = 1 << BITS;
 
   void** array_;
+  unsigned char* sizeclass_;
 
  public:
   typedef uintptr_t Number;
@@ -69,6 +74,8 @@ class TCMalloc_PageMap1 {
   explicit TCMalloc_PageMap1(void* (*allocator)(size_t)) {
     array_ = reinterpret_cast<void**>((*allocator)(sizeof(void*) << BITS));
     memset(array_, 0, sizeof(void*) << BITS);
+    sizeclass_ = reinterpret_cast<unsigned char*>((*allocator)(1 << BITS));
+    memset(sizeclass_, 0, 1 << BITS);
   }
 
   // Ensure that the map contains initialized entries "x .. x+n-1".
@@ -99,6 +106,22 @@ class TCMalloc_PageMap1 {
   void set(Number k, void* v) {
     array_[k] = v;
   }
+
+  // REQUIRES "k" is in range "[0,2^BITS-1]".
+  // REQUIRES "k" has been ensured before.
+  //
+  // Return the size-class recorded for KEY, or 0 if none.
+  size_t sizeclass(Number k) const {
+    return sizeclass_[k];
+  }
+
+  // REQUIRES "k" is in range "[0,2^BITS-1]".
+  // REQUIRES "k" has been ensured before.
+  //
+  // Record the size-class for KEY.
+  void set_sizeclass(Number k, size_t cl) {
+    sizeclass_[k] = static_cast<unsigned char>(cl);
+  }
 };
 
 // Two-level radix tree
@@ -112,9 +135,11 @@ class TCMalloc_PageMap2 {
   static const int LEAF_BITS = BITS - ROOT_BITS;
   static const int LEAF_LENGTH = 1 << LEAF_BITS;
 
-  // Leaf node
+  // Leaf node.  The size-classes sit next to the values so that
+  // looking up either one touches only the leaf.
   struct Leaf {
     void* values[LEAF_LENGTH];
+    unsigned char sizeclass[LEAF_LENGTH];
   };
 
   Leaf* root_[ROOT_LENGTH];             // Pointers to 32 child nodes
@@ -142,6 +167,20 @@ class TCMalloc_PageMap2 {
     root_[i1]->values[i2] = v;
   }
 
+  size_t sizeclass(Number k) const {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> LEAF_BITS;
+    const Number i2 = k & (LEAF_LENGTH-1);
+    return root_[i1]->sizeclass[i2];
+  }
+
+  void set_sizeclass(Number k, size_t cl) {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> LEAF_BITS;
+    const Number i2 = k & (LEAF_LENGTH-1);
+    root_[i1]->sizeclass[i2] = static_cast<unsigned char>(cl);
+  }
+
   bool Ensure(Number start, size_t n) {
     for (Number key = start; key <= start + n - 1; ) {
       const Number i1 = key >> LEAF_BITS;
@@ -187,9 +226,11 @@ class TCMalloc_PageMap3 {
     Node* ptrs[INTERIOR_LENGTH];
   };
 
-  // Leaf node
+  // Leaf node.  The size-classes sit next to the values so that
+  // looking up either one touches only the leaf.
   struct Leaf {
     void* values[LEAF_LENGTH];
+    unsigned char sizeclass[LEAF_LENGTH];
   };
 
   Node* root_;                          // Root of radix tree
@@ -227,6 +268,23 @@ class TCMalloc_PageMap3 {
     reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->values[i3] = v;
   }
 
+  size_t sizeclass(Number k) const {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+    const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH-1);
+    const Number i3 = k & (LEAF_LENGTH-1);
+    return reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->sizeclass[i3];
+  }
+
+  void set_sizeclass(Number k, size_t cl) {
+    ASSERT(k >> BITS == 0);
+    const Number i1 = k >> (LEAF_BITS + INTERIOR_BITS);
+    const Number i2 = (k >> LEAF_BITS) & (INTERIOR_LENGTH-1);
+    const Number i3 = k & (LEAF_LENGTH-1);
+    reinterpret_cast<Leaf*>(root_->ptrs[i1]->ptrs[i2])->sizeclass[i3] =
+        static_cast<unsigned char>(cl);
+  }
+
   bool Ensure(Number start, size_t n) {
     for (Number key = start; key <= start + n - 1; ) {
       const Number i1 = key >> (LEAF_BITS + INTERIOR_BITS);
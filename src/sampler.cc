@@ -0,0 +1,274 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Allocation sampling.  See sampler.h for an overview.
+
+#include "config.h"
+#include "sampler.h"
+#include <math.h>
+#include "base/commandlineflags.h"
+#include "base/cycleclock.h"
+#include "lifetime_profile.h"
+#include "static_vars.h"
+#include "system-alloc.h"
+
+// The mean number of bytes between sampling actions.  I.e., we take
+// one sample approximately once every tcmalloc_sample_parameter bytes
+// of allocation, i.e., ~ once every 128KB by default.  Zero turns
+// sampling off.
+#ifdef NO_TCMALLOC_SAMPLES
+DEFINE_int64(tcmalloc_sample_parameter, 0,
+             "Unused: code is compiled with NO_TCMALLOC_SAMPLES");
+#else
+DEFINE_int64(tcmalloc_sample_parameter,
+             EnvToInt64("TCMALLOC_SAMPLE_PARAMETER", 128 << 10),
+             "The approximate gap in bytes between sampling actions."
+             " The gaps are exponentially distributed with this mean;"
+             " 0 disables sampling.");
+#endif
+
+namespace tcmalloc {
+
+// The random number generator keeps 48 bits of state, and we use the
+// top kRandomBits of it to pick each sampling point.
+static const int kPrngStateBits = 48;
+static const int kRandomBits = 26;
+
+// Keep sampling points well away from overflow of bytes_until_sample_.
+static const double kMaxSamplingPoint =
+    static_cast<double>(static_cast<size_t>(-1) >> 2);
+
+void Sampler::Init(uint32_t seed) {
+  // Run the generator for a bit to get away from a poor seed
+  rnd_ = seed;
+  for (int i = 0; i < 20; i++) {
+    rnd_ = NextRandom(rnd_);
+  }
+  bytes_until_sample_ = PickNextSamplingPoint();
+}
+
+size_t Sampler::PickNextSamplingPoint() {
+  const int64 period = FLAGS_tcmalloc_sample_parameter;
+  if (period <= 0) {
+    // Sampling is off; callers check the flag before asking us.  If it
+    // is turned back on, the first allocation gets sampled and we then
+    // draw a proper interval.
+    return 0;
+  }
+
+  rnd_ = NextRandom(rnd_);
+  // q is uniform over (0, 1].  The low-order bits of an LCG are poor,
+  // so take the top bits of the state.
+  const uint64_t r = (rnd_ >> (kPrngStateBits - kRandomBits)) + 1;
+  const double q = static_cast<double>(r) / (1 << kRandomBits);
+
+  // Inverse transform: -log(q) is exponentially distributed with mean 1.
+  double interval = -log(q) * static_cast<double>(period);
+  if (interval > kMaxSamplingPoint) {
+    interval = kMaxSamplingPoint;
+  }
+  return static_cast<size_t>(interval) + 1;
+}
+
+size_t Sampler::GetSamplePeriod() {
+  const int64 period = FLAGS_tcmalloc_sample_parameter;
+  return period > 0 ? static_cast<size_t>(period) : 0;
+}
+
+bool Sampler::SetSamplePeriod(size_t period) {
+#ifdef NO_TCMALLOC_SAMPLES
+  return false;
+#else
+  FLAGS_tcmalloc_sample_parameter = static_cast<int64>(period);
+  return true;
+#endif
+}
+
+// Records of the sampled objects in each span, hashed by the span's
+// first page and chained through span_next.  The table doubles
+// whenever there are more records than buckets, so chains stay short
+// however many objects are sampled.  Protected by
+// Static::sample_lock().
+static const size_t kInitialSpanSampleBuckets = 1024;
+static SampledObject* initial_span_samples[kInitialSpanSampleBuckets];
+static SampledObject** span_samples = initial_span_samples;
+static size_t span_sample_buckets = kInitialSpanSampleBuckets;
+static size_t span_sample_count = 0;
+
+static inline SampledObject** SpanSampleBucket(const Span* span) {
+  return &span_samples[span->start & (span_sample_buckets - 1)];
+}
+
+// A table that fits in a metadata chunk comes from the shared pool, so
+// once outgrown it can hold other metadata.  A bigger one is mapped
+// straight from the system and unmapped when outgrown.  Returns NULL
+// if out of memory.
+static SampledObject** NewSpanSampleTable(size_t buckets) {
+  const size_t bytes = buckets * sizeof(SampledObject*);
+  void* table = (bytes <= kMetaDataChunkSize
+                 ? MetaDataChunkAlloc()
+                 : TCMalloc_DirectMap(bytes, sizeof(SampledObject*)));
+  return reinterpret_cast<SampledObject**>(table);
+}
+
+static void DeleteSpanSampleTable(SampledObject** table, size_t buckets) {
+  if (table == initial_span_samples) return;
+  const size_t bytes = buckets * sizeof(SampledObject*);
+  if (bytes <= kMetaDataChunkSize) {
+    MetaDataChunkFree(table);
+  } else {
+    TCMalloc_DirectUnmap(table, bytes);
+  }
+}
+
+// Doubles the hash table.  If we are out of memory we keep the old
+// one, which only makes the chains longer.
+static void GrowSpanSamples() {
+  const size_t n = span_sample_buckets * 2;
+  SampledObject** table = NewSpanSampleTable(n);
+  if (table == NULL) return;
+  for (size_t i = 0; i < n; i++) table[i] = NULL;
+  for (size_t i = 0; i < span_sample_buckets; i++) {
+    SampledObject* s = span_samples[i];
+    while (s != NULL) {
+      SampledObject* next = s->span_next;
+      SampledObject** bucket = &table[s->span->start & (n - 1)];
+      s->span_next = *bucket;
+      *bucket = s;
+      s = next;
+    }
+  }
+  DeleteSpanSampleTable(span_samples, span_sample_buckets);
+  span_samples = table;
+  span_sample_buckets = n;
+}
+
+// The list of sampled objects is ordered by birth, newest first, so the
+// records old enough to count as long-lived form a tail of it.
+// aged_cursor is the newest record in that tail (or the list head if
+// the tail is empty), and everything from there on is marked "aged".
+// Protected by Static::sample_lock().
+static SampledObject* aged_cursor = NULL;
+
+// Counts the records that just became old enough as long-lived.
+static void AgeSampledObjects(int64 now) {
+  SampledObject* list = Static::sampled_objects();
+  if (aged_cursor == NULL) aged_cursor = list;
+  const int64 threshold = LongLivedCycles();
+  // The next newer record; the list head's prev is the oldest record
+  for (SampledObject* s = aged_cursor->prev;
+       s != list && now - s->birth >= threshold;
+       s = s->prev) {
+    s->aged = true;
+    RecordSiteLifetime(s->site, true);
+    aged_cursor = s;
+  }
+}
+
+bool RecordSampledObject(Span* span, void* object, const StackTrace& stack,
+                         const void* site) {
+  TimedSpinLockHolder h(Static::sample_lock());
+  SampledObject* s = Static::sampled_object_allocator()->New();
+  if (s == NULL) {
+    return false;
+  }
+  s->object = object;
+  s->stack = stack;
+  s->site = site;
+  s->birth = CycleClock::Now();
+  s->aged = false;
+  s->span = span;
+  if (++span_sample_count > span_sample_buckets) GrowSpanSamples();
+  SampledObject** bucket = SpanSampleBucket(span);
+  s->span_next = *bucket;
+  *bucket = s;
+  span->sampled = 1;
+
+  SampledObject* list = Static::sampled_objects();
+  s->prev = list;
+  s->next = list->next;
+  list->next->prev = s;
+  list->next = s;
+
+  // Frees look up the sizeclass in the pagemap and skip the check for
+  // samples when they find one, so hide it for this object's page.
+  // "object" has not been handed out yet, so no free of it can race
+  // with this.
+  const PageID p = reinterpret_cast<uintptr_t>(object) >> kPageShift;
+  Static::pageheap()->SetSizeClass(p, 0);
+
+  if (FLAGS_tcmalloc_lifetime_segregation) AgeSampledObjects(s->birth);
+  return true;
+}
+
+void ForgetSampledObject(Span* span, void* object) {
+  if (!span->sampled) return;
+  TimedSpinLockHolder h(Static::sample_lock());
+  // One pass over the bucket unlinks the record for "object", if there
+  // is one, and tells whether the span holds any others
+  SampledObject* victim = NULL;
+  bool span_has_others = false;
+  for (SampledObject** s = SpanSampleBucket(span); *s != NULL; ) {
+    if (victim == NULL && (*s)->object == object) {
+      victim = *s;
+      *s = victim->span_next;
+    } else {
+      if ((*s)->span == span) span_has_others = true;
+      s = &(*s)->span_next;
+    }
+  }
+
+  if (victim != NULL) {
+    span_sample_count--;
+    if (victim == aged_cursor) aged_cursor = victim->next;
+    victim->prev->next = victim->next;
+    victim->next->prev = victim->prev;
+    if (FLAGS_tcmalloc_lifetime_segregation) {
+      const int64 now = CycleClock::Now();
+      if (!victim->aged) {
+        RecordSiteLifetime(victim->site,
+                           now - victim->birth >= LongLivedCycles());
+      }
+      AgeSampledObjects(now);
+    }
+    Static::sampled_object_allocator()->Delete(victim);
+  }
+
+  if (span_has_others) return;        // The span still holds samples
+  span->sampled = 0;
+  if (span->sizeclass != 0 && !span->long_lived) {
+    // Let frees of objects in this span take the fast path again
+    for (Length i = 0; i < span->length; i++) {
+      Static::pageheap()->SetSizeClass(span->start + i, span->sizeclass);
+    }
+  }
+}
+
+}  // namespace tcmalloc
@@ -0,0 +1,158 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Allocation sampling.
+//
+// Every thread counts down the number of bytes until its next sample.
+// The distance between samples is drawn from an exponential
+// distribution with mean FLAGS_tcmalloc_sample_parameter, so sampling
+// points form a Poisson process over the stream of allocated bytes.
+// An object of size s is then sampled with probability
+//      1 - exp(-s / FLAGS_tcmalloc_sample_parameter)
+// regardless of the sizes of the allocations around it, which lets
+// pprof turn the samples back into unbiased estimates.
+//
+// Sampled objects are allocated exactly like unsampled ones (small
+// objects keep their size class).  We remember each one in a
+// SampledObject record hung off the Span that holds it.
+
+#ifndef TCMALLOC_SAMPLER_H_
+#define TCMALLOC_SAMPLER_H_
+
+#include "config.h"
+#include "common.h"
+
+namespace tcmalloc {
+
+struct Span;
+
+//-------------------------------------------------------------------
+// Per-thread sampling state
+//-------------------------------------------------------------------
+
+class Sampler {
+ public:
+  // Initialize the random number generator from "seed" and pick the
+  // first sampling point.
+  void Init(uint32_t seed);
+
+  // Record allocation of "k" bytes.  Returns true iff the allocation
+  // should be sampled.
+  bool SampleAllocation(size_t k);
+
+  // Like SampleAllocation(), for callers that cannot sample: if the
+  // allocation of "k" bytes would be sampled, returns false and
+  // records nothing, so that SampleAllocation() still picks it.
+  bool SkipSample(size_t k);
+
+  // Returns the number of bytes until the next sample.
+  size_t PickNextSamplingPoint();
+
+  // Mean number of bytes between samples.  Zero means no sampling.
+  static size_t GetSamplePeriod();
+
+  // Change the mean number of bytes between samples.  Threads pick up
+  // the new value when they take their next sample.  Returns false if
+  // this binary was built without sampling support.
+  static bool SetSamplePeriod(size_t period);
+
+  // Returns the next value of the random number generator.  The
+  // generator is a 48-bit LCG (the same one as drand48).
+  static inline uint64_t NextRandom(uint64_t rnd) {
+    const uint64_t prng_mult = 0x5DEECE66DULL;
+    const uint64_t prng_add = 0xB;
+    const uint64_t prng_mod_power = 48;
+    const uint64_t prng_mod_mask =
+        ~((~static_cast<uint64_t>(0)) << prng_mod_power);
+    return (prng_mult * rnd + prng_add) & prng_mod_mask;
+  }
+
+ private:
+  size_t        bytes_until_sample_;    // Bytes until we sample next
+  uint64_t      rnd_;                   // Cheap random number generator
+};
+
+inline bool Sampler::SampleAllocation(size_t k) {
+  if (bytes_until_sample_ < k) {
+    bytes_until_sample_ = PickNextSamplingPoint();
+    return true;
+  } else {
+    bytes_until_sample_ -= k;
+    return false;
+  }
+}
+
+inline bool Sampler::SkipSample(size_t k) {
+  if (bytes_until_sample_ < k) return false;
+  bytes_until_sample_ -= k;
+  return true;
+}
+
+//-------------------------------------------------------------------
+// Bookkeeping for live sampled objects
+//-------------------------------------------------------------------
+
+// One record per live sampled object.  Records are found from their
+// span through a hash table keyed by the span's first page, whose
+// buckets are chained through span_next; span->sampled says whether
+// a span has any.  All records are also kept on a doubly linked list
+// (headed by Static::sampled_objects()) so we can enumerate them.
+// All fields are protected by Static::sample_lock().
+struct SampledObject {
+  void*          object;        // Address handed to the application
+  Span*          span;          // Span holding "object"
+  SampledObject* span_next;     // Next record in the same hash bucket
+  SampledObject* next;          // Next in list of all sampled objects
+  SampledObject* prev;          // Previous in list of all sampled objects
+  StackTrace     stack;         // Allocation site; stack.size is the request
+  const void*    site;          // Caller of malloc() etc., or NULL
+  int64          birth;         // CycleClock::Now() when sampled
+  bool           aged;          // Already counted as long-lived
+};
+
+// Remember that "object", which lives in "span", was sampled with the
+// allocation stack "stack" and came from allocation site "site" (see
+// lifetime_profile.h).  Afterwards the pagemap reports sizeclass 0
+// for the page holding the start of "object", so frees of objects on
+// that page take the slow path and reach ForgetSampledObject() below.
+// Returns false if we ran out of memory for the record.
+bool RecordSampledObject(Span* span, void* object, const StackTrace& stack,
+                         const void* site);
+
+// Forget the record for "object", if it was sampled.  Once the span
+// holds no more sampled objects, its pages get their sizeclass back,
+// unless the span belongs to a long-lived central list.  With
+// tcmalloc_lifetime_segregation, the object's lifetime goes into the
+// lifetime profile.  Cheap to call if span->sampled is not set.
+void ForgetSampledObject(Span* span, void* object);
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_SAMPLER_H_
@@ -0,0 +1,275 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Writes src/size_map_tables.h, the size-class tables behind SizeMap.
+//
+// Computing the tables at startup cost time in every process, and left
+// them in writable memory.  Instead this program computes them once,
+// for both the default alignment and --enable-16byte-alignment, checks
+// them, and prints them as constant arrays.  Run "make size_map_tables"
+// after changing the size-class parameters in common.h or the rules
+// below.
+
+#include "config.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include "common.h"
+
+using std::vector;
+
+static void Fail(const char* what, size_t align_shift, size_t value) {
+  fprintf(stderr, "size_map_gen: %s (alignment %d, value %d)\n",
+          what, 1 << static_cast<int>(align_shift), static_cast<int>(value));
+  exit(1);
+}
+
+#define CHECK_TABLE(cond, value)                                \
+  do {                                                          \
+    if (!(cond)) Fail(#cond, align_shift, value);               \
+  } while (0)
+
+// Note: the following only works for "n"s that fit in 32-bits, but
+// that is fine since we only use it for small sizes.
+static inline int LgFloor(size_t n) {
+  int log = 0;
+  for (int i = 4; i >= 0; --i) {
+    int shift = (1 << i);
+    size_t x = n >> shift;
+    if (x != 0) {
+      n = x;
+      log += shift;
+    }
+  }
+  return log;
+}
+
+static const int kMaxSmallSize = 1024;
+
+// SizeMap::ClassIndex() for an alignment of 1 << align_shift
+static int ClassIndex(int s, size_t align_shift) {
+  const int big_offset = (kMaxSmallSize >> align_shift) - (1024 >> 7);
+  const bool big = (s > kMaxSmallSize);
+  const int add_amount = (big ? (127 + (big_offset << 7))
+                          : (1 << align_shift) - 1);
+  const int shift_amount = big ? 7 : static_cast<int>(align_shift);
+  return (s + add_amount) >> shift_amount;
+}
+
+static int NumMoveSize(size_t size) {
+  if (size == 0) return 0;
+  // Use approx 64k transfers between thread and central caches.
+  int num = static_cast<int>(64.0 * 1024.0 / size);
+  if (num < 2) num = 2;
+  // Clamp well below kMaxFreeListLength to avoid ping pong between central
+  // and thread caches.
+  if (num > static_cast<int>(0.8 * kMaxFreeListLength))
+    num = static_cast<int>(0.8 * kMaxFreeListLength);
+
+  // Also, avoid bringing in too many objects into small object free
+  // lists.  There are lots of such lists, and if we allow each one to
+  // fetch too many at a time, we end up having to scavenge too often
+  // (especially when there are lots of threads and each thread gets a
+  // small allowance for its thread cache).  This fixes a problem seen
+  // in the 20060502 bigtable release by both Andrew Fikes and Ben
+  // Darnell.
+  //
+  // TODO: Make thread cache free list sizes dynamic so that we do not
+  // have to equally divide a fixed resource amongst lots of threads.
+  if (num > 32) num = 32;
+
+  return num;
+}
+
+struct Tables {
+  vector<unsigned char> class_array;
+  vector<size_t> class_to_size;
+  vector<size_t> class_to_pages;
+  vector<size_t> class_to_colors;
+  vector<int> num_objects_to_move;
+};
+
+static void ComputeTables(size_t align_shift, Tables* t) {
+  const size_t min_alignment = static_cast<size_t>(1) << align_shift;
+  CHECK_TABLE(min_alignment <= 16, min_alignment);
+
+  // Compute the size classes we want to use.  Class 0 is unused.
+  t->class_to_size.assign(1, 0);
+  t->class_to_pages.assign(1, 0);
+  size_t alignment = min_alignment;
+  int last_lg = -1;
+  for (size_t size = min_alignment; size <= kMaxSize; size += alignment) {
+    int lg = LgFloor(size);
+    if (lg > last_lg) {
+      // Increase alignment every so often to reduce number of size classes.
+      if (size >= 2048) {
+        // Cap alignment at 256 for large sizes
+        alignment = 256;
+      } else if (size >= 128) {
+        // Space wasted due to alignment is at most 1/8, i.e., 12.5%.
+        alignment = size / 8;
+      } else if (size >= 16) {
+        // We need an alignment of at least 16 bytes to satisfy
+        // requirements for some SSE types.
+        alignment = 16;
+      }
+      CHECK_TABLE(size < 16 || alignment >= 16, size);
+      CHECK_TABLE((alignment & (alignment - 1)) == 0, alignment);
+      last_lg = lg;
+    }
+    CHECK_TABLE((size % alignment) == 0, size);
+
+    // Allocate enough pages so leftover is less than 1/8 of total.
+    // This bounds wasted space to at most 12.5%.
+    size_t psize = kPageSize;
+    while ((psize % size) > (psize >> 3)) {
+      psize += kPageSize;
+    }
+    const size_t my_pages = psize >> kPageShift;
+
+    const size_t sc = t->class_to_size.size();
+    if (sc > 1 && my_pages == t->class_to_pages[sc-1]) {
+      // See if we can merge this into the previous class without
+      // increasing the fragmentation of the previous class.
+      const size_t my_objects = (my_pages << kPageShift) / size;
+      const size_t prev_objects = (t->class_to_pages[sc-1] << kPageShift)
+                                  / t->class_to_size[sc-1];
+      if (my_objects == prev_objects) {
+        // Adjust last class to include this size
+        t->class_to_size[sc-1] = size;
+        continue;
+      }
+    }
+
+    // Add new class
+    t->class_to_pages.push_back(my_pages);
+    t->class_to_size.push_back(size);
+  }
+  const size_t num_classes = t->class_to_size.size();
+  CHECK_TABLE(num_classes < 256, num_classes);   // Fits in class_array
+
+  // Initialize the mapping array
+  t->class_array.assign(ClassIndex(kMaxSize, align_shift) + 1, 0);
+  int next_size = 0;
+  for (size_t c = 1; c < num_classes; c++) {
+    const int max_size_in_class = t->class_to_size[c];
+    for (int s = next_size; s <= max_size_in_class; s += min_alignment) {
+      t->class_array[ClassIndex(s, align_shift)] = c;
+    }
+    next_size = max_size_in_class + min_alignment;
+  }
+
+  // Double-check sizes just to be safe
+  for (size_t size = 0; size <= kMaxSize; size++) {
+    const size_t sc = t->class_array[ClassIndex(size, align_shift)];
+    CHECK_TABLE(sc > 0 && sc < num_classes, size);
+    // Not allocating unnecessarily large classes
+    CHECK_TABLE(sc == 1 || size > t->class_to_size[sc-1], size);
+    const size_t s = t->class_to_size[sc];
+    CHECK_TABLE(size <= s && s != 0, size);
+  }
+
+  // Initialize the num_objects_to_move array.
+  t->num_objects_to_move.assign(1, 0);
+  for (size_t cl = 1; cl < num_classes; ++cl) {
+    t->num_objects_to_move.push_back(NumMoveSize(t->class_to_size[cl]));
+  }
+
+  // Work out how many cache colors each class can use.  Only classes
+  // whose objects start on at most every other cache line of a page
+  // suffer badly from aliasing; the others already spread their
+  // objects across all cache sets.  We color with the space left over
+  // at the end of the span, and if there is too little of it we give
+  // up one object, provided the total waste stays within 1/8 as above.
+  t->class_to_colors.assign(1, 0);
+  for (size_t cl = 1; cl < num_classes; ++cl) {
+    const size_t size = t->class_to_size[cl];
+    const size_t span_bytes = t->class_to_pages[cl] << kPageShift;
+    size_t spare = span_bytes % size;
+    if (size % (2 * kCacheLineSize) != 0) {
+      spare = 0;
+    } else if (spare < kCacheLineSize && spare + size <= (span_bytes >> 3)) {
+      spare += size;
+    }
+    size_t colors = spare / kCacheLineSize + 1;
+    if (colors > kPageSize / kCacheLineSize) {
+      // Beyond a page's worth of colors we would only repeat ourselves
+      colors = kPageSize / kCacheLineSize;
+    }
+    t->class_to_colors.push_back(colors);
+  }
+}
+
+template <class T>
+static void PrintArray(const char* decl, const vector<T>& values) {
+  printf("const %s[] = {", decl);
+  for (size_t i = 0; i < values.size(); i++) {
+    printf("%s%d,", (i % 12 == 0 ? "\n  " : " "),
+           static_cast<int>(values[i]));
+  }
+  printf("\n};\n");
+}
+
+static void PrintTables(size_t align_shift) {
+  Tables t;
+  ComputeTables(align_shift, &t);
+  printf("\n// %d size classes for an alignment of %d\n",
+         static_cast<int>(t.class_to_size.size()), 1 << align_shift);
+  PrintArray("unsigned char SizeMap::class_array_", t.class_array);
+  PrintArray("size_t SizeMap::class_to_size_", t.class_to_size);
+  PrintArray("size_t SizeMap::class_to_pages_", t.class_to_pages);
+  PrintArray("size_t SizeMap::class_to_colors_", t.class_to_colors);
+  PrintArray("int SizeMap::num_objects_to_move_", t.num_objects_to_move);
+}
+
+int main(int argc, char** argv) {
+  printf("// Size-class tables for SizeMap; see common.h.\n"
+         "//\n"
+         "// Generated by size_map_gen from src/size_map_gen.cc.  Do not\n"
+         "// edit; run \"make size_map_tables\" instead.  Only common.cc\n"
+         "// includes this file.\n"
+         "\n"
+         "#ifndef TCMALLOC_SIZE_MAP_TABLES_H_\n"
+         "#define TCMALLOC_SIZE_MAP_TABLES_H_\n"
+         "\n"
+         "namespace tcmalloc {\n"
+         "\n"
+         "#ifdef TCMALLOC_16BYTE_ALIGNMENT\n");
+  PrintTables(4);
+  printf("\n#else\n");
+  PrintTables(3);
+  printf("\n#endif\n"
+         "\n"
+         "}  // namespace tcmalloc\n"
+         "\n"
+         "#endif  // TCMALLOC_SIZE_MAP_TABLES_H_\n");
+  return 0;
+}
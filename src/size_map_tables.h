@@ -0,0 +1,147 @@
+// Size-class tables for SizeMap; see common.h.
+//
+// Generated by size_map_gen from src/size_map_gen.cc.  Do not
+// edit; run "make size_map_tables" instead.  Only common.cc
+// includes this file.
+
+#ifndef TCMALLOC_SIZE_MAP_TABLES_H_
+#define TCMALLOC_SIZE_MAP_TABLES_H_
+
+namespace tcmalloc {
+
+#ifdef TCMALLOC_16BYTE_ALIGNMENT
+
+// 60 size classes for an alignment of 16
+const unsigned char SizeMap::class_array_[] = {
+  1, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11,
+  12, 13, 14, 15, 16, 17, 17, 18, 18, 19, 19, 20,
+  20, 21, 21, 21, 21, 22, 22, 22, 22, 23, 23, 23,
+  23, 24, 24, 24, 24, 25, 25, 25, 25, 26, 26, 26,
+  26, 27, 27, 27, 27, 28, 28, 28, 28, 28, 28, 28,
+  28, 28, 28, 28, 28, 29, 30, 31, 32, 33, 34, 34,
+  34, 35, 35, 36, 36, 37, 37, 37, 37, 38, 38, 39,
+  39, 39, 39, 39, 39, 40, 40, 41, 41, 42, 42, 42,
+  42, 43, 43, 43, 43, 43, 43, 43, 43, 44, 44, 44,
+  44, 45, 45, 46, 46, 46, 46, 46, 46, 46, 46, 46,
+  46, 47, 47, 47, 47, 48, 48, 48, 48, 48, 48, 48,
+  48, 48, 48, 48, 48, 49, 49, 50, 50, 50, 50, 50,
+  50, 50, 50, 50, 50, 50, 50, 50, 50, 51, 51, 51,
+  51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 52,
+  52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52,
+  52, 52, 52, 52, 52, 53, 53, 53, 53, 53, 53, 53,
+  53, 53, 53, 54, 54, 54, 54, 54, 54, 54, 54, 54,
+  54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54, 54,
+  54, 55, 55, 55, 55, 55, 55, 56, 56, 56, 56, 56,
+  56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56, 56,
+  56, 56, 56, 56, 56, 56, 56, 56, 56, 57, 57, 58,
+  58, 58, 58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+  58, 58, 58, 58, 58, 58, 58, 58, 58, 58, 58, 58,
+  58, 58, 58, 58, 58, 59, 59, 59, 59, 59, 59, 59,
+  59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 59,
+  59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 59,
+  59,
+};
+const size_t SizeMap::class_to_size_[] = {
+  0, 16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176,
+  192, 208, 224, 240, 256, 288, 320, 352, 384, 448, 512, 576,
+  640, 704, 768, 832, 1024, 1152, 1280, 1408, 1536, 1664, 2048, 2304,
+  2560, 3072, 3328, 4096, 4352, 4608, 5120, 6144, 6656, 6912, 8192, 8704,
+  10240, 10496, 12288, 14080, 16384, 17664, 20480, 21248, 24576, 24832, 28672, 32768,
+};
+const size_t SizeMap::class_to_pages_[] = {
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 2, 1, 2, 1, 2, 1, 3, 2, 3, 1, 3,
+  2, 3, 5, 1, 6, 5, 4, 3, 5, 7, 2, 7,
+  5, 8, 3, 7, 4, 9, 5, 11, 6, 13, 7, 8,
+};
+const size_t SizeMap::class_to_colors_[] = {
+  0, 1, 1, 1, 1, 1, 1, 1, 3, 1, 1, 1,
+  1, 1, 1, 1, 5, 1, 1, 1, 5, 1, 9, 1,
+  5, 1, 5, 1, 1, 3, 5, 17, 9, 11, 1, 13,
+  9, 1, 9, 1, 45, 33, 17, 1, 9, 17, 1, 41,
+  1, 21, 1, 9, 1, 25, 1, 41, 1, 57, 1, 1,
+};
+const int SizeMap::num_objects_to_move_[] = {
+  0, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32,
+  32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32,
+  32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 28,
+  25, 21, 19, 16, 15, 14, 12, 10, 9, 9, 8, 7,
+  6, 6, 5, 4, 4, 3, 3, 3, 2, 2, 2, 2,
+};
+
+#else
+
+// 61 size classes for an alignment of 8
+const unsigned char SizeMap::class_array_[] = {
+  1, 1, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7,
+  7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13,
+  13, 14, 14, 15, 15, 16, 16, 17, 17, 18, 18, 18,
+  18, 19, 19, 19, 19, 20, 20, 20, 20, 21, 21, 21,
+  21, 22, 22, 22, 22, 22, 22, 22, 22, 23, 23, 23,
+  23, 23, 23, 23, 23, 24, 24, 24, 24, 24, 24, 24,
+  24, 25, 25, 25, 25, 25, 25, 25, 25, 26, 26, 26,
+  26, 26, 26, 26, 26, 27, 27, 27, 27, 27, 27, 27,
+  27, 28, 28, 28, 28, 28, 28, 28, 28, 29, 29, 29,
+  29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29, 29,
+  29, 29, 29, 29, 29, 29, 29, 29, 29, 30, 31, 32,
+  33, 34, 35, 35, 35, 36, 36, 37, 37, 38, 38, 38,
+  38, 39, 39, 40, 40, 40, 40, 40, 40, 41, 41, 42,
+  42, 43, 43, 43, 43, 44, 44, 44, 44, 44, 44, 44,
+  44, 45, 45, 45, 45, 46, 46, 47, 47, 47, 47, 47,
+  47, 47, 47, 47, 47, 48, 48, 48, 48, 49, 49, 49,
+  49, 49, 49, 49, 49, 49, 49, 49, 49, 50, 50, 51,
+  51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51, 51,
+  51, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52, 52,
+  52, 52, 52, 53, 53, 53, 53, 53, 53, 53, 53, 53,
+  53, 53, 53, 53, 53, 53, 53, 53, 53, 54, 54, 54,
+  54, 54, 54, 54, 54, 54, 54, 55, 55, 55, 55, 55,
+  55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55, 55,
+  55, 55, 55, 55, 55, 56, 56, 56, 56, 56, 56, 57,
+  57, 57, 57, 57, 57, 57, 57, 57, 57, 57, 57, 57,
+  57, 57, 57, 57, 57, 57, 57, 57, 57, 57, 57, 57,
+  57, 58, 58, 59, 59, 59, 59, 59, 59, 59, 59, 59,
+  59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 59, 59,
+  59, 59, 59, 59, 59, 59, 59, 59, 59, 60, 60, 60,
+  60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60,
+  60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60, 60,
+  60, 60, 60, 60, 60,
+};
+const size_t SizeMap::class_to_size_[] = {
+  0, 8, 16, 32, 48, 64, 80, 96, 112, 128, 144, 160,
+  176, 192, 208, 224, 240, 256, 288, 320, 352, 384, 448, 512,
+  576, 640, 704, 768, 832, 1024, 1152, 1280, 1408, 1536, 1664, 2048,
+  2304, 2560, 3072, 3328, 4096, 4352, 4608, 5120, 6144, 6656, 6912, 8192,
+  8704, 10240, 10496, 12288, 14080, 16384, 17664, 20480, 21248, 24576, 24832, 28672,
+  32768,
+};
+const size_t SizeMap::class_to_pages_[] = {
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+  1, 1, 2, 1, 2, 1, 2, 1, 3, 2, 3, 1,
+  3, 2, 3, 5, 1, 6, 5, 4, 3, 5, 7, 2,
+  7, 5, 8, 3, 7, 4, 9, 5, 11, 6, 13, 7,
+  8,
+};
+const size_t SizeMap::class_to_colors_[] = {
+  0, 1, 1, 1, 1, 1, 1, 1, 1, 3, 1, 1,
+  1, 1, 1, 1, 1, 5, 1, 1, 1, 5, 1, 9,
+  1, 5, 1, 5, 1, 1, 3, 5, 17, 9, 11, 1,
+  13, 9, 1, 9, 1, 45, 33, 17, 1, 9, 17, 1,
+  41, 1, 21, 1, 9, 1, 25, 1, 41, 1, 57, 1,
+  1,
+};
+const int SizeMap::num_objects_to_move_[] = {
+  0, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32,
+  32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32,
+  32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32, 32,
+  28, 25, 21, 19, 16, 15, 14, 12, 10, 9, 9, 8,
+  7, 6, 6, 5, 4, 4, 3, 3, 3, 2, 2, 2,
+  2,
+};
+
+#endif
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_SIZE_MAP_TABLES_H_
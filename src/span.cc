@@ -37,6 +37,7 @@
 #include <inttypes.h>
 #endif
 
+#include "base/basictypes.h"
 #include "static_vars.h"
 
 namespace tcmalloc {
@@ -51,6 +52,7 @@ void Event(Span* span, char op, int v = 0) {
 #endif
 
 Span* NewSpan(PageID p, Length len) {
+  COMPILE_ASSERT(SpanBitmap::kWords <= 255, bitmap_hint_fits_in_a_byte);
   Span* result = Static::span_allocator()->New();
   memset(result, 0, sizeof(*result));
   result->start = p;
@@ -40,17 +40,43 @@
 
 namespace tcmalloc {
 
-// Information kept for a span (a contiguous run of pages).
+// Free-object bitmap for a span of small objects, used instead of a
+// linked list threaded through the objects themselves.  Bit i of
+// "words" is set iff the i'th object of the span is free.  Every size
+// class has at most one page worth of kAlignment-sized objects per
+// span; see CentralFreeList::Init().  The rest of the bookkeeping
+// lives in the Span, so that the bitmap fills exactly one cache line
+// with the default page size.
+struct SpanBitmap {
+  static const int kWords = (kPageSize / kAlignment + 63) / 64;
+  uint64_t words[kWords];
+};
+
+// Information kept for a span (a contiguous run of pages).  A large
+// heap has millions of these, so keep rarely used state (such as the
+// records of sampled objects) out of line.
 struct Span {
   PageID        start;          // Starting page number
   Length        length;         // Number of pages in span
   Span*         next;           // Used when in link list
   Span*         prev;           // Used when in link list
-  void*         objects;        // Linked list of free objects
-  unsigned int  refcount : 16;  // Number of non-free objects
+  union {
+    void*       objects;        // Linked list of free objects
+    SpanBitmap* bitmap;         // Free objects, if has_bitmap is set
+  };
+  unsigned int  refcount : 13;  // Number of non-free objects
+  unsigned int  long_lived : 1; // Carved for a long-lived central list
+  unsigned int  direct : 1;     // Mapped straight from the system
+  unsigned int  has_bitmap : 1; // Free objects are tracked in "bitmap"
   unsigned int  sizeclass : 8;  // Size-class for small objects (or 0)
   unsigned int  location : 2;   // Is the span on a freelist, and if so, which?
-  unsigned int  sample : 1;     // Sampled object?
+  unsigned int  color : 6;      // Cache lines skipped before the first object
+  uint16_t      bitmap_objects; // Objects in the span, if has_bitmap is set
+  uint8_t       bitmap_hint;    // No free object in bitmap->words[0..hint-1]
+  // Set while the span holds sampled objects (see sampler.h).  It is
+  // written under the sample lock, so it must not share a word with
+  // the bitfields above, which the central lists update.
+  uint8_t       sampled;
 
 #undef SPAN_HISTORY
 #ifdef SPAN_HISTORY
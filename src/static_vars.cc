@@ -34,28 +34,35 @@
 
 namespace tcmalloc {
 
-SpinLock Static::pageheap_lock_(SpinLock::LINKER_INITIALIZED);
+TimedSpinLock Static::pageheap_lock_(base::LINKER_INITIALIZED);
+TimedSpinLock Static::sample_lock_(base::LINKER_INITIALIZED);
 SizeMap Static::sizemap_;
 CentralFreeListPadded Static::central_cache_[kNumClasses];
+CentralFreeListPadded Static::long_lived_cache_[kNumClasses];
 PageHeapAllocator<Span> Static::span_allocator_;
+PageHeapAllocator<SpanBitmap> Static::span_bitmap_allocator_;
 PageHeapAllocator<StackTrace> Static::stacktrace_allocator_;
-Span Static::sampled_objects_;
+PageHeapAllocator<SampledObject> Static::sampled_object_allocator_;
+SampledObject Static::sampled_objects_;
 StackTrace* Static::growth_stacks_ = NULL;
 char Static::pageheap_memory_[sizeof(PageHeap)];
 
 void Static::InitStaticVars() {
-  sizemap_.Init();
   span_allocator_.Init();
   span_allocator_.New(); // Reduce cache conflicts
   span_allocator_.New(); // Reduce cache conflicts
+  span_bitmap_allocator_.Init();
   stacktrace_allocator_.Init();
+  sampled_object_allocator_.Init();
   // Do a bit of sanitizing: make sure central_cache is aligned properly
   CHECK_CONDITION((sizeof(central_cache_[0]) % 64) == 0);
   for (int i = 0; i < kNumClasses; ++i) {
-    central_cache_[i].Init(i);
+    central_cache_[i].Init(i, false);
+    long_lived_cache_[i].Init(i, true);
   }
   new ((void*)pageheap_memory_) PageHeap;
-  DLL_Init(&sampled_objects_);
+  sampled_objects_.next = &sampled_objects_;
+  sampled_objects_.prev = &sampled_objects_;
 }
 
 }  // namespace tcmalloc
@@ -41,14 +41,23 @@
 #include "common.h"
 #include "page_heap.h"
 #include "page_heap_allocator.h"
+#include "sampler.h"
 #include "span.h"
+#include "timed_spinlock.h"
 
 namespace tcmalloc {
 
 class Static {
  public:
   // Linker initialized, so this lock can be accessed at any time.
-  static SpinLock* pageheap_lock() { return &pageheap_lock_; }
+  static TimedSpinLock* pageheap_lock() { return &pageheap_lock_; }
+
+  // Protects the stack traces we keep (the sampled object records and
+  // the heap growth stacks below), and the "sampled" field of every
+  // Span.  Never held together with pageheap_lock; while holding it we
+  // only acquire the metadata allocator's lock and the one inside the
+  // system allocator.
+  static TimedSpinLock* sample_lock() { return &sample_lock_; }
 
   // Must be called before calling any of the accessors below.
   static void InitStaticVars();
@@ -57,6 +66,13 @@ class Static {
   // We have a separate lock per free-list to reduce contention.
   static CentralFreeListPadded* central_cache() { return central_cache_; }
 
+  // A second set of free-lists, one per size-class, whose spans only
+  // ever hold objects from allocation sites that the lifetime profile
+  // found to be long-lived.  See lifetime_profile.h.
+  static CentralFreeListPadded* long_lived_cache() {
+    return long_lived_cache_;
+  }
+
   static SizeMap* sizemap() { return &sizemap_; }
 
   //////////////////////////////////////////////////////////////////////
@@ -70,18 +86,34 @@ class Static {
 
   static PageHeapAllocator<Span>* span_allocator() { return &span_allocator_; }
 
+  // Free-object bitmaps for spans populated with TCMALLOC_BITMAP_SPANS.
+  static PageHeapAllocator<SpanBitmap>* span_bitmap_allocator() {
+    return &span_bitmap_allocator_;
+  }
+
+  //////////////////////////////////////////////////////////////////////
+  // The variables below are protected by sample_lock.
+
   static PageHeapAllocator<StackTrace>* stacktrace_allocator() {
     return &stacktrace_allocator_;
   }
 
+  // Stacks of the calls that grew the heap, newest first, chained
+  // through their last stack slot.
   static StackTrace* growth_stacks() { return growth_stacks_; }
   static void set_growth_stacks(StackTrace* s) { growth_stacks_ = s; }
 
-  // Stack traces kept for sampled allocations.
-  static Span* sampled_objects() { return &sampled_objects_; }
+  // Records for sampled allocations.
+  static PageHeapAllocator<SampledObject>* sampled_object_allocator() {
+    return &sampled_object_allocator_;
+  }
+
+  // Head of the list of all live sampled objects.
+  static SampledObject* sampled_objects() { return &sampled_objects_; }
 
  private:
-  static SpinLock pageheap_lock_;
+  static TimedSpinLock pageheap_lock_;
+  static TimedSpinLock sample_lock_;
 
   // These static variables require explicit initialization.  We cannot
   // count on their constructors to do any initialization because other
@@ -90,9 +122,12 @@ class Static {
 
   static SizeMap sizemap_;
   static CentralFreeListPadded central_cache_[kNumClasses];
+  static CentralFreeListPadded long_lived_cache_[kNumClasses];
   static PageHeapAllocator<Span> span_allocator_;
+  static PageHeapAllocator<SpanBitmap> span_bitmap_allocator_;
   static PageHeapAllocator<StackTrace> stacktrace_allocator_;
-  static Span sampled_objects_;
+  static PageHeapAllocator<SampledObject> sampled_object_allocator_;
+  static SampledObject sampled_objects_;
 
   // Linked list of stack traces recorded every time we allocated memory
   // from the system.  Useful for finding allocation sites that cause
@@ -475,6 +475,59 @@ void TCMalloc_SystemRelease(void* start, size_t length) {
 #endif
 }
 
+void* TCMalloc_DirectMap(size_t bytes, size_t alignment) {
+#ifdef HAVE_MMAP
+  // Same restrictions as for MmapSysAllocator
+  if (FLAGS_malloc_skip_mmap || FLAGS_malloc_devmem_start) return NULL;
+  if (pagesize == 0) pagesize = getpagesize();
+  if (alignment > pagesize || bytes % pagesize != 0) return NULL;
+  void* result = mmap(NULL, bytes, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (result == reinterpret_cast<void*>(MAP_FAILED)) return NULL;
+  return result;
+#else
+  return NULL;
+#endif
+}
+
+void TCMalloc_DirectUnmap(void* start, size_t bytes) {
+#ifdef HAVE_MMAP
+  munmap(start, bytes);
+#endif
+}
+
+#ifdef HAVE_MMAP
+// A page we change the protection of to flush write buffers
+static SpinLock flush_lock(SpinLock::LINKER_INITIALIZED);
+static volatile int* flush_page = NULL;
+#endif
+
+bool TCMalloc_FlushProcessWriteBuffers() {
+#ifdef HAVE_MMAP
+  // Reducing the protection of a page that is mapped in our TLBs makes
+  // the kernel send an inter-processor interrupt to every CPU that is
+  // running one of our threads, so that it flushes its TLB.  Taking
+  // the interrupt serializes the CPU, draining its store buffer.
+  SpinLockHolder h(&flush_lock);
+  if (pagesize == 0) pagesize = getpagesize();
+  if (flush_page == NULL) {
+    void* result = mmap(NULL, pagesize, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (result == reinterpret_cast<void*>(MAP_FAILED)) return false;
+    flush_page = reinterpret_cast<volatile int*>(result);
+  }
+  void* page = const_cast<int*>(flush_page);
+  if (mprotect(page, pagesize, PROT_READ|PROT_WRITE) != 0) {
+    return false;
+  }
+  // Dirty the page so that the downgrade below has a TLB entry to kill
+  (*flush_page)++;
+  return mprotect(page, pagesize, PROT_NONE) == 0;
+#else
+  return false;
+#endif
+}
+
 void DumpSystemAllocatorStats(TCMalloc_Printer* printer) {
   for (int j = 0; j < kMaxAllocators; j++) {
     SysAllocator *a = allocators[j];
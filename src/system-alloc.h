@@ -65,6 +65,25 @@ extern void* TCMalloc_SystemAlloc(size_t bytes, size_t *actual_bytes,
 // be released, partial pages will not.)
 extern void TCMalloc_SystemRelease(void* start, size_t length);
 
+// Map "bytes" bytes of zeroed memory, aligned to "alignment" (a power
+// of two), for a single huge block, independently of the system
+// allocators above.  Unlike memory from TCMalloc_SystemAlloc(), it
+// can be given back with TCMalloc_DirectUnmap().  Returns NULL if the
+// system will not map it, or cannot map memory this way at all.
+extern void* TCMalloc_DirectMap(size_t bytes, size_t alignment);
+
+// Unmap a block returned by TCMalloc_DirectMap().  "bytes" must be
+// the size it was mapped with.
+extern void TCMalloc_DirectUnmap(void* start, size_t bytes);
+
+// Make every store that any thread of this process has made so far
+// visible to the calling thread, as if each of them had executed a
+// full memory barrier.  This lets a rarely-run path synchronize with
+// threads that only use plain loads and stores.  Expensive (it costs
+// an inter-processor interrupt).  Returns false if the operating
+// system gives us no way to do it.
+extern bool TCMalloc_FlushProcessWriteBuffers();
+
 // Interface to a pluggable system allocator.
 class SysAllocator {
  public:
@@ -0,0 +1,105 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// An opt-in, inline version of the allocation fast path.
+//
+// malloc() and free() are out-of-line calls, and in a shared library
+// they also go through the PLT.  A program that links tcmalloc
+// statically can include this header and call tcmalloc::InlineMalloc()
+// and tcmalloc::InlineFree() instead, for instance from class-specific
+// operator new and delete.  They pop and push the thread cache's free
+// list in the caller, and hand everything else to malloc() and free():
+//
+//  - sizes above kMaxSize, and threads that have no thread cache yet,
+//  - empty free lists, and free lists or caches that are full,
+//  - allocations due to be sampled, and frees of sampled objects,
+//  - everything, while a MallocHook new or delete hook is installed
+//    (that includes TCMALLOC_TRACE_FILE), or while
+//    TCMALLOC_LIFETIME_SEGREGATION is on.
+//
+// So hooks, sampling, the per-thread counters and idle cache reclaim
+// all see these calls just as they see malloc() and free().
+// Memory from InlineMalloc() may be freed with free() and vice versa.
+//
+// This header pulls in tcmalloc's internal headers, so the caller must
+// be built with tcmalloc's src directory on its include path and the
+// config.h tcmalloc was built with.  It is not installed.
+
+#ifndef TCMALLOC_TCMALLOC_INL_H_
+#define TCMALLOC_TCMALLOC_INL_H_
+
+#include "config.h"
+#include <stdlib.h>                     // for malloc, free
+#include <google/malloc_hook.h>
+#include "base/commandlineflags.h"
+#include "common.h"
+#include "lifetime_profile.h"
+#include "malloc_hook-inl.h"
+#include "page_heap.h"
+#include "static_vars.h"
+#include "thread_cache.h"
+
+DECLARE_int64(tcmalloc_sample_parameter);
+
+namespace tcmalloc {
+
+inline void* InlineMalloc(size_t size) {
+  if (size <= kMaxSize &&
+      MallocHook::GetNewHook() == NULL &&
+      !FLAGS_tcmalloc_lifetime_segregation) {
+    ThreadCache* heap = ThreadCache::GetCacheIfPresent();
+    if (heap != NULL) {
+      void* result =
+          heap->TryAllocate(size, FLAGS_tcmalloc_sample_parameter > 0);
+      if (result != NULL) return result;
+    }
+  }
+  return malloc(size);
+}
+
+inline void InlineFree(void* ptr) {
+  if (MallocHook::GetDeleteHook() == NULL) {
+    // A thread cache means tcmalloc is initialized, so the pagemap is
+    // there.  Sampled objects, long-lived ones and large ones all have
+    // sizeclass 0 in the pagemap.
+    ThreadCache* heap = ThreadCache::GetCacheIfPresent();
+    if (heap != NULL && ptr != NULL) {
+      const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+      const size_t cl = Static::pageheap()->GetSizeClass(p);
+      if (cl != 0 && heap->TryDeallocate(ptr, cl)) return;
+    }
+  }
+  free(ptr);
+}
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_TCMALLOC_INL_H_
@@ -45,24 +45,34 @@
 //  4. The pagemap (which maps from page-number to descriptor),
 //     can be read without holding any locks, and written while holding
 //     the "pageheap_lock".
-//  5. To improve performance, a subset of the information one can get
-//     from the pagemap is cached in a data structure, pagemap_cache_,
-//     that atomically reads and writes its entries.  This cache can be
-//     read and written without locking.
+//  5. The leaves of the pagemap also hold the sizeclass of each page,
+//     one byte per page, so that free() can find the sizeclass without
+//     touching the Span.  These bytes can be read without locking.
+//  6. Creating and deleting thread caches only takes ThreadCache's
+//     own list lock, never "pageheap_lock".
+//  7. The stack traces we keep, for sampled objects and for heap
+//     growth, are protected by "sample_lock".  It is never held
+//     together with "pageheap_lock": PageHeap::New() reports how much
+//     the heap grew, and the caller records the stack once it has
+//     released "pageheap_lock".
+//  8. Statistics are read without "pageheap_lock", through SeqLocks
+//     (see base/seqlock.h).  With TCMALLOC_LOCK_HOLD_HISTOGRAM set,
+//     the process-wide locks above record how long they are held
+//     (see timed_spinlock.h).
 //
 //     This multi-threaded access to the pagemap is safe for fairly
 //     subtle reasons.  We basically assume that when an object X is
 //     allocated by thread A and deallocated by thread B, there must
 //     have been appropriate synchronization in the handoff of object
-//     X from thread A to thread B.  The same logic applies to pagemap_cache_.
+//     X from thread A to thread B.
 //
-// THE PAGEID-TO-SIZECLASS CACHE
-// Hot PageID-to-sizeclass mappings are held by pagemap_cache_.  If this cache
-// returns 0 for a particular PageID then that means "no information," not that
-// the sizeclass is 0.  The cache may have stale information for pages that do
-// not hold the beginning of any free()'able object.  Staleness is eliminated
-// in Populate() for pages with sizeclass > 0 objects, and in do_malloc() and
-// do_memalign() for all other relevant pages.
+// THE PAGEID-TO-SIZECLASS MAP
+// The sizeclass byte for a page is non-zero exactly when the page belongs
+// to a span of small objects (set in RegisterSizeClass(), cleared when the
+// span goes back to the page heap), except that it reads 0 for a page
+// holding the start of a live sampled object.  A 0 therefore means "look
+// at the Span", which is what we need for large objects and for dropping
+// the record of a sampled object.
 //
 // PAGEMAP
 // -------
@@ -101,6 +111,7 @@
 #include <malloc.h>                        // for struct mallinfo
 #endif
 #include <string.h>
+#include <limits.h>                        // for INT_MAX
 #ifdef HAVE_PTHREAD
 #include <pthread.h>
 #endif
@@ -120,24 +131,31 @@
 #include <google/malloc_extension.h>
 #include "central_freelist.h"
 #include "internal_logging.h"
+#include "lifetime_profile.h"
 #include "linked_list.h"
 #include "maybe_threads.h"
+#include "memory_pressure.h"
 #include "page_heap.h"
 #include "page_heap_allocator.h"
 #include "pagemap.h"
+#include "sampler.h"
 #include "span.h"
 #include "static_vars.h"
 #include "system-alloc.h"
 #include "tcmalloc_guard.h"
 #include "thread_cache.h"
 
+using tcmalloc::CentralFreeList;
 using tcmalloc::PageHeap;
 using tcmalloc::PageHeapAllocator;
+using tcmalloc::SampledObject;
+using tcmalloc::Sampler;
 using tcmalloc::SizeMap;
 using tcmalloc::Span;
 using tcmalloc::StackTrace;
 using tcmalloc::Static;
 using tcmalloc::ThreadCache;
+using tcmalloc::TimedSpinLockHolder;
 
 // __THROW is defined in glibc systems.  It means, counter-intuitively,
 // "This function will never throw an exception."  It's an optional
@@ -148,6 +166,7 @@ using tcmalloc::ThreadCache;
 
 DECLARE_int64(tcmalloc_sample_parameter);
 DECLARE_double(tcmalloc_release_rate);
+DECLARE_bool(tcmalloc_color_objects);
 
 // For windows, the printf we use to report large allocs is
 // potentially dangerous: it could cause a malloc that would cause an
@@ -172,6 +191,12 @@ DEFINE_int64(tcmalloc_large_alloc_report_threshold,
              "generated by this flag.  Default value of this flag "
              "is very large and therefore you should see no extra "
              "logging unless the flag is overridden.");
+DEFINE_int64(tcmalloc_direct_mmap_threshold,
+             EnvToInt64("TCMALLOC_DIRECT_MMAP_THRESHOLD", 64 << 20),
+             "Allocations of at least this many bytes are mapped straight"
+             " from the system instead of being carved out of the page"
+             " heap, and are unmapped as soon as they are freed.  Zero"
+             " turns this off.");
 
 // Extract interesting stats
 struct TCMallocStats {
@@ -181,6 +206,7 @@ struct TCMallocStats {
   uint64_t transfer_bytes;      // Bytes in central transfer cache
   uint64_t pageheap_bytes;      // Bytes in page heap
   uint64_t metadata_bytes;      // Bytes alloced for metadata
+  uint64_t reclaimed_bytes;     // Bytes drained from idle thread caches
 };
 
 // Get stats into "r".  Also get per-size-class counts if class_count != NULL
@@ -188,7 +214,8 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count) {
   r->central_bytes = 0;
   r->transfer_bytes = 0;
   for (int cl = 0; cl < kNumClasses; ++cl) {
-    const int length = Static::central_cache()[cl].length();
+    const int length = Static::central_cache()[cl].length()
+                       + Static::long_lived_cache()[cl].length();
     const int tc_length = Static::central_cache()[cl].tc_length();
     const size_t size = static_cast<uint64_t>(
         Static::sizemap()->ByteSizeForClass(cl));
@@ -199,20 +226,100 @@ static void ExtractStats(TCMallocStats* r, uint64_t* class_count) {
 
   // Add stats from per-thread heaps
   r->thread_bytes = 0;
-  { // scope
-    SpinLockHolder h(Static::pageheap_lock());
-    ThreadCache::GetThreadStats(&r->thread_bytes, class_count);
+  ThreadCache::GetThreadStats(&r->thread_bytes, class_count);
+  r->reclaimed_bytes = ThreadCache::reclaimed_bytes();
+
+  // None of this needs pageheap_lock, so a stats reader never makes
+  // allocation wait on the page heap.
+  PageHeap::Stats pageheap;
+  Static::pageheap()->GetStats(&pageheap);
+  r->system_bytes = pageheap.system_bytes;
+  r->pageheap_bytes = pageheap.free_bytes + pageheap.unmapped_bytes;
+  r->metadata_bytes = tcmalloc::metadata_system_bytes();
+}
+
+// Get the live size distribution for MallocMemoryStats(): small
+// objects from the per-class counts, large ones from the page heap's
+// histogram of in-use spans.  Fills in "histogram" in the format of
+// MallocExtension::MallocMemoryStatsFine().
+static void LiveSizeHistogram(int* blocks, size_t* total,
+                              int histogram[kMallocFineHistogramSize]) {
+  COMPILE_ASSERT(
+      kMallocFineHistogramSubBuckets == 1 << tcmalloc::kHistogramSubBits,
+      fine_histogram_matches_page_heap);
+  *blocks = 0;
+  *total = 0;
+  memset(histogram, 0, kMallocFineHistogramSize * sizeof(*histogram));
+
+  uint64_t thread_bytes = 0;
+  uint64_t free_count[kNumClasses];
+  memset(free_count, 0, sizeof(free_count));
+  ThreadCache::GetThreadStats(&thread_bytes, free_count);
+  for (int cl = 1; cl < kNumClasses; ++cl) {
+    CentralFreeList* list = &Static::central_cache()[cl];
+    CentralFreeList* long_lived = &Static::long_lived_cache()[cl];
+    const int64 live = static_cast<int64>(list->span_objects())
+                       - list->length() - list->tc_length()
+                       - static_cast<int64>(free_count[cl])
+                       + static_cast<int64>(long_lived->span_objects())
+                       - long_lived->length();
+    if (live <= 0) continue;     // Raced with objects on the move
+    const size_t size = Static::sizemap()->ByteSizeForClass(cl);
+    histogram[tcmalloc::FineHistogramBucket(size)] += live;
+    *blocks += live;
+    *total += live * size;
   }
 
-  { //scope
-    SpinLockHolder h(Static::pageheap_lock());
-    r->system_bytes = Static::pageheap()->SystemBytes();
-    r->metadata_bytes = tcmalloc::metadata_system_bytes();
-    r->pageheap_bytes = Static::pageheap()->FreeBytes();
+  PageHeap::Stats stats;
+  Static::pageheap()->GetStats(&stats);
+  // A span of n pages is n << kPageShift bytes: the same sub-bucket,
+  // kPageShift powers of two further up
+  const int offset = kPageShift << tcmalloc::kHistogramSubBits;
+  for (int b = 0; b < PageHeap::kSpanHistogramSize; ++b) {
+    if (stats.inuse_spans[b] == 0) continue;
+    ASSERT(b + offset < kMallocFineHistogramSize);
+    histogram[b + offset] += stats.inuse_spans[b];
+    *blocks += stats.inuse_spans[b];
   }
+  *total += stats.inuse_pages << kPageShift;
 }
 
 // WRITE stats to "out"
+// Prints one line of the metadata breakdown and adds the bytes held
+// by "allocator" to *held
+template <class T>
+static void DumpMetaDataAllocator(TCMalloc_Printer* out, const char* name,
+                                  const PageHeapAllocator<T>& allocator,
+                                  uint64_t* held) {
+  out->printf("%-20s %8d in use * %5" PRIuS " bytes; %7.1f MB held\n",
+              name, allocator.inuse(), allocator.object_size(),
+              allocator.held_bytes() / 1048576.0);
+  *held += allocator.held_bytes();
+}
+
+// Breaks metadata_system_bytes() down by what the memory holds
+static void DumpMetaDataStats(TCMalloc_Printer* out) {
+  uint64_t held = 0;
+  out->printf("Metadata by type:\n");
+  DumpMetaDataAllocator(out, "Spans", *Static::span_allocator(), &held);
+  DumpMetaDataAllocator(out, "Span bitmaps",
+                        *Static::span_bitmap_allocator(), &held);
+  DumpMetaDataAllocator(out, "Thread caches", tcmalloc::threadcache_allocator,
+                        &held);
+  DumpMetaDataAllocator(out, "Sampled objects",
+                        *Static::sampled_object_allocator(), &held);
+  DumpMetaDataAllocator(out, "Stack traces",
+                        *Static::stacktrace_allocator(), &held);
+  const uint64_t free_chunks = tcmalloc::metadata_free_chunk_bytes();
+  const uint64_t total = tcmalloc::metadata_system_bytes();
+  // The rest is mostly the pagemap, which only grows
+  const uint64_t other = (total > held + free_chunks
+                          ? total - held - free_chunks : 0);
+  out->printf("%-20s %7.1f MB (released to the system)\n",
+              "Free chunks", free_chunks / 1048576.0);
+  out->printf("%-20s %7.1f MB\n", "Page map and other", other / 1048576.0);
+}
+
 static void DumpStats(TCMalloc_Printer* out, int level) {
   TCMallocStats stats;
   uint64_t class_count[kNumClasses];
@@ -237,9 +344,52 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
       }
     }
 
-    SpinLockHolder h(Static::pageheap_lock());
+    // How often each class carved a span only because it had just
+    // given one back to the page heap
+    out->printf("------------------------------------------------\n");
+    out->printf("Central cache spans: populated, reused from reserve,"
+                " returned, thrashed\n");
+    for (int cl = 1; cl < kNumClasses; ++cl) {
+      CentralFreeList::SpanStats spans;
+      Static::central_cache()[cl].GetSpanStats(&spans);
+      if (spans.populated == 0) continue;
+      out->printf("class %3d [ %8" PRIuS " bytes ] : "
+                  "%8" PRIu64 " %8" PRIu64 " %8" PRIu64 " %8" PRIu64
+                  " (%5.1f%% thrash); %" PRIuS " in reserve\n",
+                  cl, Static::sizemap()->ByteSizeForClass(cl),
+                  spans.populated, spans.reused, spans.returned,
+                  spans.thrashed, spans.thrashed * 100.0 / spans.populated,
+                  spans.reserved);
+    }
+    if (FLAGS_tcmalloc_lifetime_segregation) {
+      out->printf("Long-lived central cache spans:"
+                  " populated, in use objects\n");
+      for (int cl = 1; cl < kNumClasses; ++cl) {
+        CentralFreeList* list = &Static::long_lived_cache()[cl];
+        CentralFreeList::SpanStats spans;
+        list->GetSpanStats(&spans);
+        if (spans.populated == 0) continue;
+        out->printf("class %3d [ %8" PRIuS " bytes ] : "
+                    "%8" PRIu64 " %8" PRIuS "\n",
+                    cl, Static::sizemap()->ByteSizeForClass(cl),
+                    spans.populated,
+                    list->span_objects() - list->length());
+      }
+    }
+
     Static::pageheap()->Dump(out);
 
+    out->printf("------------------------------------------------\n");
+    DumpMetaDataStats(out);
+
+    if (FLAGS_tcmalloc_lock_hold_histogram) {
+      out->printf("------------------------------------------------\n");
+      Static::pageheap_lock()->DumpHoldHistogram(out, "Page heap lock");
+      Static::sample_lock()->DumpHoldHistogram(out, "Sample lock");
+      ThreadCache::heap_list_lock()->DumpHoldHistogram(
+          out, "Thread cache list lock");
+    }
+
     out->printf("------------------------------------------------\n");
     DumpSystemAllocatorStats(out);
   }
@@ -260,6 +410,7 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
               "MALLOC: %12" PRIu64 "              Spans in use\n"
               "MALLOC: %12" PRIu64 "              Thread heaps in use\n"
               "MALLOC: %12" PRIu64 " (%7.1f MB) Metadata allocated\n"
+              "MALLOC: %12" PRIu64 " (%7.1f MB) Reclaimed from idle thread caches\n"
               "------------------------------------------------\n",
               stats.system_bytes, stats.system_bytes / MB,
               bytes_in_use, bytes_in_use / MB,
@@ -269,7 +420,8 @@ static void DumpStats(TCMalloc_Printer* out, int level) {
               stats.thread_bytes, stats.thread_bytes / MB,
               uint64_t(Static::span_allocator()->inuse()),
               uint64_t(ThreadCache::HeapsInUse()),
-              stats.metadata_bytes, stats.metadata_bytes / MB);
+              stats.metadata_bytes, stats.metadata_bytes / MB,
+              stats.reclaimed_bytes, stats.reclaimed_bytes / MB);
 }
 
 static void PrintStats(int level) {
@@ -281,15 +433,14 @@ static void PrintStats(int level) {
   delete[] buffer;
 }
 
-static void** DumpStackTraces() {
+static void** DumpStackTraces(int* sample_period) {
   // Count how much space we need
   int needed_slots = 0;
   {
-    SpinLockHolder h(Static::pageheap_lock());
-    Span* sampled = Static::sampled_objects();
-    for (Span* s = sampled->next; s != sampled; s = s->next) {
-      StackTrace* stack = reinterpret_cast<StackTrace*>(s->objects);
-      needed_slots += 3 + stack->depth;
+    TimedSpinLockHolder h(Static::sample_lock());
+    SampledObject* sampled = Static::sampled_objects();
+    for (SampledObject* s = sampled->next; s != sampled; s = s->next) {
+      needed_slots += 3 + s->stack.depth;
     }
     needed_slots += 100;            // Slop in case sample grows
     needed_slots += needed_slots/8; // An extra 12.5% slop
@@ -302,12 +453,13 @@ static void** DumpStackTraces() {
     return NULL;
   }
 
-  SpinLockHolder h(Static::pageheap_lock());
+  TimedSpinLockHolder h(Static::sample_lock());
+  *sample_period = Sampler::GetSamplePeriod();
   int used_slots = 0;
-  Span* sampled = Static::sampled_objects();
-  for (Span* s = sampled->next; s != sampled; s = s->next) {
+  SampledObject* sampled = Static::sampled_objects();
+  for (SampledObject* s = sampled->next; s != sampled; s = s->next) {
     ASSERT(used_slots < needed_slots);  // Need to leave room for terminator
-    StackTrace* stack = reinterpret_cast<StackTrace*>(s->objects);
+    const StackTrace* stack = &s->stack;
     if (used_slots + 3 + stack->depth >= needed_slots) {
       // No more room
       break;
@@ -329,7 +481,7 @@ static void** DumpHeapGrowthStackTraces() {
   // Count how much space we need
   int needed_slots = 0;
   {
-    SpinLockHolder h(Static::pageheap_lock());
+    TimedSpinLockHolder h(Static::sample_lock());
     for (StackTrace* t = Static::growth_stacks();
          t != NULL;
          t = reinterpret_cast<StackTrace*>(
@@ -347,7 +499,7 @@ static void** DumpHeapGrowthStackTraces() {
     return NULL;
   }
 
-  SpinLockHolder h(Static::pageheap_lock());
+  TimedSpinLockHolder h(Static::sample_lock());
   int used_slots = 0;
   for (StackTrace* t = Static::growth_stacks();
        t != NULL;
@@ -374,6 +526,25 @@ static void** DumpHeapGrowthStackTraces() {
 // TCMalloc's support for extra malloc interfaces
 class TCMallocImplementation : public MallocExtension {
  public:
+  virtual bool MallocMemoryStats(int* blocks, size_t* total,
+                                 int histogram[kMallocHistogramSize]) {
+    int fine[kMallocFineHistogramSize];
+    LiveSizeHistogram(blocks, total, fine);
+    for (int i = 0; i < kMallocHistogramSize; ++i) {
+      histogram[i] = 0;
+      for (int j = 0; j < kMallocFineHistogramSubBuckets; ++j) {
+        histogram[i] += fine[i * kMallocFineHistogramSubBuckets + j];
+      }
+    }
+    return true;
+  }
+
+  virtual bool MallocMemoryStatsFine(int* blocks, size_t* total,
+                                     int histogram[kMallocFineHistogramSize]) {
+    LiveSizeHistogram(blocks, total, histogram);
+    return true;
+  }
+
   virtual void GetStats(char* buffer, int buffer_length) {
     ASSERT(buffer_length > 0);
     TCMalloc_Printer printer(buffer, buffer_length);
@@ -387,7 +558,12 @@ class TCMallocImplementation : public MallocExtension {
   }
 
   virtual void** ReadStackTraces() {
-    return DumpStackTraces();
+    int sample_period;
+    return DumpStackTraces(&sample_period);
+  }
+
+  virtual void** ReadStackTracesWithPeriod(int* sample_period) {
+    return DumpStackTraces(sample_period);
   }
 
   virtual void** ReadHeapGrowthStackTraces() {
@@ -418,13 +594,14 @@ class TCMallocImplementation : public MallocExtension {
     if (strcmp(name, "tcmalloc.slack_bytes") == 0) {
       // We assume that bytes in the page heap are not fragmented too
       // badly, and are therefore available for allocation.
-      SpinLockHolder l(Static::pageheap_lock());
-      *value = Static::pageheap()->FreeBytes();
+      PageHeap::Stats stats;
+      Static::pageheap()->GetStats(&stats);
+      *value = stats.free_bytes + stats.unmapped_bytes;
       return true;
     }
 
     if (strcmp(name, "tcmalloc.max_total_thread_cache_bytes") == 0) {
-      SpinLockHolder l(Static::pageheap_lock());
+      // A single word, so no need to stop the page heap to read it
       *value = ThreadCache::overall_thread_cache_size();
       return true;
     }
@@ -436,6 +613,26 @@ class TCMallocImplementation : public MallocExtension {
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.idle_thread_cache_reclaimed_bytes") == 0) {
+      *value = ThreadCache::reclaimed_bytes();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.sampling_period_bytes") == 0) {
+      *value = Sampler::GetSamplePeriod();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.metadata_bytes") == 0) {
+      *value = tcmalloc::metadata_system_bytes();
+      return true;
+    }
+
+    if (strcmp(name, "tcmalloc.free_metadata_bytes") == 0) {
+      *value = tcmalloc::metadata_free_chunk_bytes();
+      return true;
+    }
+
     return false;
   }
 
@@ -443,11 +640,14 @@ class TCMallocImplementation : public MallocExtension {
     ASSERT(name != NULL);
 
     if (strcmp(name, "tcmalloc.max_total_thread_cache_bytes") == 0) {
-      SpinLockHolder l(Static::pageheap_lock());
       ThreadCache::set_overall_thread_cache_size(value);
       return true;
     }
 
+    if (strcmp(name, "tcmalloc.sampling_period_bytes") == 0) {
+      return Sampler::SetSamplePeriod(value);
+    }
+
     return false;
   }
 
@@ -456,8 +656,17 @@ class TCMallocImplementation : public MallocExtension {
   }
 
   virtual void ReleaseFreeMemory() {
-    SpinLockHolder h(Static::pageheap_lock());
-    Static::pageheap()->ReleaseFreePages();
+    // Caches left by exited threads go back to the central lists first
+    ThreadCache::ReleaseDonatedCaches();
+    for (int cl = 1; cl < kNumClasses; ++cl) {
+      Static::central_cache()[cl].ReleaseReserve();
+      Static::long_lived_cache()[cl].ReleaseReserve();
+    }
+    {
+      TimedSpinLockHolder h(Static::pageheap_lock());
+      Static::pageheap()->ReleaseFreePages();
+    }
+    tcmalloc::PollMemoryPressure();
   }
 
   virtual void SetMemoryReleaseRate(double rate) {
@@ -467,6 +676,30 @@ class TCMallocImplementation : public MallocExtension {
   virtual double GetMemoryReleaseRate() {
     return FLAGS_tcmalloc_release_rate;
   }
+
+  virtual bool GetThreadAllocationCounters(size_t* allocated_bytes,
+                                           size_t* freed_bytes) {
+    // A thread that has no cache yet has not allocated anything
+    ThreadCache* heap = ThreadCache::GetCacheIfPresent();
+    *allocated_bytes = (heap == NULL ? 0 : heap->allocated_bytes());
+    *freed_bytes = (heap == NULL ? 0 : heap->freed_bytes());
+    return true;
+  }
+
+  virtual bool AddMemoryPressureCallback(MemoryPressureCallback callback,
+                                         void* arg, size_t heap_limit,
+                                         size_t rss_limit, size_t free_floor) {
+    return tcmalloc::AddMemoryPressureCallback(callback, arg, heap_limit,
+                                               rss_limit, free_floor);
+  }
+
+  virtual bool RemoveMemoryPressureCallback(MemoryPressureCallback callback,
+                                            void* arg) {
+    return tcmalloc::RemoveMemoryPressureCallback(callback, arg);
+  }
+
+  // Defined below, once GetSize() is
+  virtual size_t GetAllocatedSize(void* ptr);
 };
 
 // The constructor allocates an object to ensure that initialization
@@ -514,49 +747,41 @@ static TCMallocGuard module_enter_exit_hook;
 // Helpers for the exported routines below
 //-------------------------------------------------------------------
 
-static Span* DoSampledAllocation(size_t size) {
-  // Grab the stack trace outside the heap lock
+// Remember the stack trace for "result", a freshly allocated object
+// of "size" bytes from allocation site "site" that we decided to
+// sample.  The object itself was allocated the usual way, so we never
+// touch pageheap_lock here.
+static void DoSampledAllocation(void* result, size_t size,
+                                const void* site) {
   StackTrace tmp;
   tmp.depth = GetStackTrace(tmp.stack, tcmalloc::kMaxStackDepth, 1);
   tmp.size = size;
 
-  SpinLockHolder h(Static::pageheap_lock());
-  // Allocate span
-  Span *span = Static::pageheap()->New(tcmalloc::pages(size == 0 ? 1 : size));
-  if (span == NULL) {
-    return NULL;
-  }
-
-  // Allocate stack trace
-  StackTrace *stack = Static::stacktrace_allocator()->New();
-  if (stack == NULL) {
-    // Sampling failed because of lack of memory
-    return span;
-  }
-
-  *stack = tmp;
-  span->sample = 1;
-  span->objects = stack;
-  tcmalloc::DLL_Prepend(Static::sampled_objects(), span);
-
-  return span;
+  const PageID p = reinterpret_cast<uintptr_t>(result) >> kPageShift;
+  Span* span = Static::pageheap()->GetDescriptor(p);
+  ASSERT(span != NULL);
+  // If we are out of memory for the record, just skip this sample
+  tcmalloc::RecordSampledObject(span, result, tmp, site);
 }
 
-static inline bool CheckCachedSizeClass(void *ptr) {
+static inline bool CheckSizeClass(void *ptr) {
   PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
-  size_t cached_value = Static::pageheap()->GetSizeClassIfCached(p);
-  return cached_value == 0 ||
-      cached_value == Static::pageheap()->GetDescriptor(p)->sizeclass;
+  size_t cl = Static::pageheap()->GetSizeClass(p);
+  return cl == 0 || cl == Static::pageheap()->GetDescriptor(p)->sizeclass;
 }
 
 static inline void* CheckedMallocResult(void *result)
 {
-  ASSERT(result == 0 || CheckCachedSizeClass(result));
+  ASSERT(result == 0 || CheckSizeClass(result));
   return result;
 }
 
+// Also counts the span against the calling thread, as
+// ThreadCache::Allocate() does for small objects.
 static inline void* SpanToMallocResult(Span *span) {
-  Static::pageheap()->CacheSizeClass(span->start, 0);
+  ASSERT(Static::pageheap()->GetSizeClass(span->start) == 0);
+  ThreadCache* heap = ThreadCache::GetCacheIfPresent();
+  if (heap != NULL) heap->RecordAllocatedBytes(span->length << kPageShift);
   return
       CheckedMallocResult(reinterpret_cast<void*>(span->start << kPageShift));
 }
@@ -598,13 +823,39 @@ void* InvalidRealloc(void* old_ptr, size_t new_size) {
   return NULL;
 }
 
+size_t InvalidGetAllocatedSize(void* ptr) {
+  CRASH("Attempt to get the size of an invalid pointer: %p\n", ptr);
+  return 0;
+}
+
+// Map a huge object of "num_pages" pages straight from the system,
+// keeping the system call outside pageheap_lock.  Returns NULL if the
+// system would not map it, and the caller falls back to the page heap.
+Span* NewDirectSpan(Length num_pages) {
+  const size_t bytes = num_pages << kPageShift;
+  void* start = TCMalloc_DirectMap(bytes, kPageSize);
+  if (start == NULL) return NULL;
+  Span* span;
+  {
+    TimedSpinLockHolder h(Static::pageheap_lock());
+    span = Static::pageheap()->RegisterDirect(start, num_pages);
+  }
+  if (span == NULL) TCMalloc_DirectUnmap(start, bytes);
+  return span;
+}
+
 // Helper for do_malloc().
 inline void* do_malloc_pages(Length num_pages) {
-  Span *span;
+  Span *span = NULL;
+  size_t growth = 0;
   bool report_large = false;
+  const int64 direct_threshold = FLAGS_tcmalloc_direct_mmap_threshold;
+  if (direct_threshold > 0 && num_pages >= (direct_threshold >> kPageShift)) {
+    span = NewDirectSpan(num_pages);
+  }
   {
-    SpinLockHolder h(Static::pageheap_lock());
-    span = Static::pageheap()->New(num_pages);
+    TimedSpinLockHolder h(Static::pageheap_lock());
+    if (span == NULL) span = Static::pageheap()->New(num_pages, &growth);
     const int64 threshold = large_alloc_threshold;
     if (num_pages >= (threshold >> kPageShift)) {
       // Increase the threshold by 1/8 every time we generate a report.
@@ -614,36 +865,71 @@ inline void* do_malloc_pages(Length num_pages) {
       report_large = true;
     }
   }
+  tcmalloc::RecordHeapGrowth(growth);
 
   void* result = (span == NULL ? NULL : SpanToMallocResult(span));
   if (report_large) {
     ReportLargeAlloc(num_pages, result);
   }
+  tcmalloc::PollMemoryPressure();
   return result;
 }
 
-inline void* do_malloc(size_t size) {
+// The allocation site that the lifetime profile keys on: the return
+// address of the exported routine (malloc, operator new, ...).
+// do_malloc() sees it because it is always inlined into those
+// routines, as are do_calloc() and cpp_alloc().  Growing reallocs may
+// all share one site inside do_realloc_with_callback().
+#if defined(__GNUC__)
+#define ALLOCATION_SITE() __builtin_return_address(0)
+#else
+#define ALLOCATION_SITE() NULL
+#endif
+
+// Helper for do_malloc(): a small object from a long-lived allocation
+// site.  It comes straight from the long-lived central list, since a
+// thread cache would mix it up with objects from other sites.
+static void* DoLongLivedAllocation(ThreadCache* heap, size_t size) {
+  const size_t cl = Static::sizemap()->SizeClass(size);
+  void* start;
+  void* end;
+  if (Static::long_lived_cache()[cl].RemoveRange(&start, &end, 1) == 0) {
+    return NULL;
+  }
+  ASSERT(start == end);
+  heap->RecordAllocatedBytes(Static::sizemap()->ByteSizeForClass(cl));
+  tcmalloc::PollMemoryPressure();
+  return start;
+}
+
+ATTRIBUTE_ALWAYS_INLINE inline void* do_malloc(size_t size) {
   void* ret = NULL;
 
   // The following call forces module initialization
   ThreadCache* heap = ThreadCache::GetCache();
-  if ((FLAGS_tcmalloc_sample_parameter > 0) && heap->SampleAllocation(size)) {
-    Span* span = DoSampledAllocation(size);
-    if (span != NULL) {
-      ret = SpanToMallocResult(span);
+  const void* const site = ALLOCATION_SITE();
+  if (size <= kMaxSize) {
+    if (FLAGS_tcmalloc_lifetime_segregation &&
+        tcmalloc::IsLongLivedSite(site)) {
+      ret = DoLongLivedAllocation(heap, size);
+    } else {
+      // The common case, and also the simplest.  This just pops the
+      // size-appropriate freelist, after replenishing it if it's empty.
+      ret = CheckedMallocResult(heap->Allocate(size));
     }
-  } else if (size <= kMaxSize) {
-    // The common case, and also the simplest.  This just pops the
-    // size-appropriate freelist, after replenishing it if it's empty.
-    ret = CheckedMallocResult(heap->Allocate(size));
   } else {
     ret = do_malloc_pages(tcmalloc::pages(size));
   }
-  if (ret == NULL) errno = ENOMEM;
+  if (ret == NULL) {
+    errno = ENOMEM;
+  } else if ((FLAGS_tcmalloc_sample_parameter > 0) &&
+             heap->SampleAllocation(size)) {
+    DoSampledAllocation(ret, size, site);
+  }
   return ret;
 }
 
-inline void* do_calloc(size_t n, size_t elem_size) {
+ATTRIBUTE_ALWAYS_INLINE inline void* do_calloc(size_t n, size_t elem_size) {
   // Overflow check
   const size_t size = n * elem_size;
   if (elem_size != 0 && size / elem_size != n) return NULL;
@@ -667,7 +953,7 @@ inline void do_free_with_callback(void* ptr, void (*invalid_free_fn)(void*)) {
   ASSERT(Static::pageheap() != NULL);  // Should not call free() before malloc()
   const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
   Span* span = NULL;
-  size_t cl = Static::pageheap()->GetSizeClassIfCached(p);
+  size_t cl = Static::pageheap()->GetSizeClass(p);
 
   if (cl == 0) {
     span = Static::pageheap()->GetDescriptor(p);
@@ -683,12 +969,18 @@ inline void do_free_with_callback(void* ptr, void (*invalid_free_fn)(void*)) {
       return;
     }
     cl = span->sizeclass;
-    Static::pageheap()->CacheSizeClass(p, cl);
+    tcmalloc::ForgetSampledObject(span, ptr);
   }
   if (cl != 0) {
-    ASSERT(!Static::pageheap()->GetDescriptor(p)->sample);
     ThreadCache* heap = GetCacheIfPresent();
-    if (heap != NULL) {
+    if (span != NULL && span->long_lived) {
+      // Keep it away from the thread cache; see DoLongLivedAllocation()
+      if (heap != NULL) {
+        heap->RecordFreedBytes(Static::sizemap()->ByteSizeForClass(cl));
+      }
+      tcmalloc::SLL_SetNext(ptr, NULL);
+      Static::long_lived_cache()[cl].InsertRange(ptr, ptr, 1);
+    } else if (heap != NULL) {
       heap->Deallocate(ptr, cl);
     } else {
       // Delete directly into central cache
@@ -696,16 +988,23 @@ inline void do_free_with_callback(void* ptr, void (*invalid_free_fn)(void*)) {
       Static::central_cache()[cl].InsertRange(ptr, ptr, 1);
     }
   } else {
-    SpinLockHolder h(Static::pageheap_lock());
     ASSERT(reinterpret_cast<uintptr_t>(ptr) % kPageSize == 0);
     ASSERT(span != NULL && span->start == p);
-    if (span->sample) {
-      tcmalloc::DLL_Remove(span);
-      Static::stacktrace_allocator()->Delete(
-          reinterpret_cast<StackTrace*>(span->objects));
-      span->objects = NULL;
+    const size_t bytes = span->length << kPageShift;
+    ThreadCache* heap = GetCacheIfPresent();
+    if (heap != NULL) heap->RecordFreedBytes(bytes);
+    if (span->direct) {
+      // Give a huge object back to the system right away
+      {
+        TimedSpinLockHolder h(Static::pageheap_lock());
+        Static::pageheap()->UnregisterDirect(span);
+      }
+      TCMalloc_DirectUnmap(ptr, bytes);
+    } else {
+      TimedSpinLockHolder h(Static::pageheap_lock());
+      Static::pageheap()->Delete(span);
     }
-    Static::pageheap()->Delete(span);
+    tcmalloc::PollMemoryPressure();
   }
 }
 
@@ -714,6 +1013,28 @@ inline void do_free(void* ptr) {
   return do_free_with_callback(ptr, &InvalidFree);
 }
 
+// Returns the number of bytes reserved for "ptr", which is what its
+// size class or span holds rather than what was asked for.
+inline size_t GetSizeWithCallback(void* ptr,
+                                  size_t (*invalid_getsize_fn)(void*)) {
+  if (ptr == NULL) return 0;
+  const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
+  size_t cl = Static::pageheap()->GetSizeClass(p);
+  if (cl != 0) return Static::sizemap()->ByteSizeForClass(cl);
+
+  const Span* span = Static::pageheap()->GetDescriptor(p);
+  if (span == NULL) return (*invalid_getsize_fn)(ptr);
+  if (span->sizeclass != 0) {
+    // A sampled object keeps its size class in the span
+    return Static::sizemap()->ByteSizeForClass(span->sizeclass);
+  }
+  return span->length << kPageShift;
+}
+
+inline size_t GetSize(void* ptr) {
+  return GetSizeWithCallback(ptr, &InvalidGetAllocatedSize);
+}
+
 // This lets you call back to a given function pointer if ptr is invalid.
 // It is used primarily by windows code which wants a specialized callback.
 inline void* do_realloc_with_callback(void* old_ptr, size_t new_size,
@@ -721,7 +1042,7 @@ inline void* do_realloc_with_callback(void* old_ptr, size_t new_size,
                                                                   size_t)) {
   // Get the size of the old entry
   const PageID p = reinterpret_cast<uintptr_t>(old_ptr) >> kPageShift;
-  size_t cl = Static::pageheap()->GetSizeClassIfCached(p);
+  size_t cl = Static::pageheap()->GetSizeClass(p);
   Span *span = NULL;
   size_t old_size;
   if (cl == 0) {
@@ -733,7 +1054,6 @@ inline void* do_realloc_with_callback(void* old_ptr, size_t new_size,
       return InvalidRealloc(old_ptr, new_size);
     }
     cl = span->sizeclass;
-    Static::pageheap()->CacheSizeClass(p, cl);
   }
   if (cl != 0) {
     old_size = Static::sizemap()->ByteSizeForClass(cl);
@@ -784,6 +1104,59 @@ inline void* do_realloc(void* old_ptr, size_t new_size) {
   return do_realloc_with_callback(old_ptr, new_size, &InvalidRealloc);
 }
 
+// Returns the first size class at or above the one for "size" whose
+// objects are all aligned to "align", or kNumClasses if there is none.
+// Colored spans only start their objects on a cache-line boundary, so
+// such classes are no good for larger alignments.
+inline int AlignedSizeClass(size_t size, size_t align) {
+  const bool colored = FLAGS_tcmalloc_color_objects && align > kCacheLineSize;
+  int cl = Static::sizemap()->SizeClass(size);
+  while (cl < kNumClasses &&
+         (((Static::sizemap()->class_to_size(cl) & (align - 1)) != 0) ||
+          (colored && Static::sizemap()->class_to_colors(cl) > 1))) {
+    cl++;
+  }
+  return cl;
+}
+
+// Helper for do_memalign(): a span of "size" bytes from the page heap,
+// starting on a multiple of "align".  "*growth" is as for
+// PageHeap::New().  REQUIRES: pageheap_lock is held.
+static Span* NewAlignedSpan(size_t size, size_t align, size_t* growth) {
+  if (align <= kPageSize) {
+    // Any page-level allocation will be fine
+    // TODO: We could put the rest of this page in the appropriate
+    // TODO: cache but it does not seem worth it.
+    return Static::pageheap()->New(tcmalloc::pages(size), growth);
+  }
+
+  // Allocate extra pages and carve off an aligned portion
+  const Length alloc = tcmalloc::pages(size + align);
+  Span* span = Static::pageheap()->New(alloc, growth);
+  if (span == NULL) return NULL;
+
+  // Skip starting portion so that we end up aligned
+  Length skip = 0;
+  while ((((span->start+skip) << kPageShift) & (align - 1)) != 0) {
+    skip++;
+  }
+  ASSERT(skip < alloc);
+  if (skip > 0) {
+    Span* rest = Static::pageheap()->Split(span, skip);
+    Static::pageheap()->Delete(span);
+    span = rest;
+  }
+
+  // Skip trailing portion that we do not need to return
+  const Length needed = tcmalloc::pages(size);
+  ASSERT(span->length >= needed);
+  if (span->length > needed) {
+    Span* trailer = Static::pageheap()->Split(span, needed);
+    Static::pageheap()->Delete(trailer);
+  }
+  return span;
+}
+
 // For use by exported routines below that want specific alignments
 //
 // Note: this code can be slow, and can significantly fragment memory.
@@ -808,11 +1181,7 @@ void* do_memalign(size_t align, size_t size) {
     // are aligned at powers of two.  We will waste time and space if
     // we miss in the size class array, but that is deemed acceptable
     // since memalign() should be used rarely.
-    int cl = Static::sizemap()->SizeClass(size);
-    while (cl < kNumClasses &&
-           ((Static::sizemap()->class_to_size(cl) & (align - 1)) != 0)) {
-      cl++;
-    }
+    const int cl = AlignedSizeClass(size, align);
     if (cl < kNumClasses) {
       ThreadCache* heap = ThreadCache::GetCache();
       return CheckedMallocResult(heap->Allocate(
@@ -821,41 +1190,34 @@ void* do_memalign(size_t align, size_t size) {
   }
 
   // We will allocate directly from the page heap
-  SpinLockHolder h(Static::pageheap_lock());
-
-  if (align <= kPageSize) {
-    // Any page-level allocation will be fine
-    // TODO: We could put the rest of this page in the appropriate
-    // TODO: cache but it does not seem worth it.
-    Span* span = Static::pageheap()->New(tcmalloc::pages(size));
-    return span == NULL ? NULL : SpanToMallocResult(span);
+  Span* span;
+  size_t growth;
+  {
+    TimedSpinLockHolder h(Static::pageheap_lock());
+    span = NewAlignedSpan(size, align, &growth);
   }
+  tcmalloc::RecordHeapGrowth(growth);
+  return span == NULL ? NULL : SpanToMallocResult(span);
+}
 
-  // Allocate extra pages and carve off an aligned portion
-  const Length alloc = tcmalloc::pages(size + align);
-  Span* span = Static::pageheap()->New(alloc);
-  if (span == NULL) return NULL;
-
-  // Skip starting portion so that we end up aligned
-  Length skip = 0;
-  while ((((span->start+skip) << kPageShift) & (align - 1)) != 0) {
-    skip++;
-  }
-  ASSERT(skip < alloc);
-  if (skip > 0) {
-    Span* rest = Static::pageheap()->Split(span, skip);
-    Static::pageheap()->Delete(span);
-    span = rest;
-  }
+// Returns what GetSize() would report for the result of
+// do_memalign(align, size), or of do_malloc(size) when "align" is 1,
+// without allocating anything.  Returns 0 on overflow.
+inline size_t do_nallocx(size_t size, size_t align) {
+  ASSERT((align & (align - 1)) == 0);
+  if (size + align < size) return 0;            // Overflow
+  if (Static::pageheap() == NULL) ThreadCache::InitModule();
+  if (size == 0) size = 1;                      // As do_memalign() does
 
-  // Skip trailing portion that we do not need to return
-  const Length needed = tcmalloc::pages(size);
-  ASSERT(span->length >= needed);
-  if (span->length > needed) {
-    Span* trailer = Static::pageheap()->Split(span, needed);
-    Static::pageheap()->Delete(trailer);
+  if (size <= kMaxSize && align < kPageSize) {
+    const int cl = AlignedSizeClass(size, align);
+    if (cl < kNumClasses) return Static::sizemap()->class_to_size(cl);
   }
-  return SpanToMallocResult(span);
+  // Page-level allocations, direct-mapped or not, are trimmed to the
+  // pages they need.
+  const Length n = tcmalloc::pages(size);
+  if (n > kMaxValidPages) return 0;
+  return n << kPageShift;
 }
 
 // Helpers for use by exported routines below:
@@ -864,39 +1226,108 @@ inline void do_malloc_stats() {
   PrintStats(1);
 }
 
+// The mallopt() parameters we understand, with glibc's values for
+// systems whose <malloc.h> does not define them
+#ifndef M_TRIM_THRESHOLD
+# define M_TRIM_THRESHOLD -1
+#endif
+#ifndef M_MMAP_THRESHOLD
+# define M_MMAP_THRESHOLD -3
+#endif
+#ifndef M_ARENA_MAX
+# define M_ARENA_MAX -8
+#endif
+
+// glibc's default M_TRIM_THRESHOLD, which we take to correspond to
+// the default release rate of 1.0
+static const int kDefaultTrimThreshold = 128 << 10;
+
+// Maps the glibc tunables onto ours.  Returns 1 on success and 0 for
+// unknown commands or bad values, as glibc does.
+//  M_TRIM_THRESHOLD: the release rate, in inverse proportion to the
+//    threshold and capped at 10; a negative threshold stops releasing.
+//  M_MMAP_THRESHOLD: the direct-map threshold.  0 maps everything the
+//    page heap would serve directly, rather than turning it off.
+//  M_ARENA_MAX: the overall thread cache budget, one maximal thread
+//    cache per arena; 0 restores the default.
 inline int do_mallopt(int cmd, int value) {
-  return 1;     // Indicates error
+  switch (cmd) {
+    case M_TRIM_THRESHOLD:
+      if (value < 0) {
+        FLAGS_tcmalloc_release_rate = 0;
+      } else if (value <= kDefaultTrimThreshold / 10) {
+        FLAGS_tcmalloc_release_rate = 10;
+      } else {
+        FLAGS_tcmalloc_release_rate =
+            static_cast<double>(kDefaultTrimThreshold) / value;
+      }
+      return 1;
+    case M_MMAP_THRESHOLD:
+      if (value < 0) return 0;
+      FLAGS_tcmalloc_direct_mmap_threshold = (value == 0 ? 1 : value);
+      return 1;
+    case M_ARENA_MAX: {
+      if (value < 0) return 0;
+      // Clamp before multiplying, so a 32-bit size_t cannot wrap around
+      // to a tiny budget; set_overall_thread_cache_size() caps it anyway
+      const size_t kMaxArenas =
+          ~static_cast<size_t>(0) / ThreadCache::kMaxThreadCacheSize;
+      const size_t arenas = static_cast<size_t>(value) < kMaxArenas
+                            ? static_cast<size_t>(value) : kMaxArenas;
+      ThreadCache::set_overall_thread_cache_size(
+          arenas == 0 ? ThreadCache::kDefaultOverallThreadCacheSize
+                      : arenas * ThreadCache::kMaxThreadCacheSize);
+      return 1;
+    }
+    default:
+      return 0;
+  }
 }
 
 #ifdef HAVE_STRUCT_MALLINFO  // mallinfo isn't defined on freebsd, for instance
+inline int ClampToInt(uint64_t n) {
+  return n > INT_MAX ? INT_MAX : static_cast<int>(n);
+}
+
+// Reads only the lock-free stats, so it never waits on the page heap.
+// The struct has "int" fields, so sizes of 2GB or more are reported
+// as INT_MAX.
 inline struct mallinfo do_mallinfo() {
   TCMallocStats stats;
   ExtractStats(&stats, NULL);
+  PageHeap::Stats pageheap;
+  Static::pageheap()->GetStats(&pageheap);
+
+  const uint64_t cached = (stats.thread_bytes + stats.central_bytes +
+                           stats.transfer_bytes);
+  // Take all the page heap numbers from one snapshot
+  const uint64_t heap = pageheap.system_bytes - pageheap.direct_bytes;
+  const uint64_t heap_free = pageheap.free_bytes + pageheap.unmapped_bytes;
+  int free_spans = pageheap.large_normal_spans +
+                   pageheap.large_returned_spans;
+  for (int i = 0; i < PageHeap::kMaxPages; i++) {
+    free_spans += pageheap.normal_spans[i] + pageheap.returned_spans[i];
+  }
 
-  // Just some of the fields are filled in.
   struct mallinfo info;
   memset(&info, 0, sizeof(info));
-
-  // Unfortunately, the struct contains "int" field, so some of the
-  // size values will be truncated.
-  info.arena     = static_cast<int>(stats.system_bytes);
-  info.fsmblks   = static_cast<int>(stats.thread_bytes
-                                    + stats.central_bytes
-                                    + stats.transfer_bytes);
-  info.fordblks  = static_cast<int>(stats.pageheap_bytes);
-  info.uordblks  = static_cast<int>(stats.system_bytes
-                                    - stats.thread_bytes
-                                    - stats.central_bytes
-                                    - stats.transfer_bytes
-                                    - stats.pageheap_bytes);
-
+  info.arena     = ClampToInt(heap);                // Not directly mapped
+  info.ordblks   = free_spans;
+  info.hblks     = pageheap.direct_spans;
+  info.hblkhd    = ClampToInt(pageheap.direct_bytes);
+  info.fsmblks   = ClampToInt(cached);              // Free in the caches
+  info.fordblks  = ClampToInt(heap_free);
+  // The caches are read without stopping allocation, so can race
+  info.uordblks  = ClampToInt(heap > cached + heap_free
+                              ? heap - cached - heap_free : 0);
+  info.keepcost  = ClampToInt(pageheap.free_bytes); // Could be released
   return info;
 }
 #endif  // #ifndef HAVE_STRUCT_MALLINFO
 
 static SpinLock set_new_handler_lock(SpinLock::LINKER_INITIALIZED);
 
-inline void* cpp_alloc(size_t size, bool nothrow) {
+ATTRIBUTE_ALWAYS_INLINE inline void* cpp_alloc(size_t size, bool nothrow) {
   for (;;) {
     void* p = do_malloc(size);
 #ifdef PREANSINEW
@@ -936,6 +1367,10 @@ inline void* cpp_alloc(size_t size, bool nothrow) {
 
 }  // end unnamed namespace
 
+size_t TCMallocImplementation::GetAllocatedSize(void* ptr) {
+  return GetSize(ptr);
+}
+
 //-------------------------------------------------------------------
 // Exported routines
 //-------------------------------------------------------------------
@@ -1143,6 +1578,18 @@ extern "C" struct mallinfo mallinfo(void) {
 }
 #endif
 
+extern "C" size_t malloc_usable_size(void* ptr) __THROW {
+  return GetSize(ptr);
+}
+
+// MALLOCX_LG_ALIGN(lg) in google/malloc_extension_c.h puts lg in the
+// low six bits of "flags", as jemalloc does.
+extern "C" size_t nallocx(size_t size, int flags) {
+  const int lg_align = flags & 0x3f;
+  if (lg_align >= static_cast<int>(8 * sizeof(size_t))) return 0;
+  return do_nallocx(size, static_cast<size_t>(1) << lg_align);
+}
+
 //-------------------------------------------------------------------
 // Some library routines on RedHat 9 allocate memory using malloc()
 // and free it using __libc_free() (or vice-versa).  Since we provide
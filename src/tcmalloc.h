@@ -67,3 +67,6 @@ extern "C" void* valloc(size_t __size) __THROW;
 #if !HAVE_PVALLOC_SYMBOL
 extern "C" void* pvalloc(size_t __size) __THROW;
 #endif
+#if !HAVE_DECL_MALLOC_USABLE_SIZE
+extern "C" size_t malloc_usable_size(void* ptr) __THROW;
+#endif
@@ -0,0 +1,178 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Measures vector loads from buffers returned by malloc().
+//
+// For each buffer size we allocate many buffers of floats, report
+// which fraction of them are 16- and 32-byte aligned, and time summing
+// them three ways: with scalar loads, with unaligned vector loads
+// everywhere, and with aligned vector loads wherever the buffer allows
+// them (falling back to unaligned ones elsewhere).  The vectors are
+// SSE vectors, or AVX vectors when built with -mavx.  Compare a
+// default build with one configured with --enable-16byte-alignment.
+//
+// Usage: aligned_load_benchmark [buffers per size]
+// Not run by "make check"; build it with "make aligned_load_benchmark".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>           // for uintptr_t
+#endif
+#include <sys/time.h>
+#include <vector>
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE__)
+#include <xmmintrin.h>
+#endif
+
+using std::vector;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Keeps the compiler from optimizing away the sums below
+static volatile float sink;
+
+static float SumScalar(const float* p, size_t n) {
+  float sum = 0;
+  for (size_t i = 0; i < n; i++) sum += p[i];
+  return sum;
+}
+
+#if defined(__AVX__)
+static const size_t kVectorBytes = 32;
+static const char kVectorName[] = "AVX";
+
+static float SumVector(const float* p, size_t n, bool aligned) {
+  __m256 acc = _mm256_setzero_ps();
+  size_t i = 0;
+  if (aligned) {
+    for (; i + 8 <= n; i += 8)
+      acc = _mm256_add_ps(acc, _mm256_load_ps(p + i));
+  } else {
+    for (; i + 8 <= n; i += 8)
+      acc = _mm256_add_ps(acc, _mm256_loadu_ps(p + i));
+  }
+  float lanes[8];
+  _mm256_storeu_ps(lanes, acc);
+  float sum = 0;
+  for (int j = 0; j < 8; j++) sum += lanes[j];
+  return sum + SumScalar(p + i, n - i);
+}
+#elif defined(__SSE__)
+static const size_t kVectorBytes = 16;
+static const char kVectorName[] = "SSE";
+
+static float SumVector(const float* p, size_t n, bool aligned) {
+  __m128 acc = _mm_setzero_ps();
+  size_t i = 0;
+  if (aligned) {
+    for (; i + 4 <= n; i += 4) acc = _mm_add_ps(acc, _mm_load_ps(p + i));
+  } else {
+    for (; i + 4 <= n; i += 4) acc = _mm_add_ps(acc, _mm_loadu_ps(p + i));
+  }
+  float lanes[4];
+  _mm_storeu_ps(lanes, acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+         SumScalar(p + i, n - i);
+}
+#endif
+
+enum Mode { SCALAR, UNALIGNED, ALIGNED_IF_POSSIBLE };
+
+// Returns the mean time in ns to sum one of "buffers"
+static double TimeSums(const vector<float*>& buffers, size_t n, Mode mode) {
+  const int kRounds = static_cast<int>(20000000 / (buffers.size() * (n + 4)))
+                      + 1;
+  float total = 0;
+  const double start = NowSeconds();
+  for (int r = 0; r < kRounds; r++) {
+    for (size_t b = 0; b < buffers.size(); b++) {
+      const float* p = buffers[b];
+#if defined(__SSE__)
+      if (mode == SCALAR) {
+        total += SumScalar(p, n);
+      } else {
+        const bool aligned = (mode == ALIGNED_IF_POSSIBLE &&
+                              reinterpret_cast<uintptr_t>(p) %
+                              kVectorBytes == 0);
+        total += SumVector(p, n, aligned);
+      }
+#else
+      total += SumScalar(p, n);
+#endif
+    }
+  }
+  const double elapsed = NowSeconds() - start;
+  sink = total;
+  return elapsed * 1e9 / (static_cast<double>(kRounds) * buffers.size());
+}
+
+int main(int argc, char** argv) {
+  const int count = (argc > 1 ? atoi(argv[1]) : 8192);
+  static const size_t kSizes[] = { 8, 16, 24, 32, 48, 64, 96, 128, 256, 1024 };
+
+#if defined(__SSE__)
+  printf("vector loads: %s\n", kVectorName);
+#else
+  printf("vector loads: none (not built with SSE); all columns are scalar\n");
+#endif
+  printf("%6s %8s %8s %10s %10s %10s\n",
+         "bytes", "%align16", "%align32", "scalar ns", "loadu ns", "load ns");
+  for (size_t s = 0; s < sizeof(kSizes) / sizeof(*kSizes); s++) {
+    const size_t size = kSizes[s];
+    const size_t n = size / sizeof(float);
+    vector<float*> buffers(count);
+    int aligned16 = 0;
+    int aligned32 = 0;
+    for (int i = 0; i < count; i++) {
+      buffers[i] = static_cast<float*>(malloc(size));
+      for (size_t j = 0; j < n; j++) buffers[i][j] = static_cast<float>(j);
+      const uintptr_t address = reinterpret_cast<uintptr_t>(buffers[i]);
+      if (address % 16 == 0) aligned16++;
+      if (address % 32 == 0) aligned32++;
+    }
+
+    printf("%6d %8.1f %8.1f %10.2f %10.2f %10.2f\n",
+           static_cast<int>(size),
+           aligned16 * 100.0 / count, aligned32 * 100.0 / count,
+           TimeSums(buffers, n, SCALAR),
+           TimeSums(buffers, n, UNALIGNED),
+           TimeSums(buffers, n, ALIGNED_IF_POSSIBLE));
+    for (int i = 0; i < count; i++) free(buffers[i]);
+  }
+  return 0;
+}
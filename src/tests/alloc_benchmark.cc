@@ -0,0 +1,209 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Allocation-heavy microbenchmarks for the thread-cache fast path.
+//
+//   list:  build a linked list of small nodes, walk it, free it
+//   churn: replace random members of a working set of small objects
+//   cold:  allocate objects whose free-list links were pushed out of
+//          the CPU caches since they were freed
+//
+// "list" and "churn" report the mean time per malloc()+free() pair;
+// "cold" reports the mean time per malloc().  Where the kernel lets us
+// count them, each also reports L1 data cache load misses per op, which
+// is how to compare the thread-cache free list layouts (configure
+// --enable-array-freelists).
+//
+// Usage: alloc_benchmark [iterations scale]
+// Not run by "make check"; build it with "make alloc_benchmark".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <vector>
+#ifdef __linux
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+using std::vector;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Counts the L1 data cache load misses of this thread, if the kernel
+// and CPU let us; otherwise Count() is always 0.
+class MissCounter {
+ public:
+  MissCounter() : fd_(-1) {
+#if defined(__linux) && defined(__NR_perf_event_open)
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_L1D |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    fd_ = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#endif
+  }
+
+  bool available() const { return fd_ >= 0; }
+
+  long long Count() const {
+    long long value = 0;
+    if (fd_ < 0 || read(fd_, &value, sizeof(value)) != sizeof(value)) {
+      return 0;
+    }
+    return value;
+  }
+
+ private:
+  int fd_;
+};
+
+static MissCounter misses;
+
+static void Report(const char* name, size_t ops, double seconds,
+                   long long miss_count) {
+  printf("%-8s %10lu ops  %8.2f ns/op", name,
+         static_cast<unsigned long>(ops), seconds * 1e9 / ops);
+  if (misses.available()) {
+    printf("  %6.2f L1D misses/op", static_cast<double>(miss_count) / ops);
+  }
+  printf("\n");
+}
+
+struct Node {
+  Node* next;
+  int   value;
+};
+
+// Keeps the compiler from optimizing away the walks below
+static volatile long sink;
+
+static void BenchmarkList(int scale) {
+  const int kNodes = 100000;
+  const int rounds = 20 * scale;
+  const long long start_misses = misses.Count();
+  const double start = NowSeconds();
+  for (int r = 0; r < rounds; r++) {
+    Node* head = NULL;
+    for (int i = 0; i < kNodes; i++) {
+      Node* n = static_cast<Node*>(malloc(sizeof(Node)));
+      n->next = head;
+      n->value = i;
+      head = n;
+    }
+    long sum = 0;
+    for (Node* n = head; n != NULL; n = n->next) {
+      sum += n->value;
+    }
+    sink = sum;
+    while (head != NULL) {
+      Node* next = head->next;
+      free(head);
+      head = next;
+    }
+  }
+  Report("list", static_cast<size_t>(rounds) * kNodes, NowSeconds() - start,
+         misses.Count() - start_misses);
+}
+
+static void BenchmarkChurn(int scale) {
+  const int kSlots = 4096;
+  const int ops = 2000000 * scale;
+  vector<void*> slots(kSlots, static_cast<void*>(NULL));
+  unsigned int rnd = 1;
+  const long long start_misses = misses.Count();
+  const double start = NowSeconds();
+  for (int i = 0; i < ops; i++) {
+    rnd = rnd * 1103515245 + 12345;
+    const int slot = (rnd >> 8) % kSlots;
+    const size_t size = 8 + ((rnd >> 20) % 249);
+    free(slots[slot]);
+    slots[slot] = malloc(size);
+    *static_cast<char*>(slots[slot]) = 0;
+  }
+  Report("churn", ops, NowSeconds() - start, misses.Count() - start_misses);
+  for (int i = 0; i < kSlots; i++) {
+    free(slots[i]);
+  }
+}
+
+static void BenchmarkCold(int scale) {
+  const int kObjects = 200;          // Fits in one thread-cache list
+  const int rounds = 1000 * scale;
+  const size_t kEvictBytes = 4 << 20;
+  char* evict = static_cast<char*>(malloc(kEvictBytes));
+  void* objects[kObjects];
+  double elapsed = 0;
+  long long miss_count = 0;
+  for (int r = 0; r < rounds; r++) {
+    for (int i = 0; i < kObjects; i++) {
+      objects[i] = malloc(64);
+    }
+    for (int i = 0; i < kObjects; i++) {
+      free(objects[i]);
+    }
+    // Walk enough memory to push the freed objects out of the caches
+    memset(evict, r, kEvictBytes);
+
+    const long long start_misses = misses.Count();
+    const double start = NowSeconds();
+    for (int i = 0; i < kObjects; i++) {
+      objects[i] = malloc(64);
+    }
+    elapsed += NowSeconds() - start;
+    miss_count += misses.Count() - start_misses;
+    for (int i = 0; i < kObjects; i++) {
+      free(objects[i]);
+    }
+  }
+  free(evict);
+  Report("cold", static_cast<size_t>(rounds) * kObjects, elapsed,
+         miss_count);
+}
+
+int main(int argc, char** argv) {
+  const int scale = (argc > 1 ? atoi(argv[1]) : 1);
+  BenchmarkList(scale);
+  BenchmarkChurn(scale);
+  BenchmarkCold(scale);
+  return 0;
+}
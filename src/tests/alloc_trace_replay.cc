@@ -0,0 +1,275 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Replays an allocation trace written by the trace recorder (see
+// google/alloc_trace.h), and reports how fast tcmalloc got through it.
+//
+// Record a trace from any program with
+//
+//   TCMALLOC_TRACE_FILE=/tmp/prog.trace LD_PRELOAD=libtcmalloc_minimal.so prog
+//
+// and replay it with
+//
+//   ./alloc_trace_replay /tmp/prog.trace [repeat]
+//
+// Each recorded thread gets a replay thread of its own, which makes
+// that thread's mallocs and frees in the recorded order, as fast as it
+// can.  A thread that frees an object another thread allocated waits
+// until that allocation has been replayed, so every replay makes the
+// same calls no matter how the threads get scheduled.  Frees of objects
+// allocated before recording started are skipped, and objects still
+// live at the end of the trace are freed before the next repetition.
+//
+// Reports throughput, malloc and free latency percentiles, and the
+// peak resident set size.  The latencies include the time to read the
+// clock, which is a few ns.
+// Not run by "make check"; build it with "make alloc_trace_replay".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+#include "alloc_trace_format.h"
+#include "base/cycleclock.h"
+
+using std::map;
+using std::sort;
+using std::vector;
+using tcmalloc::alloc_trace::Event;
+using tcmalloc::alloc_trace::FileHeader;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Returns the peak resident set size so far in MB
+static double PeakResidentMB() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss / 1024.0;      // Linux reports KB
+}
+
+// One operation of a replay thread.  Objects are numbered densely, in
+// the order the trace allocates them.
+struct Op {
+  bool   is_malloc;
+  int    object;
+  size_t size;
+};
+
+struct ReplayThread {
+  vector<Op>     ops;
+  vector<uint32> malloc_cycles;
+  vector<uint32> free_cycles;
+  pthread_t      thread;
+};
+
+static vector<ReplayThread> threads;
+static void* volatile* objects;     // indexed by object number
+static int num_objects = 0;
+static volatile bool go = false;
+
+static void* RunReplayThread(void* arg) {
+  ReplayThread* t = static_cast<ReplayThread*>(arg);
+  while (!go) sched_yield();
+  for (size_t i = 0; i < t->ops.size(); i++) {
+    const Op& op = t->ops[i];
+    if (op.is_malloc) {
+      const int64 start = CycleClock::Now();
+      char* p = static_cast<char*>(malloc(op.size));
+      const int64 end = CycleClock::Now();
+      t->malloc_cycles.push_back(static_cast<uint32>(end - start));
+      if (op.size > 0) p[0] = 0;
+      objects[op.object] = p;
+    } else {
+      void* p;
+      while ((p = objects[op.object]) == NULL) {
+        sched_yield();          // another thread has yet to allocate it
+      }
+      objects[op.object] = NULL;
+      const int64 start = CycleClock::Now();
+      free(p);
+      const int64 end = CycleClock::Now();
+      t->free_cycles.push_back(static_cast<uint32>(end - start));
+    }
+  }
+  return NULL;
+}
+
+// Splits the trace into per-thread operation lists
+static void LoadTrace(const char* filename) {
+  FILE* f = fopen(filename, "rb");
+  if (f == NULL) {
+    perror(filename);
+    exit(1);
+  }
+  vector<char> bytes;
+  char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    bytes.insert(bytes.end(), buf, buf + n);
+  }
+  fclose(f);
+  FileHeader header;
+  if (bytes.size() < sizeof(header) ||
+      (memcpy(&header, &bytes[0], sizeof(header)),
+       !tcmalloc::alloc_trace::ValidHeader(header))) {
+    fprintf(stderr, "%s: not an allocation trace\n", filename);
+    exit(1);
+  }
+
+  vector<Event> events;
+  const bool whole = tcmalloc::alloc_trace::DecodeTrace(
+      &bytes[0] + sizeof(header), &bytes[0] + bytes.size(), &events);
+  if (!whole) {
+    fprintf(stderr, "%s: ignoring a truncated block at the end\n", filename);
+  }
+
+  map<uint32, int> thread_index;       // recorded thread -> replay thread
+  map<uint64, int> live;               // address -> object number
+  size_t skipped = 0;
+  for (size_t i = 0; i < events.size(); i++) {
+    const Event& e = events[i];
+    if (thread_index.find(e.thread) == thread_index.end()) {
+      const int index = thread_index.size();
+      thread_index[e.thread] = index;
+      threads.resize(index + 1);
+    }
+    Op op;
+    op.is_malloc = (e.op == tcmalloc::alloc_trace::kMalloc);
+    op.size = e.size;
+    if (op.is_malloc) {
+      // If the address is live we missed its free; forget the old object
+      op.object = num_objects++;
+      live[e.address] = op.object;
+    } else {
+      map<uint64, int>::iterator it = live.find(e.address);
+      if (it == live.end()) {
+        skipped++;
+        continue;
+      }
+      op.object = it->second;
+      live.erase(it);
+    }
+    threads[thread_index[e.thread]].ops.push_back(op);
+  }
+  printf("trace: %lu events, %lu threads, %d objects, "
+         "%lu frees of earlier objects skipped\n",
+         static_cast<unsigned long>(events.size()),
+         static_cast<unsigned long>(threads.size()), num_objects,
+         static_cast<unsigned long>(skipped));
+}
+
+static void ReportLatency(const char* name, vector<uint32>* cycles,
+                          double ns_per_cycle) {
+  if (cycles->empty()) return;
+  sort(cycles->begin(), cycles->end());
+  static const double kPercentiles[] = { 50, 90, 99, 99.9 };
+  printf("%s latency ns:", name);
+  for (int i = 0; i < sizeof(kPercentiles) / sizeof(*kPercentiles); i++) {
+    const size_t index = static_cast<size_t>(
+        cycles->size() * kPercentiles[i] / 100);
+    printf(" p%g %.0f", kPercentiles[i],
+           (*cycles)[std::min(index, cycles->size() - 1)] * ns_per_cycle);
+  }
+  printf(" max %.0f\n", cycles->back() * ns_per_cycle);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 2) {
+    fprintf(stderr, "Usage: %s <trace file> [repeat]\n", argv[0]);
+    return 1;
+  }
+  const int repeat = (argc > 2 ? atoi(argv[2]) : 1);
+  LoadTrace(argv[1]);
+  objects = static_cast<void* volatile*>(calloc(num_objects + 1,
+                                                sizeof(void*)));
+  size_t total_ops = 0;
+  for (size_t i = 0; i < threads.size(); i++) {
+    total_ops += threads[i].ops.size();
+  }
+  vector<uint32> malloc_cycles, free_cycles;
+  const double rss_before = PeakResidentMB();
+
+  double seconds = 0;
+  int64 cycles = 0;
+  for (int r = 0; r < repeat; r++) {
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].malloc_cycles.clear();
+      threads[i].free_cycles.clear();
+      threads[i].malloc_cycles.reserve(threads[i].ops.size());
+      threads[i].free_cycles.reserve(threads[i].ops.size());
+    }
+    go = false;
+    for (size_t i = 0; i < threads.size(); i++) {
+      pthread_create(&threads[i].thread, NULL, RunReplayThread, &threads[i]);
+    }
+    const double start = NowSeconds();
+    const int64 start_cycles = CycleClock::Now();
+    go = true;
+    for (size_t i = 0; i < threads.size(); i++) {
+      pthread_join(threads[i].thread, NULL);
+    }
+    seconds += NowSeconds() - start;
+    cycles += CycleClock::Now() - start_cycles;
+
+    for (size_t i = 0; i < threads.size(); i++) {
+      malloc_cycles.insert(malloc_cycles.end(),
+                           threads[i].malloc_cycles.begin(),
+                           threads[i].malloc_cycles.end());
+      free_cycles.insert(free_cycles.end(),
+                         threads[i].free_cycles.begin(),
+                         threads[i].free_cycles.end());
+    }
+    for (int i = 0; i < num_objects; i++) {
+      free(objects[i]);
+      objects[i] = NULL;
+    }
+  }
+
+  printf("replay: %d x %lu ops in %.3f secs, %.0f ops/sec\n",
+         repeat, static_cast<unsigned long>(total_ops), seconds,
+         repeat * total_ops / seconds);
+  const double ns_per_cycle = seconds * 1e9 / cycles;
+  ReportLatency("malloc", &malloc_cycles, ns_per_cycle);
+  ReportLatency("free", &free_cycles, ns_per_cycle);
+  printf("peak RSS: %.1f MB (%.1f MB before replay)\n",
+         PeakResidentMB(), rss_before);
+  return 0;
+}
@@ -0,0 +1,231 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Records a short trace with AllocTraceStart()/AllocTraceStop() and
+// checks that reading it back gives the allocations we made, in order,
+// attributed to the threads that made them.
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>         // for mkdir()
+#include <pthread.h>
+#include <set>
+#include <vector>
+#include "base/logging.h"
+#include "alloc_trace_format.h"
+#include <google/alloc_trace.h>
+#include <google/malloc_hook.h>
+
+using std::set;
+using std::vector;
+using tcmalloc::alloc_trace::Event;
+using tcmalloc::alloc_trace::FileHeader;
+
+static int chained_news = 0;
+static void CountingNewHook(const void* ptr, size_t size) {
+  chained_news++;
+}
+
+static void* volatile other_malloc;
+static void* volatile cross_thread_free;
+
+// Allocates and frees an object of its own, and frees one the main
+// thread allocated
+static void* OtherThread(void*) {
+  other_malloc = malloc(777);
+  free(other_malloc);
+  free(cross_thread_free);
+  return NULL;
+}
+
+// Many small objects, freed soon after, so that addresses are reused
+// across threads and every thread fills several blocks
+static void* ChurnThread(void*) {
+  static const int kLive = 64;
+  void* live[kLive] = { NULL };
+  for (int i = 0; i < 20000; i++) {
+    free(live[i % kLive]);
+    live[i % kLive] = malloc(16 + i % 48);
+  }
+  for (int i = 0; i < kLive; i++) free(live[i]);
+  return NULL;
+}
+
+static void ReadTrace(const char* filename, FileHeader* header,
+                      vector<Event>* events) {
+  FILE* f = fopen(filename, "rb");
+  CHECK(f != NULL);
+  vector<char> bytes;
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    bytes.insert(bytes.end(), buf, buf + n);
+  }
+  fclose(f);
+  CHECK_GE(bytes.size(), sizeof(*header));
+  memcpy(header, &bytes[0], sizeof(*header));
+
+  // The trace must end with a whole block
+  CHECK(tcmalloc::alloc_trace::DecodeTrace(&bytes[0] + sizeof(*header),
+                                           &bytes[0] + bytes.size(), events));
+}
+
+// Returns the index of the first event at or after "start" for the
+// object at "address".  We compare addresses saved before the objects
+// were freed, since the pointers themselves may not be used after.
+static int Find(const vector<Event>& events, int start,
+                tcmalloc::alloc_trace::Op op, uintptr_t address) {
+  for (int i = start; i < events.size(); i++) {
+    if (events[i].op == op && events[i].address == address) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+int main(int argc, char** argv) {
+  char filename[1024];
+  const char* tmpdir = getenv("TMPDIR");
+  if (tmpdir == NULL)
+    tmpdir = "/tmp";
+  mkdir(tmpdir, 0755);     // if necessary
+  snprintf(filename, sizeof(filename), "%s/alloc_trace_unittest.%d",
+           tmpdir, static_cast<int>(getpid()));
+
+  MallocHook::NewHook old_hook = MallocHook::SetNewHook(&CountingNewHook);
+
+  CHECK(AllocTraceStart(filename));
+  CHECK(!AllocTraceStart(filename));     // already recording
+
+  char* small = static_cast<char*>(malloc(100));
+  const uintptr_t small_address = reinterpret_cast<uintptr_t>(small);
+  char* large = static_cast<char*>(malloc(300000));
+  const uintptr_t large_address = reinterpret_cast<uintptr_t>(large);
+  cross_thread_free = malloc(5000);
+  const uintptr_t cross_address = reinterpret_cast<uintptr_t>(
+      cross_thread_free);
+  free(small);
+  char* grown = static_cast<char*>(realloc(large, 600000));
+  const uintptr_t grown_address = reinterpret_cast<uintptr_t>(grown);
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, OtherThread, NULL) == 0);
+  CHECK(pthread_join(thread, NULL) == 0);
+  const uintptr_t other_address = reinterpret_cast<uintptr_t>(other_malloc);
+  static const int kChurnThreads = 4;
+  pthread_t churn[kChurnThreads];
+  for (int i = 0; i < kChurnThreads; i++) {
+    CHECK(pthread_create(&churn[i], NULL, ChurnThread, NULL) == 0);
+  }
+  for (int i = 0; i < kChurnThreads; i++) {
+    CHECK(pthread_join(churn[i], NULL) == 0);
+  }
+
+  AllocTraceStop();
+  AllocTraceStop();                      // harmless
+  void* untraced = malloc(12345);
+  free(grown);
+
+  // Our hook was still called, and is back in place
+  CHECK_GT(chained_news, 0);
+  CHECK(MallocHook::SetNewHook(old_hook) == &CountingNewHook);
+
+  FileHeader header;
+  vector<Event> events;
+  ReadTrace(filename, &header, &events);
+  CHECK(tcmalloc::alloc_trace::ValidHeader(header));
+  CHECK_GT(header.cycles_per_second, 0);
+
+  const int small_malloc = Find(events, 0, tcmalloc::alloc_trace::kMalloc,
+                                small_address);
+  CHECK_GE(small_malloc, 0);
+  CHECK_EQ(events[small_malloc].size, 100);
+  const uint32 main_thread = events[small_malloc].thread;
+  const int small_free = Find(events, small_malloc,
+                              tcmalloc::alloc_trace::kFree,
+                              small_address);
+  CHECK_GT(small_free, small_malloc);
+  CHECK_EQ(events[small_free].thread, main_thread);
+  CHECK_LE(events[small_malloc].cycles, events[small_free].cycles);
+
+  // realloc() shows up as a new and a delete
+  const int large_malloc = Find(events, 0, tcmalloc::alloc_trace::kMalloc,
+                                large_address);
+  CHECK_GE(large_malloc, 0);
+  CHECK_EQ(events[large_malloc].size, 300000);
+  CHECK_GT(Find(events, large_malloc, tcmalloc::alloc_trace::kFree,
+                large_address),
+           large_malloc);
+  const int grown_malloc = Find(events, large_malloc,
+                                tcmalloc::alloc_trace::kMalloc,
+                                grown_address);
+  CHECK_GT(grown_malloc, large_malloc);
+  CHECK_EQ(events[grown_malloc].size, 600000);
+  CHECK_LT(Find(events, grown_malloc, tcmalloc::alloc_trace::kFree,
+                grown_address),
+           0);                             // freed after we stopped
+
+  // The other thread's events carry its own thread number
+  const int other = Find(events, small_free, tcmalloc::alloc_trace::kMalloc,
+                         other_address);
+  CHECK_GT(other, small_free);
+  CHECK_EQ(events[other].size, 777);
+  CHECK_NE(events[other].thread, main_thread);
+  const int cross = Find(events, 0, tcmalloc::alloc_trace::kMalloc,
+                         cross_address);
+  CHECK_EQ(events[cross].thread, main_thread);
+  const int cross_free = Find(events, cross, tcmalloc::alloc_trace::kFree,
+                              cross_address);
+  CHECK_GT(cross_free, other);
+  CHECK_EQ(events[cross_free].thread, events[other].thread);
+
+  for (int i = 0; i < events.size(); i++) {
+    CHECK_NE(events[i].size, 12345);     // we had stopped by then
+  }
+
+  // Merged from all the threads' blocks, no address is handed out
+  // again before the event that freed it
+  set<uint64> live;
+  for (int i = 0; i < events.size(); i++) {
+    if (i > 0) CHECK_LT(events[i - 1].seq, events[i].seq);
+    if (events[i].op == tcmalloc::alloc_trace::kMalloc) {
+      CHECK(live.insert(events[i].address).second);
+    } else {
+      live.erase(events[i].address);
+    }
+  }
+
+  unlink(filename);
+  free(untraced);
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,113 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Measures cache conflicts between objects of one size class.
+//
+// Hash tables and similar structures often touch just the first cache
+// line of many equally-sized objects.  When the size is a multiple of
+// a large power of two, those first lines all fall into a few cache
+// sets and evict each other long before the cache is full.  We build
+// working sets of increasing size out of such objects, link their
+// first words into a random cycle, and time a walk around the cycle.
+// Run it twice to see the effect of coloring:
+//
+//   TCMALLOC_COLOR_OBJECTS=0 ./cache_color_benchmark
+//   TCMALLOC_COLOR_OBJECTS=1 ./cache_color_benchmark
+//
+// Usage: cache_color_benchmark [object size]
+// Not run by "make check"; build it with "make cache_color_benchmark".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Keeps the compiler from optimizing away the walk below
+static void* volatile sink;
+
+// Returns the mean time in ns to follow one link of a random cycle
+// through "count" objects of "size" bytes.
+static double TimeWalk(size_t size, int count) {
+  vector<void**> objects(count);
+  for (int i = 0; i < count; i++) {
+    objects[i] = static_cast<void**>(malloc(size));
+  }
+  vector<void**> order(objects);
+  std::random_shuffle(order.begin(), order.end());
+  for (int i = 0; i < count; i++) {
+    *order[i] = order[(i + 1) % count];
+  }
+
+  const long kSteps = 20 << 20;
+  void** p = order[0];
+  for (int i = 0; i < count; i++) {     // Warm up
+    p = static_cast<void**>(*p);
+  }
+  const double start = NowSeconds();
+  for (long i = 0; i < kSteps; i++) {
+    p = static_cast<void**>(*p);
+  }
+  const double elapsed = NowSeconds() - start;
+  sink = p;
+
+  for (int i = 0; i < count; i++) {
+    free(objects[i]);
+  }
+  return elapsed * 1e9 / kSteps;
+}
+
+int main(int argc, char** argv) {
+  const size_t size = (argc > 1 ? strtoul(argv[1], NULL, 10) : 512);
+  if (size < sizeof(void*)) {
+    fprintf(stderr, "object size must be at least %d\n",
+            static_cast<int>(sizeof(void*)));
+    return 1;
+  }
+  const char* env = getenv("TCMALLOC_COLOR_OBJECTS");
+  printf("object size %lu, coloring %s\n", static_cast<unsigned long>(size),
+         env != NULL && (env[0] == '1' || env[0] == 't') ? "on" : "off");
+
+  static const int kCounts[] = { 64, 128, 256, 512, 1024, 2048, 4096 };
+  for (int i = 0; i < sizeof(kCounts) / sizeof(kCounts[0]); i++) {
+    printf("%6d objects  %6.2f ns/access\n",
+           kCounts[i], TimeWalk(size, kCounts[i]));
+  }
+  return 0;
+}
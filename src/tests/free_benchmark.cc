@@ -0,0 +1,108 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Measures the cost of free() over a large heap.
+//
+// We fill a heap of the requested size with small objects of mixed
+// sizes, then time freeing all of them, first in allocation order and
+// then (after refilling) in random order.  With a heap of several GB
+// the pages being freed are spread far wider than any cache of
+// page-to-sizeclass mappings, so this mostly measures how quickly
+// free() can find the sizeclass of an arbitrary pointer.
+//
+// Usage: free_benchmark [heap size in MB] [max object size]
+// Not run by "make check"; build it with "make free_benchmark".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+
+using std::vector;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Allocates objects of random sizes in [8, max_size] until "heap_bytes"
+// bytes are in use.  Touches every object so its pages are really there.
+static void Fill(vector<void*>* objects, size_t heap_bytes, size_t max_size) {
+  objects->clear();
+  size_t total = 0;
+  while (total < heap_bytes) {
+    const size_t size = 8 + (random() % (max_size - 7));
+    char* p = static_cast<char*>(malloc(size));
+    if (p == NULL) {
+      fprintf(stderr, "out of memory after %lu bytes\n",
+              static_cast<unsigned long>(total));
+      exit(1);
+    }
+    p[0] = 1;
+    objects->push_back(p);
+    total += size;
+  }
+}
+
+static void TimeFrees(const char* label, const vector<void*>& objects) {
+  const double start = NowSeconds();
+  for (size_t i = 0; i < objects.size(); i++) {
+    free(objects[i]);
+  }
+  const double elapsed = NowSeconds() - start;
+  printf("%-12s %10lu frees  %8.2f ns/free\n", label,
+         static_cast<unsigned long>(objects.size()),
+         elapsed * 1e9 / objects.size());
+}
+
+int main(int argc, char** argv) {
+  const size_t heap_mb = (argc > 1 ? strtoul(argv[1], NULL, 10) : 2048);
+  const size_t max_size = (argc > 2 ? strtoul(argv[2], NULL, 10) : 2048);
+  if (max_size < 8) {
+    fprintf(stderr, "max object size must be at least 8\n");
+    return 1;
+  }
+  const size_t heap_bytes = heap_mb << 20;
+  printf("heap: %lu MB, object sizes 8..%lu\n",
+         static_cast<unsigned long>(heap_mb),
+         static_cast<unsigned long>(max_size));
+
+  vector<void*> objects;
+  Fill(&objects, heap_bytes, max_size);
+  TimeFrees("sequential", objects);
+
+  Fill(&objects, heap_bytes, max_size);
+  std::random_shuffle(objects.begin(), objects.end());
+  TimeFrees("random", objects);
+  return 0;
+}
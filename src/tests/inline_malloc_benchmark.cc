@@ -0,0 +1,111 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Measures the cost of a small allocation and free through malloc()
+// and free(), through operator new and delete, and through the inline
+// fast path in tcmalloc-inl.h.
+//
+// Each iteration allocates a batch of objects of one size and frees
+// them again, so everything after the first batch comes from the
+// thread cache.  We report nanoseconds per allocation and free pair.
+// The binary links tcmalloc statically, as the inline fast path
+// requires; compare with TCMALLOC_SAMPLE_PARAMETER=0 to see what the
+// sampling check costs.
+//
+// Usage: inline_malloc_benchmark [pairs per size]
+// Not run by "make check"; build it with "make inline_malloc_benchmark".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "tcmalloc-inl.h"
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static const int kBatch = 64;
+
+// Keeps the compiler from dropping allocation and free pairs
+static void* volatile sink;
+
+enum Mode { MALLOC, NEW, INLINE };
+
+static double TimePairs(Mode mode, size_t size, int pairs) {
+  void* batch[kBatch];
+  const int rounds = pairs / kBatch + 1;
+  const double start = NowSeconds();
+  for (int r = 0; r < rounds; r++) {
+    switch (mode) {
+      case MALLOC:
+        for (int i = 0; i < kBatch; i++) batch[i] = malloc(size);
+        sink = batch[r % kBatch];
+        for (int i = 0; i < kBatch; i++) free(batch[i]);
+        break;
+      case NEW:
+        for (int i = 0; i < kBatch; i++) batch[i] = new char[size];
+        sink = batch[r % kBatch];
+        for (int i = 0; i < kBatch; i++) {
+          delete[] static_cast<char*>(batch[i]);
+        }
+        break;
+      case INLINE:
+        for (int i = 0; i < kBatch; i++) {
+          batch[i] = tcmalloc::InlineMalloc(size);
+        }
+        sink = batch[r % kBatch];
+        for (int i = 0; i < kBatch; i++) tcmalloc::InlineFree(batch[i]);
+        break;
+    }
+  }
+  const double elapsed = NowSeconds() - start;
+  return elapsed * 1e9 / (static_cast<double>(rounds) * kBatch);
+}
+
+int main(int argc, char** argv) {
+  const int pairs = (argc > 1 ? atoi(argv[1]) : 10000000);
+  static const size_t kSizes[] = { 8, 16, 32, 64, 128, 256, 1024, 4096 };
+
+  printf("%6s %10s %10s %10s\n", "bytes", "malloc ns", "new ns", "inline ns");
+  for (size_t s = 0; s < sizeof(kSizes) / sizeof(*kSizes); s++) {
+    const size_t size = kSizes[s];
+    TimePairs(INLINE, size, kBatch);      // Fill the thread cache
+    printf("%6d %10.2f %10.2f %10.2f\n",
+           static_cast<int>(size),
+           TimePairs(MALLOC, size, pairs),
+           TimePairs(NEW, size, pairs),
+           TimePairs(INLINE, size, pairs));
+  }
+  return 0;
+}
@@ -0,0 +1,94 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Checks that the inline fast path in tcmalloc-inl.h keeps tcmalloc's
+// books the way malloc() and free() do.
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "base/logging.h"
+#include <google/malloc_extension.h>
+#include <google/malloc_hook.h>
+#include "tcmalloc-inl.h"
+
+static int new_hook_calls = 0;
+static int delete_hook_calls = 0;
+
+static void CountNew(const void* ptr, size_t size) {
+  new_hook_calls++;
+}
+
+static void CountDelete(const void* ptr) {
+  delete_hook_calls++;
+}
+
+int main(int argc, char** argv) {
+  MallocExtension* inst = MallocExtension::instance();
+  // Make sure this thread has a cache with objects in it
+  free(malloc(32));
+
+  // Objects move freely between the inline path and malloc()/free()
+  void* p = tcmalloc::InlineMalloc(32);
+  CHECK(p != NULL);
+  memset(p, 1, 32);
+  free(p);
+  p = malloc(32);
+  tcmalloc::InlineFree(p);
+  p = tcmalloc::InlineMalloc(1 << 20);      // Not a small object
+  CHECK(p != NULL);
+  tcmalloc::InlineFree(p);
+  tcmalloc::InlineFree(NULL);
+
+  // The per-thread counters see the inline path
+  size_t allocated_before, freed_before, allocated_after, freed_after;
+  CHECK(inst->GetThreadAllocationCounters(&allocated_before, &freed_before));
+  void* q[100];
+  for (int i = 0; i < 100; i++) q[i] = tcmalloc::InlineMalloc(64);
+  for (int i = 0; i < 100; i++) tcmalloc::InlineFree(q[i]);
+  CHECK(inst->GetThreadAllocationCounters(&allocated_after, &freed_after));
+  CHECK_EQ(allocated_after - allocated_before, 100 * 64);
+  CHECK_EQ(freed_after - freed_before, 100 * 64);
+
+  // While hooks are installed, every call reaches them
+  CHECK(MallocHook::SetNewHook(&CountNew) == NULL);
+  CHECK(MallocHook::SetDeleteHook(&CountDelete) == NULL);
+  for (int i = 0; i < 100; i++) q[i] = tcmalloc::InlineMalloc(64);
+  for (int i = 0; i < 100; i++) tcmalloc::InlineFree(q[i]);
+  CHECK(MallocHook::SetNewHook(NULL) == &CountNew);
+  CHECK(MallocHook::SetDeleteHook(NULL) == &CountDelete);
+  CHECK_EQ(new_hook_calls, 100);
+  CHECK_EQ(delete_hook_calls, 100);
+
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,130 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Measures the fragmentation left behind by objects of mixed lifetimes.
+//
+// Each round allocates a batch of short-lived objects from one call
+// site, with a few long-lived objects from another call site mixed in
+// between them, and then frees the short-lived ones.  The long-lived
+// objects stay live to the end.  The batches grow from round to round,
+// the way a program's working set grows after startup.  All objects
+// have the same size, so by default both sites share spans, and the
+// survivors end up scattered over many spans that are otherwise free
+// but cannot be given back.  At the end we release free memory and
+// compare the heap that is still in use with the bytes the survivors
+// need.
+// Compare
+//
+//   TCMALLOC_LIFETIME_SEGREGATION=0 ./lifetime_frag_benchmark
+//   TCMALLOC_LIFETIME_SEGREGATION=1 ./lifetime_frag_benchmark
+//
+// Segregation needs a few samples from each site before it kicks in;
+// TCMALLOC_SAMPLE_PARAMETER=16384 and TCMALLOC_LONG_LIVED_MS=20 make
+// it learn within the first rounds.
+//
+// Usage: lifetime_frag_benchmark [rounds] [objects per round] [size]
+// Not run by "make check"; build it with "make lifetime_frag_benchmark".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <vector>
+#include <google/malloc_extension.h>
+
+using std::vector;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+static double PropertyMB(const char* name) {
+  size_t value = 0;
+  MallocExtension::instance()->GetNumericProperty(name, &value);
+  return value / 1048576.0;
+}
+
+// One long-lived object for every this many short-lived ones
+static const int kShortPerLong = 32;
+
+int main(int argc, char** argv) {
+  const int rounds = (argc > 1 ? atoi(argv[1]) : 50);
+  const int per_round = (argc > 2 ? atoi(argv[2]) : 262144);
+  const size_t size = (argc > 3 ? strtoul(argv[3], NULL, 10) : 64);
+  const char* env = getenv("TCMALLOC_LIFETIME_SEGREGATION");
+  printf("%d rounds of up to %d objects of %lu bytes,"
+         " lifetime segregation %s\n",
+         rounds, per_round, static_cast<unsigned long>(size),
+         env != NULL && (env[0] == '1' || env[0] == 't') ? "on" : "off");
+
+  vector<void*> survivors;
+  vector<void*> batch(per_round);
+  const double start = NowSeconds();
+  for (int r = 0; r < rounds; r++) {
+    const int n = static_cast<int>(
+        static_cast<long long>(per_round) * (r + 1) / rounds);
+    for (int i = 0; i < n; i++) {
+      batch[i] = malloc(size);                  // Short-lived site
+      memset(batch[i], 1, size);
+      if (i % kShortPerLong == 0) {
+        void* p = malloc(size);                 // Long-lived site
+        memset(p, 2, size);
+        survivors.push_back(p);
+      }
+    }
+    for (int i = 0; i < n; i++) {
+      free(batch[i]);
+    }
+    // Give the survivors time to count as long-lived
+    usleep(10000);
+  }
+  const double elapsed = NowSeconds() - start;
+
+  MallocExtension::instance()->ReleaseFreeMemory();
+  const double live_mb = survivors.size() * size / 1048576.0;
+  // Everything outside the page heap: spans of small objects, and
+  // whatever else the application holds
+  const double in_use_mb = PropertyMB("generic.heap_size")
+                           - PropertyMB("tcmalloc.slack_bytes");
+  printf("%10s %10s %10s %12s %8s\n",
+         "secs", "live MB", "in use MB", "allocated MB", "ratio");
+  printf("%10.2f %10.2f %10.2f %12.2f %8.2f\n",
+         elapsed, live_mb, in_use_mb,
+         PropertyMB("generic.current_allocated_bytes"),
+         in_use_mb / live_mb);
+
+  for (size_t i = 0; i < survivors.size(); i++) free(survivors[i]);
+  return 0;
+}
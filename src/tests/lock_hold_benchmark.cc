@@ -0,0 +1,135 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Reports how long tcmalloc's process-wide locks are held under a mix
+// of work that used to serialize on the page heap lock.
+//
+// Worker threads allocate and free page-level blocks, so they go
+// through the page heap.  At the same time one thread keeps creating
+// and joining short-lived threads, whose caches come and go, and
+// another keeps asking for the heap growth stacks, as a heap profiler
+// polling in the background would.  At the end we print the lock hold
+// histograms from MallocExtension::GetStats().  Run it as
+//
+//   TCMALLOC_LOCK_HOLD_HISTOGRAM=1 ./lock_hold_benchmark [seconds]
+//
+// Not run by "make check"; build it with "make lock_hold_benchmark".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_STDINT_H
+#include <stdint.h>           // for uintptr_t
+#endif
+#include <unistd.h>           // for usleep()
+#include <pthread.h>
+#include <sys/time.h>
+#include <string>
+#include <google/malloc_extension.h>
+
+static const int kWorkers = 4;
+static volatile bool done = false;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Allocates and frees blocks of 40K to 2M, keeping up to 64 live
+static void* PageHeapWorker(void* arg) {
+  static const int kSlots = 64;
+  void* slots[kSlots] = { NULL };
+  unsigned int rnd = static_cast<unsigned int>(
+      reinterpret_cast<uintptr_t>(arg)) + 1;
+  while (!done) {
+    rnd = rnd * 1103515245 + 12345;
+    const int slot = (rnd >> 8) % kSlots;
+    free(slots[slot]);
+    slots[slot] = malloc(40000 + (rnd >> 12) % 2000000);
+  }
+  for (int i = 0; i < kSlots; i++) free(slots[i]);
+  return NULL;
+}
+
+static void* ShortLived(void*) {
+  free(malloc(100));
+  return NULL;
+}
+
+static void* ThreadChurn(void*) {
+  while (!done) {
+    pthread_t t;
+    if (pthread_create(&t, NULL, ShortLived, NULL) == 0) {
+      pthread_join(t, NULL);
+    }
+  }
+  return NULL;
+}
+
+static void* GrowthStackReader(void*) {
+  while (!done) {
+    std::string stacks;
+    MallocExtension::instance()->GetHeapGrowthStacks(&stacks);
+  }
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  const double seconds = (argc > 1 ? atof(argv[1]) : 5);
+
+  pthread_t threads[kWorkers + 2];
+  for (int i = 0; i < kWorkers; i++) {
+    pthread_create(&threads[i], NULL, PageHeapWorker,
+                   reinterpret_cast<void*>(static_cast<uintptr_t>(i)));
+  }
+  pthread_create(&threads[kWorkers], NULL, ThreadChurn, NULL);
+  pthread_create(&threads[kWorkers + 1], NULL, GrowthStackReader, NULL);
+
+  const double start = NowSeconds();
+  while (NowSeconds() - start < seconds) usleep(100000);
+  done = true;
+  for (int i = 0; i < kWorkers + 2; i++) pthread_join(threads[i], NULL);
+
+  static const int kBufferSize = 1 << 20;
+  char* buffer = new char[kBufferSize];
+  MallocExtension::instance()->GetStats(buffer, kBufferSize);
+  const char* histograms = strstr(buffer, "Page heap lock held");
+  if (histograms == NULL) {
+    printf("no lock hold histograms: set TCMALLOC_LOCK_HOLD_HISTOGRAM=1\n");
+  } else {
+    const char* end = strstr(histograms, "------");
+    fwrite(histograms, 1,
+           end != NULL ? end - histograms : strlen(histograms), stdout);
+  }
+  delete[] buffer;
+  return 0;
+}
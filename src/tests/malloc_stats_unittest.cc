@@ -0,0 +1,163 @@
+// Copyright (c) 2003, Google Inc.
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+// 
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// Checks that the numbers reported by MallocExtension stay consistent
+// while another thread keeps the page heap busy.  The stats readers
+// do not take the page heap lock, so they see the counters as they
+// change.  Also checks the live size histograms of MallocMemoryStats().
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>           // for sleep()
+#include <pthread.h>
+#include "base/logging.h"
+#include <google/malloc_extension.h>
+
+static volatile bool done = false;
+
+// Allocates and frees spans of assorted sizes, so that the page heap
+// keeps splitting and coalescing them
+static void* PageHeapChurn(void*) {
+  static const int kSlots = 64;
+  void* slots[kSlots] = { NULL };
+  unsigned int rnd = 1;
+  while (!done) {
+    rnd = rnd * 1103515245 + 12345;
+    const int slot = (rnd >> 8) % kSlots;
+    free(slots[slot]);
+    slots[slot] = malloc(40000 + (rnd >> 12) % 3000000);
+  }
+  for (int i = 0; i < kSlots; i++) {
+    free(slots[i]);
+  }
+  return NULL;
+}
+
+static size_t GetProperty(const char* name) {
+  size_t result;
+  CHECK(MallocExtension::instance()->GetNumericProperty(name, &result));
+  return result;
+}
+
+struct SizeStats {
+  int blocks;
+  size_t total;
+  int histogram[kMallocHistogramSize];
+  int fine[kMallocFineHistogramSize];
+};
+
+static void GetSizeStats(SizeStats* s) {
+  int fine_blocks;
+  size_t fine_total;
+  CHECK(MallocExtension::instance()->MallocMemoryStats(
+            &s->blocks, &s->total, s->histogram));
+  CHECK(MallocExtension::instance()->MallocMemoryStatsFine(
+            &fine_blocks, &fine_total, s->fine));
+  // Nothing was allocated in between
+  CHECK_EQ(s->blocks, fine_blocks);
+  CHECK_EQ(s->total, fine_total);
+  for (int i = 0; i < kMallocHistogramSize; i++) {
+    int sum = 0;
+    for (int j = 0; j < kMallocFineHistogramSubBuckets; j++) {
+      sum += s->fine[i * kMallocFineHistogramSubBuckets + j];
+    }
+    CHECK_EQ(s->histogram[i], sum);
+  }
+}
+
+// Allocates a known number of blocks of a few sizes, and checks that
+// they show up in the right buckets
+static void TestSizeHistogram() {
+  static const int kSmall = 5000;
+  static const int kLarge = 20;
+  static void* small[kSmall];
+  static void* large[kLarge];
+
+  SizeStats before, after;
+  GetSizeStats(&before);
+  for (int i = 0; i < kSmall; i++) small[i] = malloc(1000);   // Class of 1024
+  for (int i = 0; i < kLarge; i++) large[i] = malloc(7 << 20);  // 7MB
+  GetSizeStats(&after);
+
+  // 1024 = 2^10 is at the start of its bucket; 7MB = 2^22 * 1.75 is in
+  // the last quarter of its bucket
+  CHECK_GE(after.histogram[10] - before.histogram[10], kSmall);
+  CHECK_GE(after.fine[10 * kMallocFineHistogramSubBuckets] -
+           before.fine[10 * kMallocFineHistogramSubBuckets], kSmall);
+  CHECK_EQ(after.histogram[22] - before.histogram[22], kLarge);
+  CHECK_EQ(after.fine[22 * kMallocFineHistogramSubBuckets + 3] -
+           before.fine[22 * kMallocFineHistogramSubBuckets + 3], kLarge);
+  CHECK_GE(after.blocks - before.blocks, kSmall + kLarge);
+  CHECK_GE(after.total - before.total,
+           kSmall * 1024 + kLarge * static_cast<size_t>(7 << 20));
+
+  for (int i = 0; i < kSmall; i++) free(small[i]);
+  for (int i = 0; i < kLarge; i++) free(large[i]);
+  GetSizeStats(&after);
+  CHECK_EQ(after.histogram[22], before.histogram[22]);
+}
+
+int main(int argc, char** argv) {
+  TestSizeHistogram();
+
+  pthread_t churner;
+  CHECK(pthread_create(&churner, NULL, PageHeapChurn, NULL) == 0);
+
+  const int kBufferSize = 64 << 10;
+  char* buffer = static_cast<char*>(malloc(kBufferSize));
+  for (int i = 0; i < 2000; i++) {
+    const size_t heap = GetProperty("generic.heap_size");
+    const size_t allocated = GetProperty("generic.current_allocated_bytes");
+    const size_t slack = GetProperty("tcmalloc.slack_bytes");
+    const size_t later_heap = GetProperty("generic.heap_size");
+    // The heap never shrinks, and each reading is of a consistent
+    // snapshot, so none of these can be out of whack
+    CHECK_LE(heap, later_heap);
+    CHECK_LE(allocated, later_heap);
+    CHECK_LE(slack, later_heap);
+
+    if (i % 100 == 0) {
+      MallocExtension::instance()->GetStats(buffer, kBufferSize);
+      CHECK(strstr(buffer, "PageHeap:") != NULL);
+      CHECK(strstr(buffer, "Heap size") != NULL);
+      CHECK(strstr(buffer, "% thrash") != NULL);
+    }
+  }
+
+  done = true;
+  CHECK(pthread_join(churner, NULL) == 0);
+  free(buffer);
+
+  printf("PASS\n");
+  return 0;
+}
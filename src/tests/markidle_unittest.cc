@@ -33,6 +33,11 @@
 // MallocExtension::MarkThreadIdle() testing
 
 #include "config_for_unittests.h"
+#include <stdlib.h>           // for getenv()
+#include <unistd.h>           // for sleep()
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "base/logging.h"
 #include <google/malloc_extension.h>
 #include "tests/testutil.h"   // for RunThread()
@@ -96,11 +101,67 @@ static void TestIdleUsage() {
   VLOG(0, "Post idle: %"PRIuS"\n", post_idle);
 }
 
+static size_t GetReclaimedBytes() {
+  size_t result;
+  CHECK(MallocExtension::instance()->GetNumericProperty(
+            "tcmalloc.idle_thread_cache_reclaimed_bytes",
+            &result));
+  return result;
+}
+
+#ifdef HAVE_PTHREAD
+// Shared between the two threads of TestIdleReclaim()
+static volatile bool idler_parked = false;
+static volatile bool idler_release = false;
+
+// Fills its cache and then goes quiet until released.  Then allocates
+// again, to make sure that its cache still works after being drained.
+static void* IdleThread(void*) {
+  TestAllocation();
+  idler_parked = true;
+  while (!idler_release) sleep(1);
+  TestAllocation();
+  return NULL;
+}
+
+// Check that the cache of a thread that stops allocating is drained
+// by another thread that keeps allocating.  testutil's RunManyThreads()
+// may run its functions one after another, so use pthreads directly.
+static void TestIdleReclaim() {
+  pthread_t idler;
+  CHECK(pthread_create(&idler, NULL, IdleThread, NULL) == 0);
+  while (!idler_parked) sleep(1);
+
+  const size_t original = GetReclaimedBytes();
+  size_t reclaimed = original;
+  // Sweeps are at least $TCMALLOC_IDLE_THREAD_CACHE_MS apart (1s when
+  // run from idle_reclaim_unittest.sh), and it takes two sweeps to find an idle thread.
+  for (int round = 0; round < 10 && reclaimed == original; round++) {
+    static const int kNum = 20000;
+    static void* ptr[kNum];
+    for (int i = 0; i < kNum; i++) ptr[i] = malloc(64);
+    for (int i = 0; i < kNum; i++) free(ptr[i]);
+    sleep(1);
+    reclaimed = GetReclaimedBytes();
+  }
+  idler_release = true;
+  CHECK(pthread_join(idler, NULL) == 0);
+  CHECK_GT(reclaimed, original);
+  VLOG(0, "Reclaimed from idle thread: %"PRIuS"\n", reclaimed - original);
+}
+#endif  // HAVE_PTHREAD
+
 int main(int argc, char** argv) {
   RunThread(&TestIdleUsage);
   RunThread(&TestAllocation);
   RunThread(&MultipleIdleCalls);
   RunThread(&MultipleIdleNonIdlePhases);
+#ifdef HAVE_PTHREAD
+  // Idle caches are only reclaimed if this is set at startup;
+  // idle_reclaim_unittest.sh runs us that way.
+  const char* interval = getenv("TCMALLOC_IDLE_THREAD_CACHE_MS");
+  if (interval != NULL && atoi(interval) > 0) TestIdleReclaim();
+#endif
 
   printf("PASS\n");
   return 0;
@@ -0,0 +1,122 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+// ---
+// MallocExtension::AddMemoryPressureCallback() testing
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "base/logging.h"
+#include <google/malloc_extension.h>
+
+static int calls = 0;
+static MallocExtension::MemoryPressureInfo last_info;
+
+// Keeps the compiler from dropping malloc()/free() pairs whose result
+// is otherwise unused
+static void* volatile sink;
+
+static void CountCall(const MallocExtension::MemoryPressureInfo* info,
+                      void* arg) {
+  calls++;
+  last_info = *info;
+  // Callbacks may allocate; doing so must not call us again
+  sink = malloc(*static_cast<size_t*>(arg));
+  CHECK(sink != NULL);
+  free(sink);
+}
+
+int main(int argc, char** argv) {
+  MallocExtension* inst = MallocExtension::instance();
+  size_t heap_size;
+  CHECK(inst->GetNumericProperty("generic.heap_size", &heap_size));
+
+  // Growing the heap past the limit calls us once...
+  size_t callback_alloc = 8 << 20;
+  CHECK(inst->AddMemoryPressureCallback(&CountCall, &callback_alloc,
+                                        heap_size + (4 << 20), 0, 0));
+  sink = malloc(16 << 20);
+  void* big = sink;
+  CHECK_EQ(calls, 1);
+  CHECK_GT(last_info.heap_bytes, heap_size + (4 << 20));
+
+  // ... and growing it further straight away does not, since a second
+  // has not passed
+  sink = malloc(16 << 20);
+  void* bigger = sink;
+  CHECK_EQ(calls, 1);
+  free(bigger);
+  free(big);
+
+  // Nor does anything once we are gone
+  CHECK(inst->RemoveMemoryPressureCallback(&CountCall, &callback_alloc));
+  CHECK(!inst->RemoveMemoryPressureCallback(&CountCall, &callback_alloc));
+  sink = malloc(48 << 20);
+  free(sink);
+  CHECK_EQ(calls, 1);
+
+  // An RSS limit the process is already over fires on the next check,
+  // which returning memory to the system makes
+  callback_alloc = 100;
+  CHECK(inst->AddMemoryPressureCallback(&CountCall, &callback_alloc,
+                                        0, 1, 0));
+  inst->ReleaseFreeMemory();
+  CHECK(inst->RemoveMemoryPressureCallback(&CountCall, &callback_alloc));
+#ifdef __linux
+  CHECK_EQ(calls, 2);
+  CHECK_GT(last_info.rss_bytes, 0);
+#endif
+
+  // Huge objects are mapped straight from the system, bypassing the
+  // page heap's free lists; mapping one past the limit is checked too
+  const int before_direct = calls;
+  CHECK(inst->GetNumericProperty("generic.heap_size", &heap_size));
+  CHECK(inst->AddMemoryPressureCallback(&CountCall, &callback_alloc,
+                                        heap_size + (4 << 20), 0, 0));
+  sink = malloc(96 << 20);
+  void* huge = sink;
+  CHECK(huge != NULL);
+  CHECK_EQ(calls, before_direct + 1);
+  CHECK_GT(last_info.heap_bytes, heap_size + (4 << 20));
+  CHECK(inst->RemoveMemoryPressureCallback(&CountCall, &callback_alloc));
+
+  // ... and so is unmapping it
+  CHECK(inst->AddMemoryPressureCallback(&CountCall, &callback_alloc,
+                                        1, 0, 0));
+  free(huge);
+  CHECK_EQ(calls, before_direct + 2);
+  CHECK_LT(last_info.heap_bytes, heap_size + (4 << 20));
+  CHECK(inst->RemoveMemoryPressureCallback(&CountCall, &callback_alloc));
+
+  printf("PASS\n");
+  return 0;
+}
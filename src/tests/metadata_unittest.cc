@@ -0,0 +1,115 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Checks that metadata freed by one kind of object (spans) can be
+// reused by another (thread caches), instead of staying with the
+// allocator that first asked the system for it.
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <vector>
+#include "base/logging.h"
+#include <google/malloc_extension.h>
+
+using std::vector;
+
+static size_t Property(const char* name) {
+  size_t value;
+  CHECK(MallocExtension::instance()->GetNumericProperty(name, &value));
+  return value;
+}
+
+// Threads allocate, so that they get a thread cache, and then wait
+// until they are all running before they exit.  There are more of
+// them than fit in one chunk of thread caches.
+static const int kThreads = 200;
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static int started = 0;
+
+// Keeps the compiler from dropping malloc()/free() pairs whose result
+// is otherwise unused
+static void* volatile sink;
+
+static void* WaitForOthers(void*) {
+  sink = malloc(16);
+  free(sink);
+  pthread_mutex_lock(&mutex);
+  started++;
+  pthread_cond_broadcast(&cond);
+  while (started < kThreads) pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+  return NULL;
+}
+
+int main(int argc, char** argv) {
+  // Carve all the spans below out of one free span, so that when they
+  // are freed they coalesce back into it and hardly any descriptors
+  // survive.  The block stays below the direct-mapping threshold.
+  sink = malloc(48 << 20);
+  free(sink);
+
+  // Objects of this size get a one-page span each
+  static const int kSpans = 8000;
+  static const size_t kSize = 4096;
+  vector<void*> blocks(kSpans);
+  for (int i = 0; i < kSpans; i++) {
+    blocks[i] = malloc(kSize);
+    CHECK(blocks[i] != NULL);
+  }
+  for (int i = 0; i < kSpans; i++) free(blocks[i]);
+  // Hand our cached objects back, so their spans can go back too
+  MallocExtension::instance()->MarkThreadIdle();
+
+  const size_t metadata = Property("tcmalloc.metadata_bytes");
+  const size_t free_metadata = Property("tcmalloc.free_metadata_bytes");
+  printf("metadata: %d bytes, %d bytes of it free\n",
+         static_cast<int>(metadata), static_cast<int>(free_metadata));
+  CHECK_GT(free_metadata, 0);
+  CHECK_LE(free_metadata, metadata);
+
+  // Thread caches now come out of the chunks the spans gave back
+  pthread_t threads[kThreads];
+  for (int i = 0; i < kThreads; i++) {
+    CHECK(pthread_create(&threads[i], NULL, WaitForOthers, NULL) == 0);
+  }
+  for (int i = 0; i < kThreads; i++) pthread_join(threads[i], NULL);
+
+  printf("after %d threads: %d bytes, %d bytes of it free\n", kThreads,
+         static_cast<int>(Property("tcmalloc.metadata_bytes")),
+         static_cast<int>(Property("tcmalloc.free_metadata_bytes")));
+  CHECK_EQ(Property("tcmalloc.metadata_bytes"), metadata);
+  CHECK_LT(Property("tcmalloc.free_metadata_bytes"), free_metadata);
+
+  printf("PASS\n");
+  return 0;
+}
@@ -0,0 +1,178 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Tracks resident memory over the life of a heap that grows, shrinks
+// and then churns at a steady size.
+//
+// We allocate objects of mixed sizes (most of them served directly as
+// spans by the page heap) up to a peak, shrink the live set by
+// freeing objects at random, and then keep replacing random objects
+// while holding the live set constant.  Memory only goes back to the
+// system through the incremental scavenger, so RSS falls faster when
+// live objects gather in part of the heap and the rest coalesces into
+// large spans.
+// Compare the page heap's span policies with
+//
+//   TCMALLOC_ADDRESS_ORDERED_SPANS=0 ./rss_benchmark
+//   TCMALLOC_ADDRESS_ORDERED_SPANS=1 ./rss_benchmark
+//
+// The scavenger is slow at the default TCMALLOC_RELEASE_RATE; setting
+// it to 10 makes the difference in RSS show up sooner.
+//
+// Usage: rss_benchmark [peak MB] [steady MB] [churn operations]
+// Not run by "make check"; build it with "make rss_benchmark".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <vector>
+#include <google/malloc_extension.h>
+
+using std::vector;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Returns the resident set size in MB, or -1 if we cannot tell
+static double ResidentMB() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return -1;
+  long size, resident;
+  const int n = fscanf(f, "%ld %ld", &size, &resident);
+  fclose(f);
+  if (n != 2) return -1;
+  return resident * (getpagesize() / 1048576.0);
+}
+
+static double HeapMB() {
+  size_t value = 0;
+  MallocExtension::instance()->GetNumericProperty("generic.heap_size",
+                                                  &value);
+  return value / 1048576.0;
+}
+
+struct Object {
+  char*  ptr;
+  size_t size;
+};
+
+class Workload {
+ public:
+  Workload() : live_bytes_(0), ops_(0), rnd_(1), start_(NowSeconds()) {
+    printf("%10s %8s %10s %10s %10s\n",
+           "ops", "secs", "live MB", "heap MB", "RSS MB");
+  }
+
+  // Object sizes from 1KB to 128KB, skewed toward the small end
+  size_t RandomSize() {
+    const int lg = 10 + Random() % 8;
+    return (static_cast<size_t>(1) << lg) + Random() % (1 << lg);
+  }
+
+  void Allocate() {
+    Object o;
+    o.size = RandomSize();
+    o.ptr = static_cast<char*>(malloc(o.size));
+    memset(o.ptr, 1, o.size);
+    objects_.push_back(o);
+    live_bytes_ += o.size;
+    Tick();
+  }
+
+  void FreeRandom() {
+    const size_t i = Random() % objects_.size();
+    free(objects_[i].ptr);
+    live_bytes_ -= objects_[i].size;
+    objects_[i] = objects_.back();
+    objects_.pop_back();
+    Tick();
+  }
+
+  size_t live_bytes() const { return live_bytes_; }
+
+  void Report() {
+    printf("%10lu %8.1f %10.1f %10.1f %10.1f\n",
+           static_cast<unsigned long>(ops_), NowSeconds() - start_,
+           live_bytes_ / 1048576.0, HeapMB(), ResidentMB());
+    fflush(stdout);
+  }
+
+ private:
+  vector<Object> objects_;
+  size_t         live_bytes_;
+  size_t         ops_;
+  unsigned int   rnd_;
+  double         start_;
+
+  unsigned int Random() {
+    rnd_ = rnd_ * 1103515245 + 12345;
+    return rnd_ >> 8;
+  }
+
+  void Tick() {
+    if (++ops_ % 100000 == 0) Report();
+  }
+};
+
+int main(int argc, char** argv) {
+  const size_t peak_mb = (argc > 1 ? strtoul(argv[1], NULL, 10) : 512);
+  const size_t steady_mb = (argc > 2 ? strtoul(argv[2], NULL, 10) : 128);
+  const size_t churn_ops = (argc > 3 ? strtoul(argv[3], NULL, 10) : 6000000);
+  const char* env = getenv("TCMALLOC_ADDRESS_ORDERED_SPANS");
+  printf("peak %lu MB, steady %lu MB, %lu churn ops, %s spans\n",
+         static_cast<unsigned long>(peak_mb),
+         static_cast<unsigned long>(steady_mb),
+         static_cast<unsigned long>(churn_ops),
+         env != NULL && (env[0] == '1' || env[0] == 't')
+         ? "address-ordered" : "LIFO");
+
+  Workload w;
+  while (w.live_bytes() < (peak_mb << 20)) {
+    w.Allocate();
+  }
+  while (w.live_bytes() > (steady_mb << 20)) {
+    w.FreeRandom();
+  }
+  for (size_t i = 0; i < churn_ops; i++) {
+    if (w.live_bytes() < (steady_mb << 20)) {
+      w.Allocate();
+    } else {
+      w.FreeRandom();
+    }
+  }
+  w.Report();
+  return 0;
+}
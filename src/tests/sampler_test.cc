@@ -0,0 +1,181 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Checks the allocation sampler through the MallocExtension interface:
+//  - the sampling period can be read and changed at runtime;
+//  - heap samples, scaled up the way pprof does for "heap_v2"
+//    profiles, give unbiased estimates of the live bytes for both
+//    small and large objects;
+//  - sampled small objects keep their size-class rather than taking
+//    a page each;
+//  - freeing a sampled object removes it from the heap sample.
+
+#include "config_for_unittests.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "base/logging.h"
+#include <google/malloc_extension.h>
+
+using std::string;
+using std::vector;
+
+static const char kPeriodProperty[] = "tcmalloc.sampling_period_bytes";
+
+static size_t GetProperty(const char* name) {
+  size_t value;
+  CHECK(MallocExtension::instance()->GetNumericProperty(name, &value));
+  return value;
+}
+
+// Parses a heap sample and returns the number of live bytes it
+// represents, undoing the sampling like pprof does.  Also returns the
+// number of sampled objects in *samples.  If "size" is non-zero, only
+// looks at stacks whose objects are all "size" bytes long, which
+// leaves out whatever the test harness itself (and GetHeapSample)
+// has allocated.
+static double EstimateLiveBytes(const string& sample, size_t size,
+                                size_t* samples) {
+  const char* p = sample.c_str();
+  int period = 0;
+  const char* header = strstr(p, "@ heap_v2/");
+  CHECK(header != NULL);
+  CHECK_EQ(sscanf(header, "@ heap_v2/%d", &period), 1);
+
+  *samples = 0;
+  double estimate = 0;
+  for (p = strchr(p, '\n'); p != NULL; p = strchr(p, '\n')) {
+    p++;
+    unsigned long count, bytes;
+    if (sscanf(p, "%lu: %lu [", &count, &bytes) != 2 || count == 0) {
+      continue;
+    }
+    if (size != 0 && bytes != count * size) {
+      continue;
+    }
+    *samples += count;
+    double scale = 1;
+    if (period > 0) {
+      const double ratio = (static_cast<double>(bytes) / count) / period;
+      scale = 1 / (1 - exp(-ratio));
+    }
+    estimate += bytes * scale;
+  }
+  return estimate;
+}
+
+// Allocates "total" bytes in objects of "size" bytes and checks that
+// the heap sample estimates their total to within "tolerance".
+static void TestEstimate(size_t size, size_t total, double tolerance) {
+  const size_t n = total / size;
+  vector<void*> objects(n);
+  for (size_t i = 0; i < n; i++) {
+    objects[i] = malloc(size);
+    CHECK(objects[i] != NULL);
+  }
+
+  string after;
+  MallocExtension::instance()->GetHeapSample(&after);
+  size_t samples;
+  const double estimate = EstimateLiveBytes(after, size, &samples);
+  const double actual = static_cast<double>(n * size);
+  const double error = fabs(estimate - actual) / actual;
+  printf("size %6d: %6d samples, estimated %10.0f of %10.0f bytes "
+         "(%.1f%% off)\n",
+         static_cast<int>(size), static_cast<int>(samples),
+         estimate, actual, error * 100);
+  CHECK_LT(error, tolerance);
+
+  for (size_t i = 0; i < n; i++) {
+    free(objects[i]);
+  }
+}
+
+// With a period of one byte every allocation is sampled.  Under the
+// old scheme each sampled object took a whole page.
+static void TestSmallObjectsKeepSizeClass() {
+  static const int kObjects = 10000;
+  static const size_t kSize = 32;
+  vector<void*> objects(kObjects);
+
+  const size_t heap_before = GetProperty("generic.heap_size");
+  CHECK(MallocExtension::instance()->SetNumericProperty(kPeriodProperty, 1));
+  for (int i = 0; i < kObjects; i++) {
+    objects[i] = malloc(kSize);
+    CHECK(objects[i] != NULL);
+  }
+  const size_t heap_after = GetProperty("generic.heap_size");
+
+  string sample;
+  MallocExtension::instance()->GetHeapSample(&sample);
+  size_t samples;
+  EstimateLiveBytes(sample, kSize, &samples);
+  // Allow for the thread's sampling point from before the change
+  CHECK_GE(samples, static_cast<size_t>(kObjects * 9 / 10));
+
+  // A page per object would be kObjects * 4K = 40MB
+  CHECK_LT(heap_after - heap_before, static_cast<size_t>(4 << 20));
+
+  for (int i = 0; i < kObjects; i++) {
+    free(objects[i]);
+  }
+
+  // Nothing we allocated above should be left in the sample
+  sample.clear();
+  MallocExtension::instance()->GetHeapSample(&sample);
+  size_t samples_after_free;
+  EstimateLiveBytes(sample, kSize, &samples_after_free);
+  CHECK_LT(samples_after_free, static_cast<size_t>(kObjects / 100));
+}
+
+int main(int argc, char** argv) {
+  const size_t default_period = GetProperty(kPeriodProperty);
+  CHECK_GT(default_period, 0);
+
+  CHECK(MallocExtension::instance()->SetNumericProperty(kPeriodProperty,
+                                                        4096));
+  CHECK_EQ(GetProperty(kPeriodProperty), 4096);
+
+  TestEstimate(8, 16 << 20, 0.1);
+  TestEstimate(100, 16 << 20, 0.1);
+  TestEstimate(1000, 16 << 20, 0.1);
+  TestEstimate(6000, 32 << 20, 0.1);
+  TestEstimate(100000, 64 << 20, 0.1);
+
+  TestSmallObjectsKeepSizeClass();
+
+  CHECK(MallocExtension::instance()->SetNumericProperty(kPeriodProperty,
+                                                        default_period));
+  printf("PASS\n");
+  return 0;
+}
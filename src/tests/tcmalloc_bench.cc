@@ -0,0 +1,371 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Multi-threaded allocator benchmarks, for tracking tcmalloc's speed
+// and memory use from one version to the next.
+//
+//   churn:      replace random members of a working set of objects of
+//               one size (run for a range of sizes)
+//   prodcons:   each thread allocates batches of objects that the next
+//               thread frees
+//   realloc:    grow objects by doubling from 16 bytes to 64KB
+//   large:      replace random members of a small set of 256KB-4MB
+//               objects
+//   memalign:   churn with alignments from 16 to 4096 bytes
+//   threads:    start threads that allocate a little and exit
+//
+// Every scenario runs once per thread count.  Each thread makes the
+// same number of operations, so with more threads there is more work.
+// One operation is a free()+malloc() pair for the churn scenarios, a
+// malloc() or a free() for prodcons, a realloc() for realloc, and a
+// whole thread for threads.  One in every kSampleEvery operations is
+// timed with CycleClock for the latency percentiles, which therefore
+// include the few ns it takes to read the clock.
+//
+// The output is one tab-separated line per run, after a "#" line with
+// the version and a header naming the columns:
+//
+//   scenario size threads ops secs ops_per_sec p50_ns p99_ns rss_mb
+//
+// rss_mb is the resident set size after the run; the memory the
+// scenario freed is only returned to the system by the scavenger.
+//
+// Usage: tcmalloc_bench [--threads=1,2,4,8] [--scale=N] [scenario...]
+// Not run by "make check"; build it with "make tcmalloc_bench".
+
+#include "config_for_unittests.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <vector>
+#include "base/cycleclock.h"
+
+using std::sort;
+using std::vector;
+
+static const int kSampleEvery = 16;
+
+static double NowSeconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
+
+// Returns the resident set size in MB, or -1 if we cannot tell
+static double ResidentMB() {
+  FILE* f = fopen("/proc/self/statm", "r");
+  if (f == NULL) return -1;
+  long size, resident;
+  const int n = fscanf(f, "%ld %ld", &size, &resident);
+  fclose(f);
+  if (n != 2) return -1;
+  return resident * (getpagesize() / 1048576.0);
+}
+
+// What one benchmark thread is asked to do, and what it measured
+struct Worker {
+  void           (*run)(Worker* w);
+  int            index;
+  int            num_threads;
+  size_t         size;
+  size_t         ops;
+  unsigned int   rnd;
+  vector<uint32> samples;       // cycles taken by the timed operations
+  pthread_t      thread;
+
+  unsigned int Random() {
+    rnd = rnd * 1103515245 + 12345;
+    return rnd >> 8;
+  }
+};
+
+// Times "expr" if operation "i" is one of the sampled ones
+#define TIMED(w, i, expr) do {                                    \
+    if ((i) % kSampleEvery == 0) {                                \
+      const int64 start = CycleClock::Now();                      \
+      expr;                                                       \
+      (w)->samples.push_back(                                     \
+          static_cast<uint32>(CycleClock::Now() - start));        \
+    } else {                                                      \
+      expr;                                                       \
+    }                                                             \
+  } while (0)
+
+static void Churn(Worker* w) {
+  const int kSlots = 1024;
+  vector<void*> slots(kSlots, static_cast<void*>(NULL));
+  for (size_t i = 0; i < w->ops; i++) {
+    const int slot = w->Random() % kSlots;
+    TIMED(w, i, free(slots[slot]); slots[slot] = malloc(w->size));
+    *static_cast<char*>(slots[slot]) = 0;
+  }
+  for (int i = 0; i < kSlots; i++) {
+    free(slots[i]);
+  }
+}
+
+// Each thread hands its batches to the next one through a queue
+struct BatchQueue {
+  pthread_mutex_t lock;
+  vector<void**>  batches;
+};
+static const int kBatchSize = 32;
+static vector<BatchQueue> queues;
+
+static void ProducerConsumer(Worker* w) {
+  BatchQueue* inbox = &queues[w->index];
+  BatchQueue* outbox = &queues[(w->index + 1) % w->num_threads];
+  size_t i = 0;
+  while (i < w->ops) {
+    void** batch = static_cast<void**>(malloc(kBatchSize * sizeof(void*)));
+    for (int j = 0; j < kBatchSize; j++, i += 2) {
+      TIMED(w, i, batch[j] = malloc(w->size));
+    }
+    pthread_mutex_lock(&outbox->lock);
+    outbox->batches.push_back(batch);
+    pthread_mutex_unlock(&outbox->lock);
+
+    pthread_mutex_lock(&inbox->lock);
+    if (inbox->batches.empty()) {
+      batch = NULL;
+    } else {
+      batch = inbox->batches.back();
+      inbox->batches.pop_back();
+    }
+    pthread_mutex_unlock(&inbox->lock);
+    if (batch != NULL) {
+      for (int j = 0; j < kBatchSize; j++) {
+        TIMED(w, i + 2 * j + 1, free(batch[j]));
+      }
+      free(batch);
+    }
+  }
+}
+
+static void DrainQueues() {
+  for (size_t q = 0; q < queues.size(); q++) {
+    for (size_t b = 0; b < queues[q].batches.size(); b++) {
+      for (int j = 0; j < kBatchSize; j++) {
+        free(queues[q].batches[b][j]);
+      }
+      free(queues[q].batches[b]);
+    }
+    queues[q].batches.clear();
+  }
+}
+
+static void Realloc(Worker* w) {
+  void* p = NULL;
+  size_t size = 8;
+  for (size_t i = 0; i < w->ops; i++) {
+    if (size >= 64 << 10) {
+      free(p);
+      p = NULL;
+      size = 8;
+    }
+    size *= 2;
+    TIMED(w, i, p = realloc(p, size));
+    static_cast<char*>(p)[size - 1] = 0;
+  }
+  free(p);
+}
+
+static void Large(Worker* w) {
+  const int kSlots = 8;
+  void* slots[kSlots] = { NULL };
+  for (size_t i = 0; i < w->ops; i++) {
+    const int slot = w->Random() % kSlots;
+    const size_t size = (256 << 10) + w->Random() % (15 << 18);
+    TIMED(w, i, free(slots[slot]); slots[slot] = malloc(size));
+    *static_cast<char*>(slots[slot]) = 0;
+  }
+  for (int i = 0; i < kSlots; i++) {
+    free(slots[i]);
+  }
+}
+
+static void Memalign(Worker* w) {
+  const int kSlots = 1024;
+  vector<void*> slots(kSlots, static_cast<void*>(NULL));
+  for (size_t i = 0; i < w->ops; i++) {
+    const int slot = w->Random() % kSlots;
+    const size_t alignment = 16 << (w->Random() % 9);
+    const size_t size = 64 << (w->Random() % 8);
+    TIMED(w, i,
+          free(slots[slot]);
+          if (posix_memalign(&slots[slot], alignment, size) != 0) {
+            slots[slot] = NULL;
+          });
+  }
+  for (int i = 0; i < kSlots; i++) {
+    free(slots[i]);
+  }
+}
+
+static void* ShortLivedThread(void* arg) {
+  const size_t size = *static_cast<size_t*>(arg);
+  void* objects[100];
+  for (int i = 0; i < 100; i++) {
+    objects[i] = malloc(size);
+  }
+  for (int i = 0; i < 100; i++) {
+    free(objects[i]);
+  }
+  return NULL;
+}
+
+static void ThreadChurn(Worker* w) {
+  for (size_t i = 0; i < w->ops; i++) {
+    pthread_t thread;
+    TIMED(w, i,
+          pthread_create(&thread, NULL, ShortLivedThread, &w->size);
+          pthread_join(thread, NULL));
+  }
+}
+
+struct Scenario {
+  const char* name;
+  void        (*run)(Worker* w);
+  size_t      sizes[8];         // zero-terminated
+  size_t      ops;              // per thread, at --scale=1
+};
+
+static const Scenario kScenarios[] = {
+  { "churn",    Churn,
+    { 16, 64, 256, 1024, 4096, 16384, 65536, 0 },            4000000 },
+  { "prodcons", ProducerConsumer, { 64, 1024, 0 },           4000000 },
+  { "realloc",  Realloc,          { 64 << 10, 0 },            500000 },
+  { "large",    Large,            { 4 << 20, 0 },              20000 },
+  { "memalign", Memalign,         { 8192, 0 },               1000000 },
+  { "threads",  ThreadChurn,      { 64, 0 },                    2000 },
+};
+
+static void* RunWorker(void* arg) {
+  Worker* w = static_cast<Worker*>(arg);
+  (*w->run)(w);
+  return NULL;
+}
+
+static void Run(const Scenario& s, size_t size, int num_threads, int scale) {
+  vector<Worker> workers(num_threads);
+  queues.resize(num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    workers[i].run = s.run;
+    workers[i].index = i;
+    workers[i].num_threads = num_threads;
+    workers[i].size = size;
+    workers[i].ops = s.ops * scale;
+    workers[i].rnd = i + 1;
+    workers[i].samples.reserve(workers[i].ops / kSampleEvery + kBatchSize);
+  }
+
+  const double start = NowSeconds();
+  const int64 start_cycles = CycleClock::Now();
+  for (int i = 0; i < num_threads; i++) {
+    pthread_create(&workers[i].thread, NULL, RunWorker, &workers[i]);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  DrainQueues();
+  const double seconds = NowSeconds() - start;
+  const double ns_per_cycle = seconds * 1e9 /
+                              (CycleClock::Now() - start_cycles);
+
+  vector<uint32> samples;
+  size_t ops = 0;
+  for (int i = 0; i < num_threads; i++) {
+    samples.insert(samples.end(), workers[i].samples.begin(),
+                   workers[i].samples.end());
+    ops += workers[i].ops;
+  }
+  sort(samples.begin(), samples.end());
+  const double p50 = samples.empty() ? 0 : samples[samples.size() / 2];
+  const double p99 = samples.empty() ? 0 : samples[samples.size() * 99 / 100];
+  printf("%s\t%lu\t%d\t%lu\t%.3f\t%.0f\t%.1f\t%.1f\t%.1f\n",
+         s.name, static_cast<unsigned long>(size), num_threads,
+         static_cast<unsigned long>(ops), seconds, ops / seconds,
+         p50 * ns_per_cycle, p99 * ns_per_cycle, ResidentMB());
+  fflush(stdout);
+  for (int i = 0; i < num_threads; i++) {
+    pthread_mutex_destroy(&queues[i].lock);
+  }
+}
+
+int main(int argc, char** argv) {
+  vector<int> thread_counts;
+  int scale = 1;
+  vector<const char*> names;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--threads=", 10) == 0) {
+      for (const char* p = argv[i] + 10; *p != '\0'; ) {
+        char* end;
+        thread_counts.push_back(strtol(p, &end, 10));
+        if (end == p || thread_counts.back() <= 0) {
+          fprintf(stderr, "Bad thread count list: %s\n", argv[i]);
+          return 1;
+        }
+        p = (*end == ',' ? end + 1 : end);
+      }
+    } else if (strncmp(argv[i], "--scale=", 8) == 0) {
+      scale = atoi(argv[i] + 8);
+    } else {
+      names.push_back(argv[i]);
+    }
+  }
+  if (thread_counts.empty()) {
+    const int kDefaultThreads[] = { 1, 2, 4, 8 };
+    thread_counts.assign(kDefaultThreads, kDefaultThreads + 4);
+  }
+
+  printf("# tcmalloc_bench %s\n", PACKAGE_STRING);
+  printf("scenario\tsize\tthreads\tops\tsecs\tops_per_sec"
+         "\tp50_ns\tp99_ns\trss_mb\n");
+  const int num_scenarios = sizeof(kScenarios) / sizeof(*kScenarios);
+  for (int n = 0; n < num_scenarios; n++) {
+    const Scenario& s = kScenarios[n];
+    bool wanted = names.empty();
+    for (size_t i = 0; i < names.size(); i++) {
+      wanted |= (strcmp(names[i], s.name) == 0);
+    }
+    if (!wanted) continue;
+    for (int i = 0; s.sizes[i] != 0; i++) {
+      for (size_t t = 0; t < thread_counts.size(); t++) {
+        Run(s, s.sizes[i], thread_counts[t], scale);
+      }
+    }
+  }
+  return 0;
+}
@@ -65,6 +65,7 @@
 #include <stdint.h>        // for intptr_t
 #endif
 #include <sys/types.h>     // for size_t
+#include <limits.h>        // for INT_MAX
 #ifdef HAVE_FCNTL_H
 #include <fcntl.h>         // for open; used with mmap-hook test
 #endif
@@ -72,6 +73,9 @@
 #include <sys/mman.h>      // for testing mmap hooks
 #endif
 #include <assert.h>
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include <vector>
 #include <string>
 #include <new>
@@ -79,6 +83,7 @@
 #include "base/simple_mutex.h"
 #include "google/malloc_hook.h"
 #include "google/malloc_extension.h"
+#include "google/malloc_extension_c.h"
 #include "tests/testutil.h"
 
 // Windows doesn't define pvalloc and a few other obsolete unix
@@ -518,6 +523,134 @@ static void TestHugeAllocations(AllocatorState* rnd) {
   inst->ReleaseFreeMemory();
 }
 
+// Objects of TCMALLOC_DIRECT_MMAP_THRESHOLD (64MB by default) or more
+// are mapped for themselves, and unmapped as soon as they are freed
+static void TestDirectMapping() {
+  MallocExtension* inst = MallocExtension::instance();
+  size_t before, during, after;
+  CHECK(inst->GetNumericProperty("generic.heap_size", &before));
+  void* p = malloc(100 << 20);
+  CHECK(p != NULL);
+  memset(p, 0x5a, 100 << 20);
+  CHECK(inst->GetNumericProperty("generic.heap_size", &during));
+  CHECK_GE(during, before + (100 << 20));
+  free(p);
+  CHECK(inst->GetNumericProperty("generic.heap_size", &after));
+  CHECK_EQ(after, before);
+}
+
+// malloc_usable_size(), nallocx() and GetAllocatedSize() all report
+// the bytes actually reserved, and the caller may use every one of them
+static void TestAllocatedSize() {
+#ifndef _WIN32
+  MallocExtension* inst = MallocExtension::instance();
+  static const size_t kSizes[] = { 0, 1, 7, 8, 9, 100, 1000, 4096, 10000,
+                                   32 << 10, 100000, 1 << 20, 70 << 20 };
+  for (int i = 0; i < sizeof(kSizes) / sizeof(*kSizes); i++) {
+    const size_t size = kSizes[i];
+    void* p = malloc(size);
+    const size_t usable = malloc_usable_size(p);
+    CHECK_GE(usable, size);
+    CHECK_EQ(usable, nallocx(size, 0));
+    CHECK_EQ(usable, inst->GetAllocatedSize(p));
+    memset(p, 0x5a, usable);
+    free(p);
+
+    for (int lg = 6; lg <= 13; lg += 7) {
+      void* q = memalign(1 << lg, size);
+      CHECK_EQ(malloc_usable_size(q), nallocx(size, MALLOCX_LG_ALIGN(lg)));
+      free(q);
+    }
+  }
+  CHECK_EQ(malloc_usable_size(NULL), 0);
+#endif
+}
+
+// mallopt() tunes the release rate, the direct-map threshold and the
+// thread cache budget, and mallinfo() reports direct-mapped objects
+static void TestMallopt() {
+#if defined(M_ARENA_MAX) && defined(HAVE_STRUCT_MALLINFO)
+  MallocExtension* inst = MallocExtension::instance();
+  size_t value;
+
+  CHECK(inst->GetNumericProperty("tcmalloc.max_total_thread_cache_bytes",
+                                 &value));
+  const size_t old_budget = value;
+  CHECK_EQ(mallopt(M_ARENA_MAX, 2), 1);
+  CHECK(inst->GetNumericProperty("tcmalloc.max_total_thread_cache_bytes",
+                                 &value));
+  CHECK_EQ(value, 4 << 20);
+  // Too many arenas to multiply out, even with a 32-bit size_t
+  CHECK_EQ(mallopt(M_ARENA_MAX, INT_MAX), 1);
+  CHECK(inst->GetNumericProperty("tcmalloc.max_total_thread_cache_bytes",
+                                 &value));
+  CHECK_EQ(value, 1 << 30);
+  inst->SetNumericProperty("tcmalloc.max_total_thread_cache_bytes",
+                           old_budget);
+
+  const double old_rate = inst->GetMemoryReleaseRate();
+  CHECK_EQ(mallopt(M_TRIM_THRESHOLD, 64 << 10), 1);
+  CHECK_EQ(inst->GetMemoryReleaseRate(), 2.0);
+  CHECK_EQ(mallopt(M_TRIM_THRESHOLD, -1), 1);
+  CHECK_EQ(inst->GetMemoryReleaseRate(), 0.0);
+  inst->SetMemoryReleaseRate(old_rate);
+
+  const struct mallinfo before = mallinfo();
+  CHECK_EQ(mallopt(M_MMAP_THRESHOLD, 1 << 20), 1);
+  void* p = malloc(2 << 20);
+  const struct mallinfo during = mallinfo();
+  CHECK_EQ(during.hblks, before.hblks + 1);
+  CHECK_GE(during.hblkhd, before.hblkhd + (2 << 20));
+  free(p);
+  CHECK_EQ(mallinfo().hblks, before.hblks);
+  CHECK_EQ(mallopt(M_MMAP_THRESHOLD, 64 << 20), 1);
+
+  CHECK_EQ(mallopt(M_MMAP_THRESHOLD, -1), 0);
+  CHECK_EQ(mallopt(12345, 1), 0);
+#endif
+}
+
+// Allocates and frees 1000 objects of 100 bytes and one of 1MB
+static void AllocateAndFree() {
+  void* small[1000];
+  for (int i = 0; i < 1000; i++) small[i] = malloc(100);
+  void* large = malloc(1 << 20);
+  for (int i = 0; i < 1000; i++) free(small[i]);
+  free(large);
+}
+
+#ifdef HAVE_PTHREAD
+static void* AllocateAndFreeInThread(void*) {
+  AllocateAndFree();
+  return NULL;
+}
+#endif
+
+// Each thread's counters see its own allocations only, and count
+// the bytes actually reserved
+static void TestThreadAllocationCounters() {
+  MallocExtension* inst = MallocExtension::instance();
+  size_t allocated_before, freed_before, allocated_after, freed_after;
+  CHECK(inst->GetThreadAllocationCounters(&allocated_before, &freed_before));
+  AllocateAndFree();
+  CHECK(inst->GetThreadAllocationCounters(&allocated_after, &freed_after));
+  const size_t expected = 1000 * nallocx(100, 0) + nallocx(1 << 20, 0);
+  CHECK_EQ(allocated_after - allocated_before, expected);
+  CHECK_EQ(freed_after - freed_before, expected);
+
+#ifdef HAVE_PTHREAD
+  // Starting the thread may allocate a little here, but none of what
+  // the thread does counts.  (RunThread() is no good: it does not
+  // start a thread here.)
+  pthread_t thread;
+  CHECK(pthread_create(&thread, NULL, AllocateAndFreeInThread, NULL) == 0);
+  CHECK(pthread_join(thread, NULL) == 0);
+  CHECK(inst->GetThreadAllocationCounters(&allocated_before, &freed_before));
+  CHECK_LT(allocated_before - allocated_after, expected / 2);
+  CHECK_LT(freed_before - freed_after, expected / 2);
+#endif
+}
+
 static void TestCalloc(size_t n, size_t s, bool ok) {
   char* p = reinterpret_cast<char*>(calloc(n, s));
   if (FLAGS_verbose)
@@ -692,10 +825,15 @@ static void TestAlignmentForSize(int size) {
     CHECK((p % sizeof(void*)) == 0);
     CHECK((p % sizeof(double)) == 0);
 
-    // Must have 16-byte alignment for large enough objects
+    // Must have 16-byte alignment for large enough objects, and for
+    // all of them when built with --enable-16byte-alignment
+#ifdef TCMALLOC_16BYTE_ALIGNMENT
+    CHECK((p % 16) == 0);
+#else
     if (size >= 16) {
       CHECK((p % 16) == 0);
     }
+#endif
   }
   for (int i = 0; i < kNum; i++) {
     free(ptrs[i]);
@@ -884,8 +1022,12 @@ int main(int argc, char** argv) {
     CHECK(p != NULL);  // could not allocate
     free(p);
   }
+  TestDirectMapping();
 
   TestMallocAlignment();
+  TestAllocatedSize();
+  TestMallopt();
+  TestThreadAllocationCounters();
 
   // Check calloc() with various arguments
   fprintf(LOGSTREAM, "Testing calloc\n");
@@ -30,13 +30,18 @@
 // ---
 // Author: Sanjay Ghemawat
 //
-// Check that we do not leak memory when cycling through lots of threads.
+// Check that we do not leak memory when cycling through lots of threads,
+// and that an exiting thread's cache is passed on to the next thread
+// or released.
 
 #include "config_for_unittests.h"
 #include <stdio.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>    // for sleep()
 #endif
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
 #include "base/logging.h"
 #include <google/malloc_extension.h>
 #include "tests/testutil.h"   // for RunThread()
@@ -60,7 +65,61 @@ static void AllocStuff() {
   delete[] objects;
 }
 
+#ifdef HAVE_PTHREAD
+static size_t ThreadCacheBytes() {
+  size_t value;
+  CHECK(MallocExtension::instance()->GetNumericProperty(
+      "tcmalloc.current_total_thread_cache_bytes", &value));
+  return value;
+}
+
+static void* AllocStuffThread(void*) {
+  AllocStuff();
+  return NULL;
+}
+
+// Allocates half as much as AllocStuff(), and reports how far the
+// thread caches shrank meanwhile
+static void* AllocFromDonatedCache(void* arg) {
+  const size_t before = ThreadCacheBytes();
+  void* objects[kNumObjects / 2];
+  for (int i = 0; i < kNumObjects / 2; i++) {
+    objects[i] = malloc(kObjectSize);
+  }
+  const size_t after = ThreadCacheBytes();
+  *static_cast<size_t*>(arg) = (before > after ? before - after : 0);
+  for (int i = 0; i < kNumObjects / 2; i++) {
+    free(objects[i]);
+  }
+  return NULL;
+}
+
+// Real threads, since RunThread() may just call its argument
+static void TestDonation() {
+  pthread_t thread;
+  const size_t before = ThreadCacheBytes();
+  CHECK(pthread_create(&thread, NULL, AllocStuffThread, NULL) == 0);
+  CHECK(pthread_join(thread, NULL) == 0);
+  // The exited thread's cache is kept for the next one...
+  CHECK_GT(ThreadCacheBytes(), before + kObjectSize * kNumObjects / 8);
+
+  // ...which allocates out of it instead of the central cache
+  size_t shrunk;
+  CHECK(pthread_create(&thread, NULL, AllocFromDonatedCache, &shrunk) == 0);
+  CHECK(pthread_join(thread, NULL) == 0);
+  CHECK_GT(shrunk, kObjectSize * kNumObjects / 8);
+
+  // Caches nobody has taken over are given back on request
+  MallocExtension::instance()->ReleaseFreeMemory();
+  CHECK_LT(ThreadCacheBytes(), before + kObjectSize * kNumObjects / 8);
+}
+#endif
+
 int main(int argc, char** argv) {
+#ifdef HAVE_PTHREAD
+  TestDonation();
+#endif
+
   static const int kDisplaySize = 1048576;
   char* display = new char[kDisplaySize];
 
@@ -31,46 +31,48 @@
 // Author: Ken Ashcraft <opensource@google.com>
 
 #include "thread_cache.h"
+#include "base/commandlineflags.h"
+#include "base/cycleclock.h"
+#include "base/sysinfo.h"
 #include "maybe_threads.h"
-
-// Twice the approximate gap between sampling actions.
-// I.e., we take one sample approximately once every
-//      tcmalloc_sample_parameter/2
-// bytes of allocation, i.e., ~ once every 128KB.
-// Must be a prime number.
-#ifdef NO_TCMALLOC_SAMPLES
-DEFINE_int64(tcmalloc_sample_parameter, 0,
-             "Unused: code is compiled with NO_TCMALLOC_SAMPLES");
-static size_t sample_period = 0;
-#else
-DEFINE_int64(tcmalloc_sample_parameter,
-             EnvToInt("TCMALLOC_SAMPLE_PARAMETER", 262147),
-	     "Twice the approximate gap between sampling actions."
-	     " Must be a prime number. Otherwise will be rounded up to a "
-	     " larger prime number");
-static size_t sample_period = EnvToInt("TCMALLOC_SAMPLE_PARAMETER", 262147);
-#endif
-// Protects sample_period above
-static SpinLock sample_period_lock(SpinLock::LINKER_INITIALIZED);
+#include "system-alloc.h"
+
+DEFINE_int64(tcmalloc_idle_thread_cache_ms,
+             EnvToInt64("TCMALLOC_IDLE_THREAD_CACHE_MS", 0),
+             "Drain the caches of threads that have not allocated or freed"
+             " memory for about this many milliseconds, and share their"
+             " part of the overall thread cache budget among the other"
+             " threads.  0 disables this.  Whether it is enabled at all is"
+             " decided at startup, since it adds bookkeeping to every"
+             " malloc and free.  Has no effect where the system cannot"
+             " flush other threads' write buffers (e.g. Windows before"
+             " Vista).");
 
 namespace tcmalloc {
 
-/* The smallest prime > 2^n */
-static unsigned int primes_list[] = {
-	// Small values might cause high rates of sampling
-	// and hence commented out.
-        // 2, 5, 11, 17, 37, 67, 131, 257,
-	// 521, 1031, 2053, 4099, 8209, 16411,
-	32771, 65537, 131101, 262147, 524309, 1048583,
-	2097169, 4194319, 8388617, 16777259, 33554467 };
-
 static bool phinited = false;
 
+// ReclaimIdleCaches() looks at the clock on every kReclaimCheckPeriod'th
+// call to CheckIdleReclaim().
+static const uint32_t kReclaimCheckPeriod = 16;
+
+// CycleClock time at which ReclaimIdleCaches() should next run.  Read
+// and written without locking; a race just means an extra sweep.
+static int64 next_reclaim_cycles = 0;
+
 volatile size_t ThreadCache::per_thread_cache_size_ = kMaxThreadCacheSize;
 size_t ThreadCache::overall_thread_cache_size_ = kDefaultOverallThreadCacheSize;
 PageHeapAllocator<ThreadCache> threadcache_allocator;
 ThreadCache* ThreadCache::thread_heaps_ = NULL;
 int ThreadCache::thread_heap_count_ = 0;
+ThreadCache* ThreadCache::unregistered_heaps_ = NULL;
+ThreadCache* ThreadCache::donated_heaps_ = NULL;
+int ThreadCache::donated_heap_count_ = 0;
+int ThreadCache::idle_heap_count_ = 0;
+uint64_t ThreadCache::reclaimed_bytes_ = 0;
+SpinLock ThreadCache::reclaim_lock_(SpinLock::LINKER_INITIALIZED);
+bool ThreadCache::reclaim_idle_ = false;
+TimedSpinLock ThreadCache::heap_list_lock_(base::LINKER_INITIALIZED);
 #ifdef HAVE_TLS
 __thread ThreadCache* ThreadCache::threadlocal_heap_
 # ifdef HAVE___ATTRIBUTE__
@@ -114,20 +116,27 @@ bool kernel_supports_tls = false;      // be conservative
 
 void ThreadCache::Init(pthread_t tid) {
   size_ = 0;
+  allocated_bytes_ = 0;
+  freed_bytes_ = 0;
   next_ = NULL;
   prev_ = NULL;
   tid_  = tid;
   in_setspecific_ = false;
+  unregistered_next_ = NULL;
+  donated_next_ = NULL;
+  donated_ = false;
+  use_count_ = 0;
+  reclaiming_ = 0;
+  reclaim_seen_ = 1;          // Odd, so the first sweep only looks
+  reclaimed_ = false;
+  reclaim_next_ = NULL;
+  slow_path_count_ = 0;
   for (size_t cl = 0; cl < kNumClasses; ++cl) {
     list_[cl].Init();
   }
 
-  // Initialize RNG -- run it for a bit to get to good values
-  bytes_until_sample_ = 0;
-  rnd_ = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(this));
-  for (int i = 0; i < 100; i++) {
-    PickNextSample(FLAGS_tcmalloc_sample_parameter * 2);
-  }
+  // Initialize RNG -- seeded from our address so threads differ
+  sampler_.Init(static_cast<uint32_t>(reinterpret_cast<uintptr_t>(this)));
 }
 
 void ThreadCache::Cleanup() {
@@ -143,6 +152,7 @@ void ThreadCache::Cleanup() {
 // On success, return the first object for immediate use; otherwise return NULL.
 void* ThreadCache::FetchFromCentralCache(size_t cl, size_t byte_size) {
   void *start, *end;
+  CheckIdleReclaim();
   int fetch_count = Static::central_cache()[cl].RemoveRange(
       &start, &end,
       Static::sizemap()->num_objects_to_move(cl));
@@ -186,6 +196,7 @@ void ThreadCache::Scavenge() {
   // pretty soon and the low-water marks will be high on that call.
   //int64 start = CycleClock::Now();
 
+  CheckIdleReclaim();
   for (int cl = 0; cl < kNumClasses; cl++) {
     FreeList* list = &list_[cl];
     const int lowmark = list->lowwatermark();
@@ -201,51 +212,111 @@ void ThreadCache::Scavenge() {
   //MESSAGE("GC: %.0f ns\n", ct.CyclesToUsec(finish-start)*1000.0);
 }
 
-void ThreadCache::PickNextSample(size_t k) {
-  // Copied from "base/synchronization.cc" (written by Mike Burrows)
-  // Make next "random" number
-  // x^32+x^22+x^2+x^1+1 is a primitive polynomial for random numbers
-  static const uint32_t kPoly = (1 << 22) | (1 << 2) | (1 << 1) | (1 << 0);
-  uint32_t r = rnd_;
-  rnd_ = (r << 1) ^ ((static_cast<int32_t>(r) >> 31) & kPoly);
-
-  // Next point is "rnd_ % (sample_period)".  I.e., average
-  // increment is "sample_period/2".
-  const int flag_value = FLAGS_tcmalloc_sample_parameter;
-  static int last_flag_value = -1;
-
-  if (flag_value != last_flag_value) {
-    SpinLockHolder h(&sample_period_lock);
-    int i;
-    for (i = 0; i < (sizeof(primes_list)/sizeof(primes_list[0]) - 1); i++) {
-      if (primes_list[i] >= flag_value) {
-        break;
-      }
+// Reclaiming idle caches
+// ----------------------
+// The owner of a cache works on it without any locking, so another
+// thread may only drain it while the owner is known to stay away.
+// The owner bumps use_count_ on entry (making it odd) and on exit
+// (making it even again), and on entry checks reclaiming_.  A
+// reclaimer
+//   1. notes use_count_ at each sweep; a heap whose count is even and
+//      unchanged since the previous sweep has been idle in between;
+//   2. sets reclaiming_ on such a heap;
+//   3. calls TCMalloc_FlushProcessWriteBuffers(), so that any owner
+//      that entered before step 2 has made its new use_count_ visible
+//      to us, and any owner that enters later sees reclaiming_;
+//   4. drains the heap only if use_count_ still has the noted value.
+// An owner that sees reclaiming_ steps out (WaitForReclaim()) until
+// the reclaimer releases reclaim_lock_.  This keeps the fast path down
+// to two plain stores and a load; all the expense is on the reclaimer.
+// Programs that do not turn reclaiming on pay only the test of
+// reclaim_idle_.
+
+void ThreadCache::CheckIdleReclaim() {
+  if (reclaimed_) {
+    // We were drained as idle; ask for our share of the budget again
+    TimedSpinLockHolder l(&heap_list_lock_);
+    if (reclaimed_) {
+      reclaimed_ = false;
+      idle_heap_count_--;
+      RecomputeThreadCacheSize();
     }
-    sample_period = primes_list[i];
-    last_flag_value = flag_value;
   }
 
-  bytes_until_sample_ += rnd_ % sample_period;
+  if (!reclaim_idle_) return;
+  if (++slow_path_count_ % kReclaimCheckPeriod != 0) return;
+  const int64 interval_ms = FLAGS_tcmalloc_idle_thread_cache_ms;
+  if (interval_ms <= 0) return;
+  const int64 now = CycleClock::Now();
+  if (now < next_reclaim_cycles) return;
+  next_reclaim_cycles =
+      now + static_cast<int64>(CyclesPerSecond() * interval_ms / 1000);
+  ReclaimIdleCaches();
+}
+
+void ThreadCache::WaitForReclaim() {
+  do {
+    base::subtle::Release_Store(&use_count_, use_count_ + 1);
+    reclaim_lock_.Lock();
+    reclaim_lock_.Unlock();
+    base::subtle::NoBarrier_Store(&use_count_, use_count_ + 1);
+  } while (base::subtle::Acquire_Load(&reclaiming_));
+}
 
-  if (k > (static_cast<size_t>(-1) >> 2)) {
-    // If the user has asked for a huge allocation then it is possible
-    // for the code below to loop infinitely.  Just return (note that
-    // this throws off the sampling accuracy somewhat, but a user who
-    // is allocating more than 1G of memory at a time can live with a
-    // minor inaccuracy in profiling of small allocations, and also
-    // would rather not wait for the loop below to terminate).
+void ThreadCache::ReclaimIdleCaches() {
+  if (!reclaim_lock_.TryLock()) return;   // Somebody else is at it
+
+  // Claim the heaps that have been idle since the last sweep.
+  ThreadCache* claimed = NULL;
+  {
+    TimedSpinLockHolder l(&heap_list_lock_);
+    for (ThreadCache* heap = thread_heaps_; heap != NULL; heap = heap->next_) {
+      const Atomic32 count = base::subtle::NoBarrier_Load(&heap->use_count_);
+      if ((count & 1) == 0 && count == heap->reclaim_seen_ &&
+          !heap->reclaimed_) {
+        base::subtle::NoBarrier_Store(&heap->reclaiming_, 1);
+        heap->reclaim_next_ = claimed;
+        claimed = heap;
+      }
+      heap->reclaim_seen_ = count;
+    }
+  }
+  if (claimed == NULL) {
+    reclaim_lock_.Unlock();
     return;
   }
 
-  while (bytes_until_sample_ < k) {
-    // Increase bytes_until_sample_ by enough average sampling periods
-    // (sample_period >> 1) to allow us to sample past the current
-    // allocation.
-    bytes_until_sample_ += (sample_period >> 1);
+  const bool flushed = TCMalloc_FlushProcessWriteBuffers();
+  uint64_t drained = 0;
+  int newly_idle = 0;
+  ThreadCache* next;
+  for (ThreadCache* heap = claimed; heap != NULL; heap = next) {
+    // Once we clear reclaiming_, the heap may be deleted under us
+    next = heap->reclaim_next_;
+    if (flushed && base::subtle::Acquire_Load(&heap->use_count_) ==
+                   heap->reclaim_seen_) {
+      drained += heap->size_;
+      heap->Cleanup();
+      ASSERT(heap->size_ == 0);
+      TimedSpinLockHolder l(&heap_list_lock_);
+      heap->reclaimed_ = true;
+      newly_idle++;
+    }
+    base::subtle::Release_Store(&heap->reclaiming_, 0);
   }
 
-  bytes_until_sample_ -= k;
+  {
+    TimedSpinLockHolder l(&heap_list_lock_);
+    reclaimed_bytes_ += drained;
+    idle_heap_count_ += newly_idle;
+    RecomputeThreadCacheSize();
+  }
+  reclaim_lock_.Unlock();
+}
+
+uint64_t ThreadCache::reclaimed_bytes() {
+  TimedSpinLockHolder l(&heap_list_lock_);
+  return reclaimed_bytes_;
 }
 
 void ThreadCache::InitModule() {
@@ -255,10 +326,13 @@ void ThreadCache::InitModule() {
   // fine.  We increase the chances of doing such a small allocation
   // by doing one in the constructor of the module_enter_exit_hook
   // object declared below.
-  SpinLockHolder h(Static::pageheap_lock());
+  TimedSpinLockHolder h(Static::pageheap_lock());
   if (!phinited) {
     Static::InitStaticVars();
     threadcache_allocator.Init();
+    // This may run before the static constructor that sets
+    // FLAGS_tcmalloc_idle_thread_cache_ms, so look at the environment.
+    reclaim_idle_ = (EnvToInt64("TCMALLOC_IDLE_THREAD_CACHE_MS", 0) > 0);
     phinited = 1;
   }
 }
@@ -269,10 +343,12 @@ void ThreadCache::InitTSD() {
   tsd_inited_ = true;
 
   // We may have used a fake pthread_t for the main thread.  Fix it.
+  // Such a heap was never registered with pthread_setspecific().
   pthread_t zero;
   memset(&zero, 0, sizeof(zero));
-  SpinLockHolder h(Static::pageheap_lock());
-  for (ThreadCache* h = thread_heaps_; h != NULL; h = h->next_) {
+  TimedSpinLockHolder l(&heap_list_lock_);
+  for (ThreadCache* h = unregistered_heaps_; h != NULL;
+       h = h->unregistered_next_) {
     if (h->tid_ == zero) {
       h->tid_ = pthread_self();
     }
@@ -282,8 +358,9 @@ void ThreadCache::InitTSD() {
 ThreadCache* ThreadCache::CreateCacheIfNecessary() {
   // Initialize per-thread data if necessary
   ThreadCache* heap = NULL;
+  ThreadCache* trimmed = NULL;
   {
-    SpinLockHolder h(Static::pageheap_lock());
+    TimedSpinLockHolder l(&heap_list_lock_);
 
     // Early on in glibc's life, we cannot even call pthread_self()
     pthread_t me;
@@ -293,18 +370,28 @@ ThreadCache* ThreadCache::CreateCacheIfNecessary() {
       me = pthread_self();
     }
 
-    // This may be a recursive malloc call from pthread_setspecific()
+    // This may be a recursive malloc call from pthread_setspecific(),
+    // or we may not have been able to call pthread_setspecific() yet.
     // In that case, the heap for this thread has already been created
-    // and added to the linked list.  So we search for that first.
-    for (ThreadCache* h = thread_heaps_; h != NULL; h = h->next_) {
+    // and is waiting on the unregistered list.  So we search for that
+    // first.
+    for (ThreadCache* h = unregistered_heaps_; h != NULL;
+         h = h->unregistered_next_) {
       if (h->tid_ == me) {
         heap = h;
         break;
       }
     }
 
-    if (heap == NULL) heap = NewHeap(me);
+    if (heap == NULL) {
+      heap = NewHeap(me);
+      heap->unregistered_next_ = unregistered_heaps_;
+      unregistered_heaps_ = heap;
+      // A new heap shrinks everyone's share of the budget
+      trimmed = DetachDonatedHeaps(per_thread_cache_size_);
+    }
   }
+  DeleteDetachedHeaps(trimmed);
 
   // We call pthread_setspecific() outside the lock because it may
   // call malloc() recursively.  We check for the recursive call using
@@ -318,6 +405,16 @@ ThreadCache* ThreadCache::CreateCacheIfNecessary() {
     threadlocal_heap_ = heap;
 #endif
     heap->in_setspecific_ = false;
+
+    // From now on GetThreadHeap() finds the heap
+    TimedSpinLockHolder l(&heap_list_lock_);
+    for (ThreadCache** p = &unregistered_heaps_; *p != NULL;
+         p = &(*p)->unregistered_next_) {
+      if (*p == heap) {
+        *p = heap->unregistered_next_;
+        break;
+      }
+    }
   }
   return heap;
 }
@@ -354,27 +451,100 @@ void ThreadCache::DestroyThreadCache(void* ptr) {
   // Prevent fast path of GetThreadHeap() from returning heap.
   threadlocal_heap_ = NULL;
 #endif
-  DeleteCache(reinterpret_cast<ThreadCache*>(ptr));
+  DonateCache(reinterpret_cast<ThreadCache*>(ptr));
+}
+
+void ThreadCache::DonateCache(ThreadCache* heap) {
+  {
+    TimedSpinLockHolder l(&heap_list_lock_);
+    if (heap->size_ > 0 && donated_heap_count_ < kMaxDonatedHeaps) {
+      heap->donated_next_ = donated_heaps_;
+      donated_heaps_ = heap;
+      heap->donated_ = true;
+      donated_heap_count_++;
+      if (heap->reclaimed_) {
+        // Drained, and refilled by the fast path since; it holds
+        // memory again, so it takes a share of the budget
+        heap->reclaimed_ = false;
+        idle_heap_count_--;
+      }
+      RecomputeThreadCacheSize();
+      return;
+    }
+  }
+  DeleteCache(heap);
+}
+
+void ThreadCache::ReleaseDonatedCaches() {
+  ThreadCache* list;
+  {
+    TimedSpinLockHolder l(&heap_list_lock_);
+    list = DetachDonatedHeaps(0);
+  }
+  DeleteDetachedHeaps(list);
+}
+
+ThreadCache* ThreadCache::DetachDonatedHeaps(size_t limit) {
+  ThreadCache* detached = NULL;
+  ThreadCache** p = &donated_heaps_;
+  while (*p != NULL) {
+    ThreadCache* heap = *p;
+    // Nobody owns the heap, so size_ only changes if a reclaimer
+    // drains it; reading it racily just means we may miss that.
+    if (heap->size_ > limit) {
+      *p = heap->donated_next_;
+      donated_heap_count_--;
+      heap->donated_ = false;
+      heap->donated_next_ = detached;
+      detached = heap;
+    } else {
+      p = &heap->donated_next_;
+    }
+  }
+  return detached;
+}
+
+void ThreadCache::DeleteDetachedHeaps(ThreadCache* list) {
+  ThreadCache* next;
+  for (ThreadCache* heap = list; heap != NULL; heap = next) {
+    next = heap->donated_next_;
+    DeleteCache(heap);
+  }
 }
 
 void ThreadCache::DeleteCache(ThreadCache* heap) {
   // Remove all memory from heap
+  heap->BeginUse();
   heap->Cleanup();
-
-  // Remove from linked list
-  SpinLockHolder h(Static::pageheap_lock());
-  if (heap->next_ != NULL) heap->next_->prev_ = heap->prev_;
-  if (heap->prev_ != NULL) heap->prev_->next_ = heap->next_;
-  if (thread_heaps_ == heap) thread_heaps_ = heap->next_;
-  thread_heap_count_--;
-  RecomputeThreadCacheSize();
-
-  threadcache_allocator.Delete(heap);
+  heap->EndUse();
+
+  // Remove from linked list, once no reclaimer is looking at the heap
+  while (true) {
+    {
+      TimedSpinLockHolder l(&heap_list_lock_);
+      if (!base::subtle::Acquire_Load(&heap->reclaiming_)) {
+        if (heap->next_ != NULL) heap->next_->prev_ = heap->prev_;
+        if (heap->prev_ != NULL) heap->prev_->next_ = heap->next_;
+        if (thread_heaps_ == heap) thread_heaps_ = heap->next_;
+        thread_heap_count_--;
+        if (heap->reclaimed_) idle_heap_count_--;
+        RecomputeThreadCacheSize();
+
+        threadcache_allocator.Delete(heap);
+        return;
+      }
+    }
+    reclaim_lock_.Lock();
+    reclaim_lock_.Unlock();
+  }
 }
 
 void ThreadCache::RecomputeThreadCacheSize() {
-  // Divide available space across threads
-  int n = thread_heap_count_ > 0 ? thread_heap_count_ : 1;
+  // Divide available space across threads, leaving out idle ones.  The
+  // heaps of exited threads keep a share, since they hold on to their
+  // contents.
+  const int active = thread_heap_count_ - idle_heap_count_;
+  int n = active > 0 ? active : 1;
   size_t space = overall_thread_cache_size_ / n;
 
   // Limit to allowed range
@@ -395,6 +565,10 @@ void ThreadCache::Print() const {
 }
 
 void ThreadCache::GetThreadStats(uint64_t* total_bytes, uint64_t* class_count) {
+  // The sizes are read without any synchronization with the owning
+  // threads, so the result is approximate; but the heaps themselves
+  // cannot go away while we hold heap_list_lock_.
+  TimedSpinLockHolder l(&heap_list_lock_);
   for (ThreadCache* h = thread_heaps_; h != NULL; h = h->next_) {
     *total_bytes += h->Size();
     if (class_count) {
@@ -410,8 +584,14 @@ void ThreadCache::set_overall_thread_cache_size(size_t new_size) {
   if (new_size < kMinThreadCacheSize) new_size = kMinThreadCacheSize;
   if (new_size > (1<<30)) new_size = (1<<30);     // Limit to 1GB
 
-  overall_thread_cache_size_ = new_size;
-  ThreadCache::RecomputeThreadCacheSize();
+  ThreadCache* trimmed;
+  {
+    TimedSpinLockHolder l(&heap_list_lock_);
+    overall_thread_cache_size_ = new_size;
+    ThreadCache::RecomputeThreadCacheSize();
+    trimmed = DetachDonatedHeaps(per_thread_cache_size_);
+  }
+  DeleteDetachedHeaps(trimmed);
 }
 
 }  // namespace tcmalloc
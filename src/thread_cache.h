@@ -34,11 +34,16 @@
 #define TCMALLOC_THREAD_CACHE_H_
 
 #include "config.h"
+#include "base/atomicops.h"
+#include "base/spinlock.h"
 #include "common.h"
 #include "linked_list.h"
 #include "maybe_threads.h"
+#include "memory_pressure.h"
 #include "page_heap_allocator.h"
+#include "sampler.h"
 #include "static_vars.h"
+#include "timed_spinlock.h"
 
 namespace tcmalloc {
 
@@ -72,9 +77,26 @@ class ThreadCache {
   // Total byte size in cache
   size_t Size() const { return size_; }
 
+  // Bytes this thread has allocated and freed so far, counting whole
+  // size classes and spans.  Only the owning thread updates them, so
+  // they are plain, wrapping counters.
+  size_t allocated_bytes() const { return allocated_bytes_; }
+  size_t freed_bytes() const { return freed_bytes_; }
+  void RecordAllocatedBytes(size_t bytes) { allocated_bytes_ += bytes; }
+  void RecordFreedBytes(size_t bytes) { freed_bytes_ += bytes; }
+
   void* Allocate(size_t size);
   void Deallocate(void* ptr, size_t size_class);
 
+  // The common cases of Allocate() and Deallocate(), for callers that
+  // inline them (see tcmalloc-inl.h).  TryAllocate() returns NULL if
+  // the free list is empty or, when "sampling" is true, if this
+  // allocation is due to be sampled.  TryDeallocate() returns false if
+  // the free list or the cache is full.  Either way nothing changes,
+  // and the caller goes through malloc() or free() instead.
+  void* TryAllocate(size_t size, bool sampling);
+  bool TryDeallocate(void* ptr, size_t size_class);
+
   void Scavenge();
   void Print() const;
 
@@ -82,9 +104,6 @@ class ThreadCache {
   // should be sampled
   bool SampleAllocation(size_t k);
 
-  // Pick next sampling point
-  void PickNextSample(size_t k);
-
   static void         InitModule();
   static void         InitTSD();
   static ThreadCache* GetThreadHeap();
@@ -92,28 +111,138 @@ class ThreadCache {
   static ThreadCache* GetCacheIfPresent();
   static ThreadCache* CreateCacheIfNecessary();
   static void         DeleteCache(ThreadCache* heap);
+
+  // Called when the thread that owns "heap" exits.  Keeps a populated
+  // heap, contents and all, for the next thread that needs one,
+  // unless kMaxDonatedHeaps heaps are waiting already; otherwise the
+  // same as DeleteCache().
+  static void         DonateCache(ThreadCache* heap);
+
+  // Delete the heaps of exited threads that nobody has taken over,
+  // giving their contents back to the central cache.
+  static void         ReleaseDonatedCaches();
   static void         BecomeIdle();
   static void         RecomputeThreadCacheSize();
 
+  // Drain the caches of threads that have not allocated or freed
+  // anything since the previous call, and stop counting them when
+  // dividing up the overall thread cache budget.  The calling thread's
+  // own cache is never drained.  Called periodically from the slow
+  // paths of Allocate() and Deallocate(), every
+  // FLAGS_tcmalloc_idle_thread_cache_ms milliseconds at most, if that
+  // flag was positive when the module was initialized.
+  static void         ReclaimIdleCaches();
+
+  // Total bytes drained from idle thread caches so far.
+  static uint64_t reclaimed_bytes();
+
   // Return the number of thread heaps in use.
   static inline int HeapsInUse();
 
+  // The lock behind thread creation and exit, for its hold histogram
+  static const TimedSpinLock* heap_list_lock() { return &heap_list_lock_; }
+
   // Writes to total_bytes the total number of bytes used by all thread heaps.
   // class_count must be an array of size kNumClasses.  Writes the number of
   // items on the corresponding freelist.  class_count may be NULL.
   // The storage of both parameters must be zero intialized.
-  // Requires Static::pageheap_lock is held.
+  // Does not need Static::pageheap_lock.
   static void GetThreadStats(uint64_t* total_bytes, uint64_t* class_count);
 
   // Sets the total thread cache size to new_size, recomputing the
   // individual thread cache sizes as necessary.
-  // REQUIRES: Static::pageheap lock is held.
   static void set_overall_thread_cache_size(size_t new_size);
   static size_t overall_thread_cache_size() {
     return overall_thread_cache_size_;
   }
 
+  // Default bound on the total amount of thread caches
+  static const size_t kDefaultOverallThreadCacheSize = 16 << 20;
+
+  // Lower and upper bounds on the per-thread cache sizes
+  static const size_t kMinThreadCacheSize = kMaxSize * 2;
+  static const size_t kMaxThreadCacheSize = 2 << 20;
+
  private:
+#ifdef TCMALLOC_ARRAY_FREELISTS
+  // Keeps the free objects of a class in an array, used as a stack,
+  // instead of a list linked through the objects themselves.  Push()
+  // and Pop() then never touch the freed memory, which is often no
+  // longer in the CPU caches.  Links are only written (and read) when
+  // whole batches move to and from the central cache, which works in
+  // linked chains.  This costs kNumClasses * kMaxFreeListLength
+  // pointers per thread.  Enabled by configure --enable-array-freelists.
+  class FreeList {
+   private:
+    uint32_t length_;     // Current length
+    uint32_t lowater_;    // Low water mark for list length
+    // Deallocate() pushes before it trims a full list, so there is
+    // room for one more than kMaxFreeListLength.
+    void*    slots_[kMaxFreeListLength + 1];
+
+   public:
+    void Init() {
+      length_ = 0;
+      lowater_ = 0;
+    }
+
+    // Return current length of list
+    size_t length() const {
+      return length_;
+    }
+
+    // Is list empty?
+    bool empty() const {
+      return length_ == 0;
+    }
+
+    // Low-water mark management
+    int lowwatermark() const { return lowater_; }
+    void clear_lowwatermark() { lowater_ = length_; }
+
+    void Push(void* ptr) {
+      ASSERT(length_ <= kMaxFreeListLength);
+      slots_[length_++] = ptr;
+    }
+
+    void* Pop() {
+      ASSERT(length_ > 0);
+      length_--;
+      if (length_ < lowater_) lowater_ = length_;
+      return slots_[length_];
+    }
+
+    // Pop() hands out "start" first, as it would from a linked list
+    void PushRange(int N, void *start, void *end) {
+      ASSERT(length_ + N <= kMaxFreeListLength + 1);
+      void** slot = &slots_[length_ + N - 1];
+      for (int i = 0; i < N; i++) {
+        *slot-- = start;
+        start = SLL_Next(start);
+      }
+      length_ += N;
+    }
+
+    // Links the N most recently pushed objects into a chain, most
+    // recent first, as SLL_PopRange() would.
+    void PopRange(int N, void **start, void **end) {
+      ASSERT(length_ >= N);
+      if (N == 0) {
+        *start = *end = NULL;
+        return;
+      }
+      void** top = &slots_[length_ - 1];
+      *start = *top;
+      for (int i = 1; i < N; i++) {
+        SLL_SetNext(top[1 - i], top[-i]);
+      }
+      *end = top[1 - N];
+      SLL_SetNext(*end, NULL);
+      length_ -= N;
+      if (length_ < lowater_) lowater_ = length_;
+    }
+  };
+#else
   class FreeList {
    private:
     void*    list_;       // Linked list of nodes
@@ -159,7 +288,11 @@ class ThreadCache {
       ASSERT(list_ != NULL);
       length_--;
       if (length_ < lowater_) lowater_ = length_;
-      return SLL_Pop(&list_);
+      void* result = SLL_Pop(&list_);
+      // The next Pop() has to read the link stored in the new head,
+      // which is often cold; start fetching it now.
+      SLL_Prefetch(list_);
+      return result;
     }
 
     void PushRange(int N, void *start, void *end) {
@@ -174,13 +307,7 @@ class ThreadCache {
       if (length_ < lowater_) lowater_ = length_;
     }
   };
-
-  // Default bound on the total amount of thread caches
-  static const size_t kDefaultOverallThreadCacheSize = 16 << 20;
-
-  // Lower and upper bounds on the per-thread cache sizes
-  static const size_t kMinThreadCacheSize = kMaxSize * 2;
-  static const size_t kMaxThreadCacheSize = 2 << 20;
+#endif  // TCMALLOC_ARRAY_FREELISTS
 
   // Gets and returns an object from the central cache, and, if possible,
   // also adds some objects of that size class to this thread cache.
@@ -189,6 +316,27 @@ class ThreadCache {
   // Releases N items from this thread cache.  Returns size_.
   size_t ReleaseToCentralCache(FreeList* src, size_t cl, int N);
 
+  // The owning thread brackets all its work on the cache with these,
+  // so that ReclaimIdleCaches() can tell whether the cache is busy.
+  // See thread_cache.cc for the protocol.
+  void BeginUse() {
+    if (!reclaim_idle_) return;
+    base::subtle::NoBarrier_Store(&use_count_, use_count_ + 1);
+    if (base::subtle::Acquire_Load(&reclaiming_)) WaitForReclaim();
+  }
+  void EndUse() {
+    if (!reclaim_idle_) return;
+    base::subtle::Release_Store(&use_count_, use_count_ + 1);
+  }
+
+  // Called by BeginUse() when a reclaimer has claimed this cache.
+  // Returns once the reclaimer is done with it.
+  void WaitForReclaim();
+
+  // If this cache was drained as idle, count it as active again.
+  // Also runs ReclaimIdleCaches() if it is time to.
+  void CheckIdleReclaim();
+
   // If TLS is available, we also store a copy of the per-thread object
   // in a __thread variable since __thread variables are faster to read
   // than pthread_getspecific().  We still need pthread_setspecific()
@@ -217,15 +365,57 @@ class ThreadCache {
   static bool tsd_inited_;
   static pthread_key_t heap_key_;
 
-  // Linked list of heap objects.  Protected by Static::pageheap_lock.
+  // heap_list_lock_ protects the bookkeeping below: the list of heap
+  // objects, the counts and budget that go with it, and
+  // threadcache_allocator.  It is only ever held for a few steps, and
+  // the only lock taken under it is the metadata allocator's, so
+  // threads come and go without touching Static::pageheap_lock.
+  static TimedSpinLock heap_list_lock_;
   static ThreadCache* thread_heaps_;
   static int thread_heap_count_;
 
-  // Overall thread cache size.  Protected by Static::pageheap_lock.
+  // Heaps that their threads cannot find with GetThreadHeap() yet,
+  // because pthread_setspecific() is running (and may call malloc()
+  // itself) or has not been called yet.  Linked through
+  // unregistered_next_.  There are only ever a handful of these, so
+  // CreateCacheIfNecessary() can look its thread's heap up here
+  // instead of searching all of thread_heaps_.
+  static ThreadCache* unregistered_heaps_;
+
+  // Heaps left behind by exited threads, linked through donated_next_.
+  // They stay in thread_heaps_ and keep their share of the overall
+  // budget.  When the shares shrink, those holding more than a share
+  // are deleted (see DetachDonatedHeaps()), as are all of them on
+  // ReleaseDonatedCaches().  One drained by ReclaimIdleCaches() counts
+  // as idle, like any other.
+  static const int kMaxDonatedHeaps = 8;
+  static ThreadCache* donated_heaps_;
+  static int donated_heap_count_;
+
+  // Number of heaps in thread_heaps_ that were drained by
+  // ReclaimIdleCaches() and have not been used since.  These do not
+  // get a share of the overall budget.
+  static int idle_heap_count_;
+
+  // Bytes drained by ReclaimIdleCaches().  Protected by
+  // heap_list_lock_.
+  static uint64_t reclaimed_bytes_;
+
+  // Held by ReclaimIdleCaches() while it runs.
+  static SpinLock reclaim_lock_;
+
+  // Whether idle caches are reclaimed at all, i.e. whether owners
+  // bracket their work with BeginUse() and EndUse().  Set once, from
+  // $TCMALLOC_IDLE_THREAD_CACHE_MS, by InitModule(): turning the
+  // bookkeeping on later would let a reclaimer drain a cache whose
+  // owner is in the middle of using it without having said so.
+  static bool reclaim_idle_;
+
+  // Overall thread cache size.  Protected by heap_list_lock_.
   static size_t overall_thread_cache_size_;
 
   // Global per-thread cache size.  Writes are protected by
-  // Static::pageheap_lock.  Reads are done without any locking, which should be
+  // heap_list_lock_.  Reads are done without any locking, which should be
   // fine as long as size_t can be written atomically and we don't place
   // invariants between this variable and other pieces of state.
   static volatile size_t per_thread_cache_size_;
@@ -236,15 +426,41 @@ class ThreadCache {
   // cause cache conflicts.
 
   // We sample allocations, biased by the size of the allocation
-  size_t        bytes_until_sample_;    // Bytes until we sample next
-  uint32_t      rnd_;                   // Cheap random number generator
+  Sampler       sampler_;               // A sampler
 
   size_t        size_;                  // Combined size of data
+  size_t        allocated_bytes_;       // See allocated_bytes()
+  size_t        freed_bytes_;           // See freed_bytes()
   pthread_t     tid_;                   // Which thread owns it
   FreeList      list_[kNumClasses];     // Array indexed by size-class
   bool          in_setspecific_;        // In call to pthread_setspecific?
-
-  // Allocate a new heap. REQUIRES: Static::pageheap_lock is held.
+  ThreadCache*  unregistered_next_;     // Next in unregistered_heaps_
+  ThreadCache*  donated_next_;          // Next in donated_heaps_
+  bool          donated_;               // On donated_heaps_?
+
+  // State for ReclaimIdleCaches().  use_count_ is odd while the owner
+  // is working on the cache; only the owner writes it.  reclaiming_
+  // is set by a reclaimer that wants to drain the cache.
+  // reclaim_seen_ and reclaim_next_ belong to whoever holds
+  // reclaim_lock_, and reclaimed_ is protected by heap_list_lock_.
+  volatile Atomic32 use_count_;
+  volatile Atomic32 reclaiming_;
+  Atomic32      reclaim_seen_;          // use_count_ at the last sweep
+  bool          reclaimed_;             // Drained, and not used since?
+  ThreadCache*  reclaim_next_;          // Next heap for the reclaimer
+  uint32_t      slow_path_count_;       // Calls to CheckIdleReclaim()
+
+  // Take the donated heaps holding more than "limit" bytes off
+  // donated_heaps_, and return them linked through donated_next_.
+  // REQUIRES: heap_list_lock_ is held.
+  static ThreadCache* DetachDonatedHeaps(size_t limit);
+
+  // Delete the heaps returned by DetachDonatedHeaps().  Must not be
+  // called with heap_list_lock_ held.
+  static void DeleteDetachedHeaps(ThreadCache* list);
+
+  // Allocate a new heap, or take over a donated one.
+  // REQUIRES: heap_list_lock_ is held.
   static inline ThreadCache* NewHeap(pthread_t tid);
 
   // Use only as pthread thread-specific destructor function.
@@ -262,13 +478,7 @@ inline int ThreadCache::HeapsInUse() {
 }
 
 inline bool ThreadCache::SampleAllocation(size_t k) {
-  if (bytes_until_sample_ < k) {
-    PickNextSample(k);
-    return true;
-  } else {
-    bytes_until_sample_ -= k;
-    return false;
-  }
+  return sampler_.SampleAllocation(k);
 }
 
 inline void* ThreadCache::Allocate(size_t size) {
@@ -276,18 +486,64 @@ inline void* ThreadCache::Allocate(size_t size) {
   const size_t cl = Static::sizemap()->SizeClass(size);
   const size_t alloc_size = Static::sizemap()->ByteSizeForClass(cl);
   FreeList* list = &list_[cl];
+  BeginUse();
+  void* result;
   if (list->empty()) {
-    return FetchFromCentralCache(cl, alloc_size);
+    result = FetchFromCentralCache(cl, alloc_size);
+    if (result != NULL) allocated_bytes_ += alloc_size;
+    EndUse();
+    // The central cache may have grown the heap
+    PollMemoryPressure();
+    return result;
   }
   size_ -= alloc_size;
-  return list->Pop();
+  allocated_bytes_ += alloc_size;
+  result = list->Pop();
+  EndUse();
+  return result;
+}
+
+inline void* ThreadCache::TryAllocate(size_t size, bool sampling) {
+  ASSERT(size <= kMaxSize);
+  const size_t cl = Static::sizemap()->SizeClass(size);
+  FreeList* list = &list_[cl];
+  void* result = NULL;
+  BeginUse();
+  if (!list->empty() && (!sampling || sampler_.SkipSample(size))) {
+    const size_t alloc_size = Static::sizemap()->ByteSizeForClass(cl);
+    size_ -= alloc_size;
+    allocated_bytes_ += alloc_size;
+    result = list->Pop();
+  }
+  EndUse();
+  return result;
+}
+
+inline bool ThreadCache::TryDeallocate(void* ptr, size_t cl) {
+  FreeList* list = &list_[cl];
+  const size_t byte_size = Static::sizemap()->ByteSizeForClass(cl);
+  BeginUse();
+  // The same limits as the "uncommon" branch of Deallocate()
+  const bool fits =
+      (list->length() < static_cast<size_t>(kMaxFreeListLength) &&
+       size_ + byte_size < per_thread_cache_size_);
+  if (fits) {
+    size_ += byte_size;
+    freed_bytes_ += byte_size;
+    list->Push(ptr);
+  }
+  EndUse();
+  return fits;
 }
 
 inline void ThreadCache::Deallocate(void* ptr, size_t cl) {
+  BeginUse();
   FreeList* list = &list_[cl];
   ssize_t list_headroom =
       static_cast<ssize_t>(kMaxFreeListLength - 1) - list->length();
-  size_ += Static::sizemap()->ByteSizeForClass(cl);
+  const size_t byte_size = Static::sizemap()->ByteSizeForClass(cl);
+  size_ += byte_size;
+  freed_bytes_ += byte_size;
   size_t cache_size = size_;
   ssize_t size_headroom = per_thread_cache_size_ - cache_size - 1;
   list->Push(ptr);
@@ -301,10 +557,30 @@ inline void ThreadCache::Deallocate(void* ptr, size_t cl) {
           list, cl, Static::sizemap()->num_objects_to_move(cl));
     }
     if (cache_size >= per_thread_cache_size_) Scavenge();
+    EndUse();
+    // Spans may have gone back to the page heap, and its scavenger
+    PollMemoryPressure();
+    return;
   }
+  EndUse();
 }
 
 inline ThreadCache* ThreadCache::NewHeap(pthread_t tid) {
+  if (donated_heaps_ != NULL) {
+    // Take over the heap of an exited thread.  It is already on the
+    // list, and if a reclaimer is draining it, BeginUse() will wait.
+    ThreadCache* heap = donated_heaps_;
+    donated_heaps_ = heap->donated_next_;
+    donated_heap_count_--;
+    heap->donated_ = false;
+    heap->tid_ = tid;
+    heap->in_setspecific_ = false;
+    heap->allocated_bytes_ = 0;       // The counters are per thread
+    heap->freed_bytes_ = 0;
+    RecomputeThreadCacheSize();
+    return heap;
+  }
+
   // Create the heap and add it to the linked list
   ThreadCache *heap = threadcache_allocator.New();
   heap->Init(tid);
@@ -0,0 +1,72 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Lock hold histograms; see timed_spinlock.h.
+
+#include "config.h"
+#include "timed_spinlock.h"
+#include "common.h"
+
+DEFINE_bool(tcmalloc_lock_hold_histogram,
+            EnvToBool("TCMALLOC_LOCK_HOLD_HISTOGRAM", false),
+            "Keep a histogram of how long tcmalloc's process-wide locks"
+            " are held, and print it with the other statistics.  Each"
+            " acquisition of those locks then reads the cycle counter"
+            " twice.");
+
+namespace tcmalloc {
+
+void LockHoldHistogram::Record(int64 cycles) {
+  const int bucket = (cycles > 0
+                      ? FineHistogramBucket(cycles) >> kHistogramSubBits
+                      : 0);
+  counts[bucket]++;
+}
+
+void TimedSpinLock::DumpHoldHistogram(TCMalloc_Printer* out,
+                                      const char* name) const {
+  uint64_t total = 0;
+  for (int i = 0; i < LockHoldHistogram::kBuckets; i++) {
+    total += histogram_.counts[i];
+  }
+  if (total == 0) return;
+
+  out->printf("%s held %" PRIu64 " times:\n", name, total);
+  uint64_t cumulative = 0;
+  for (int i = 0; i < LockHoldHistogram::kBuckets; i++) {
+    const uint64_t count = histogram_.counts[i];
+    if (count == 0) continue;
+    cumulative += count;
+    out->printf("  < 2^%-2d cycles: %10" PRIu64 " (%5.1f%% cum)\n",
+                i + 1, count, cumulative * 100.0 / total);
+  }
+}
+
+}  // namespace tcmalloc
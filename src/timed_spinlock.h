@@ -0,0 +1,111 @@
+// Copyright (c) 2008, Google Inc.
+// All rights reserved.
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// ---
+// Spinlocks that can keep a histogram of how long they are held.
+//
+// tcmalloc's process-wide locks (the page heap lock, the sample lock
+// and the thread cache list lock) are TimedSpinLocks.  With
+// TCMALLOC_LOCK_HOLD_HISTOGRAM set, each of them records how many CPU
+// cycles every critical section took, and the histograms show up in
+// MallocExtension::GetStats().  That tells which lock serializes
+// threads, and for how long.  Otherwise the only cost is a test of the
+// flag on each acquisition.
+
+#ifndef TCMALLOC_TIMED_SPINLOCK_H_
+#define TCMALLOC_TIMED_SPINLOCK_H_
+
+#include "config.h"
+#ifdef HAVE_STDINT_H
+#include <stdint.h>
+#endif
+#include "base/basictypes.h"
+#include "base/commandlineflags.h"
+#include "base/cycleclock.h"
+#include "base/spinlock.h"
+#include "internal_logging.h"
+
+DECLARE_bool(tcmalloc_lock_hold_histogram);
+
+namespace tcmalloc {
+
+// Bucket i counts the critical sections that took [2^i, 2^(i+1))
+// cycles; bucket 0 also gets the ones that took less than a cycle.
+struct LockHoldHistogram {
+  static const int kBuckets = 64;
+  uint64_t counts[kBuckets];
+
+  void Record(int64 cycles);
+};
+
+class TimedSpinLock {
+ public:
+  // Like SpinLock, these are only used as linker initialized statics
+  explicit TimedSpinLock(base::LinkerInitialized x) : lock_(x) { }
+
+  void Lock() {
+    lock_.Lock();
+    start_ = (FLAGS_tcmalloc_lock_hold_histogram ? CycleClock::Now() : 0);
+  }
+
+  void Unlock() {
+    if (start_ != 0) histogram_.Record(CycleClock::Now() - start_);
+    lock_.Unlock();
+  }
+
+  bool IsHeld() const { return lock_.IsHeld(); }
+
+  // Prints the histogram, unless it is empty.  The counts are read
+  // without the lock, so a section ending meanwhile may be missed.
+  void DumpHoldHistogram(TCMalloc_Printer* out, const char* name) const;
+
+ private:
+  SpinLock lock_;
+  int64 start_;                 // When the holder got the lock, or 0
+  LockHoldHistogram histogram_; // Written by the holder only
+
+  DISALLOW_EVIL_CONSTRUCTORS(TimedSpinLock);
+};
+
+class TimedSpinLockHolder {
+ public:
+  explicit TimedSpinLockHolder(TimedSpinLock* l) : lock_(l) { l->Lock(); }
+  ~TimedSpinLockHolder() { lock_->Unlock(); }
+
+ private:
+  TimedSpinLock* lock_;
+
+  DISALLOW_EVIL_CONSTRUCTORS(TimedSpinLockHolder);
+};
+// Catch bug where variable name is omitted, e.g. TimedSpinLockHolder (&l);
+#define TimedSpinLockHolder(x) COMPILE_ASSERT(0, timed_lock_decl_missing_var_name)
+
+}  // namespace tcmalloc
+
+#endif  // TCMALLOC_TIMED_SPINLOCK_H_
@@ -740,7 +740,7 @@ template<int T>
 size_t LibcInfoWithPatchFunctions<T>::Perftools__msize(void* ptr) __THROW {
   // Get the size of the old entry
   const PageID p = reinterpret_cast<uintptr_t>(ptr) >> kPageShift;
-  size_t cl = Static::pageheap()->GetSizeClassIfCached(p);
+  size_t cl = Static::pageheap()->GetSizeClass(p);
   Span *span = NULL;
   size_t old_size;
   if (cl == 0) {
@@ -751,7 +751,6 @@ size_t LibcInfoWithPatchFunctions<T>::Perftools__msize(void* ptr) __THROW {
       return ((size_t (*)(void*))origstub_fn_[k_Msize])(ptr);
     }
     cl = span->sizeclass;
-    Static::pageheap()->CacheSizeClass(p, cl);
   }
   if (cl != 0) {
     old_size = Static::sizemap()->ByteSizeForClass(cl);
@@ -225,6 +225,44 @@ void TCMalloc_SystemRelease(void* start, size_t length) {
   // TODO(csilvers): should I be calling VirtualFree here?
 }
 
+void* TCMalloc_DirectMap(size_t bytes, size_t alignment) {
+  // VirtualAlloc() hands out whole allocation granules (64K), which
+  // meets any alignment the page heap asks for; but check, since we
+  // cannot trim the result the way TCMalloc_SystemAlloc() does and
+  // still give it back with MEM_RELEASE.
+  void* result = VirtualAlloc(0, bytes, MEM_COMMIT|MEM_RESERVE,
+                              PAGE_READWRITE);
+  if (result == NULL) return NULL;
+  if ((reinterpret_cast<uintptr_t>(result) & (alignment - 1)) != 0) {
+    VirtualFree(result, 0, MEM_RELEASE);
+    return NULL;
+  }
+  return result;
+}
+
+void TCMalloc_DirectUnmap(void* start, size_t bytes) {
+  VirtualFree(start, 0, MEM_RELEASE);
+}
+
+bool TCMalloc_FlushProcessWriteBuffers() {
+  // FlushProcessWriteBuffers() first appeared in Vista, so look it up
+  // rather than link against it.  Earlier versions have no equivalent.
+  typedef VOID (WINAPI *FlushFn)(VOID);
+  static FlushFn flush = NULL;
+  static bool looked_up = false;
+  if (!looked_up) {
+    HMODULE kernel32 = ::GetModuleHandleA("kernel32");
+    if (kernel32 != NULL) {
+      flush = reinterpret_cast<FlushFn>(
+          ::GetProcAddress(kernel32, "FlushProcessWriteBuffers"));
+    }
+    looked_up = true;
+  }
+  if (flush == NULL) return false;
+  (*flush)();
+  return true;
+}
+
 bool RegisterSystemAllocator(SysAllocator *allocator, int priority) {
   return false;   // we don't allow registration on windows, right now
 }